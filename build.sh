@@ -49,14 +49,20 @@ build() {
     fi
     local CPPFLAGS="${CPPFLAGS} -I${CONF_LEVELDB_INCLUDEPATH} -D_GIT_COMMIT=${GIT_COMMIT}"
     local lvldb="-L${CONF_LEVELDB_LIBPATH} -lleveldb"
-    local common="$BUILD/progress_reporting.o $BUILD/task_processing.o $BUILD/persistent_db.o"
+    local common="$BUILD/progress_reporting.o $BUILD/task_processing.o $BUILD/parity_container.o $BUILD/persistent_db.o $BUILD/db_snapshot.o $BUILD/chunk_key.o $BUILD/stripe.o $BUILD/parity_writer.o"
 
     _mpicc progress_reporting.o -c common/progress_reporting.c
     _mpicc task_processing.o    -c common/task_processing.c
+    _mpicc parity_container.o   -c common/parity_container.c
     _mpicc persistent_db.o      -c common/persistent_db.c
+    _mpicc db_snapshot.o        -c common/db_snapshot.c
+    _mpicc chunk_key.o          -c common/chunk_key.c
+    _mpicc stripe.o             -c common/stripe.c
+    _mpicc parity_writer.o      -c common/parity_writer.c
 
-    _mpicc bp-parity-gen     gen/main.c gen/file_info_hash.c gen/assign_lanes.c $common -lm $lvldb -DMAX_WORKITEMS=$MAX_ITEMS
-    _mpicc bp-parity-rebuild rebuild/main.c                                     $common     $lvldb
+    _mpicc bp-parity-gen     gen/main.c gen/file_info_hash.c gen/spill_run.c gen/wire_format.c gen/task_scheduler.c gen/size_sort.c $common -lm $lvldb
+    _mpicc bp-parity-rebuild rebuild/main.c                                                                                         $common     $lvldb
+    _mpicc bp-db-migrate     migrate/main.c $BUILD/persistent_db.o $BUILD/db_snapshot.o $BUILD/chunk_key.o $lvldb
     )
 
     cp "src/beegfs-parity-gen"      "$BUILD/"
@@ -76,6 +82,7 @@ install_bins() {
     cp bp-cm-*              "$PREFIX/bin/"
     cp bp-find-*            "$PREFIX/bin/"
     cp bp-parity-*          "$PREFIX/bin/"
+    cp bp-db-migrate        "$PREFIX/bin/"
     cp bp-set-corrupt       "$PREFIX/bin/"
     cp beegfs-parity-*      "$PREFIX/bin/"
     cp bp-update-storage-wrapper "$PREFIX/bin/"
@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+
+#include "chunk_key.h"
+
+/* Neither can be the first byte of a chunk path */
+#define TAG_VERBATIM 0x00
+#define TAG_CHUNK 0x01
+
+/* Hex digits in upper case without leading zeros, up to `end` */
+static
+const char *parse_hex(const char *p, const char *end, uint64_t *v)
+{
+    const char *start = p;
+    uint64_t res = 0;
+    while (p < end && ((*p >= '0' && *p <= '9') || (*p >= 'A' && *p <= 'F'))) {
+        if (p - start == 16)
+            return NULL;
+        res = (res << 4) | (uint64_t)((*p <= '9')? *p - '0' : *p - 'A' + 10);
+        p++;
+    }
+    if (p == start || (*start == '0' && p - start > 1))
+        return NULL;
+    *v = res;
+    return p;
+}
+
+/* Exactly two hex digits, leading zero included */
+static
+const char *parse_byte(const char *p, const char *end, uint64_t *v)
+{
+    if (end - p < 2)
+        return NULL;
+    uint64_t res = 0;
+    for (int i = 0; i < 2; i++) {
+        char c = p[i];
+        if (c >= '0' && c <= '9')
+            res = (res << 4) | (uint64_t)(c - '0');
+        else if (c >= 'A' && c <= 'F')
+            res = (res << 4) | (uint64_t)(c - 'A' + 10);
+        else
+            return NULL;
+    }
+    *v = res;
+    return p + 2;
+}
+
+static
+const char *expect(const char *p, const char *end, char c)
+{
+    return (p != NULL && p < end && *p == c)? p + 1 : NULL;
+}
+
+static
+char *put_varint(char *dst, uint64_t v)
+{
+    while (v >= 0x80) {
+        *dst++ = (char)(v | 0x80);
+        v >>= 7;
+    }
+    *dst++ = (char)v;
+    return dst;
+}
+
+static
+const char *get_varint(const char *src, const char *end, uint64_t *v)
+{
+    uint64_t res = 0;
+    for (int shift = 0; shift < 64 && src < end; shift += 7) {
+        uint8_t b = (uint8_t)*src++;
+        res |= (uint64_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            *v = res;
+            return src;
+        }
+    }
+    return NULL;
+}
+
+size_t chunk_key_encode(const char *name, size_t name_len, char *dst)
+{
+    const char *end = name + name_len;
+    uint64_t f[6];
+    const char *p = expect(name, end, 'u');
+    if (p) p = parse_hex(p, end, &f[0]);
+    if (p) p = expect(p, end, '/');
+    if (p) p = parse_byte(p, end, &f[1]);
+    if (p) p = expect(p, end, '/');
+    if (p) p = parse_byte(p, end, &f[2]);
+    if (p) p = expect(p, end, '/');
+    if (p) p = parse_hex(p, end, &f[3]);
+    if (p) p = expect(p, end, '-');
+    if (p) p = parse_hex(p, end, &f[4]);
+    if (p) p = expect(p, end, '-');
+    if (p) p = parse_hex(p, end, &f[5]);
+    if (p != end) {
+        dst[0] = TAG_VERBATIM;
+        memcpy(dst + 1, name, name_len);
+        return name_len + 1;
+    }
+    char *q = dst;
+    *q++ = TAG_CHUNK;
+    q = put_varint(q, f[0]);
+    *q++ = (char)f[1];
+    *q++ = (char)f[2];
+    for (int i = 3; i < 6; i++)
+        q = put_varint(q, f[i]);
+    return q - dst;
+}
+
+size_t chunk_key_decode(const char *key, size_t key_len, char *dst, size_t dst_size)
+{
+    if (key_len == 0)
+        errx(1, "Empty database key");
+    if (key[0] == TAG_VERBATIM) {
+        if (key_len > dst_size)
+            errx(1, "Database key too long (%zu bytes)", key_len);
+        memcpy(dst, key + 1, key_len - 1);
+        dst[key_len - 1] = '\0';
+        return key_len - 1;
+    }
+    if (key[0] != TAG_CHUNK || key_len < 6)
+        errx(1, "Malformed database key");
+    const char *end = key + key_len;
+    uint64_t uid, counter, timestamp, node;
+    const char *p = get_varint(key + 1, end, &uid);
+    if (p == NULL || end - p < 2)
+        errx(1, "Malformed database key");
+    unsigned d1 = (uint8_t)p[0];
+    unsigned d2 = (uint8_t)p[1];
+    p += 2;
+    if (p) p = get_varint(p, end, &counter);
+    if (p) p = get_varint(p, end, &timestamp);
+    if (p) p = get_varint(p, end, &node);
+    if (p != end)
+        errx(1, "Malformed database key");
+    int n = snprintf(dst, dst_size, "u%lX/%02X/%02X/%lX-%lX-%lX",
+            uid, d1, d2, counter, timestamp, node);
+    if (n < 0 || (size_t)n >= dst_size)
+        errx(1, "Database key too long");
+    return n;
+}
+
+int chunk_key_is_encoded(const char *key, size_t key_len)
+{
+    return key_len > 0 && (key[0] == TAG_VERBATIM || key[0] == TAG_CHUNK);
+}
@@ -0,0 +1,27 @@
+#ifndef __chunk_key__
+#define __chunk_key__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Database keys in a packed form of the BeeGFS chunk name. A chunk lives at
+ * `u<uid>/<XX>/<YY>/<counter>-<timestamp>-<node>`, all in upper case hex, and
+ * is stored as a tag byte followed by the numbers as varints - about half the
+ * size of the text.
+ *
+ * A name that isn't exactly on that form (leading zeros, lower case, other
+ * layouts) is stored as another tag byte and then the name as it is, so the
+ * encoding is always lossless.
+ */
+#define CHUNK_KEY_MAX(name_len) ((name_len) + 1)
+
+/* `dst` must have room for CHUNK_KEY_MAX(name_len) bytes, returns the length */
+size_t chunk_key_encode(const char *name, size_t name_len, char *dst);
+/* Writes the name with a '\0' to `dst` and returns its length, aborts if
+ * the key is malformed or the name doesn't fit in `dst_size` */
+size_t chunk_key_decode(const char *key, size_t key_len, char *dst, size_t dst_size);
+/* True if the key could be one from chunk_key_encode */
+int chunk_key_is_encoded(const char *key, size_t key_len);
+
+#endif
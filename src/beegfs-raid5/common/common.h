@@ -1,7 +1,9 @@
 #ifndef __COMMON_H__
 #define __COMMON_H__
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "progress_reporting.h"
 
@@ -27,24 +29,128 @@
 /* The database stores FileInfo elements as values. If the structure (or the
  * interpretation of it) is changed you must bump the DB_VERSION field to make
  * sure we don't read incompatible versions of the database. */
-#define DB_VERSION 1
+#define DB_VERSION 6
+/* Older versions: every target kept all the records in 1, which
+ * bp-parity-gen prunes, the keys were plain chunk names up to 2, there
+ * were no parity containers up to 3, no parity in the database up to 4 and
+ * no stripes of small files up to 5 */
+#define DB_VERSION_REPLICATED 1
+#define DB_VERSION_TEXT_KEYS 2
+#define DB_VERSION_NO_CONTAINERS 3
+#define DB_VERSION_NO_INLINE_PARITY 4
+#define DB_VERSION_NO_STRIPES 5
 typedef struct {
     int64_t timestamp;
     uint64_t locations;
 } FileInfo;
 
+/* Where the P target keeps the parity of a small file, see parity_container.h.
+ * A length of 0 means it is in a parity file of its own. */
+typedef struct {
+    uint32_t container;
+    uint32_t length;
+    uint64_t offset;
+} ParityLocation;
+
+/* Parity of up to INLINE_PARITY_MAX bytes, chunk sizes included, isn't worth
+ * a container entry either. It is stored in the database right after its
+ * ParityLocation, which has INLINE_PARITY as the container. */
+#define INLINE_PARITY_MAX 4096
+#define INLINE_PARITY 0
+
+typedef struct ParityContainer ParityContainer;
+
+static inline
+unsigned simple_hash(const char *p, int len)
+{
+    unsigned h = 5381;
+    for (int i = 0; i < len; i++)
+        h = h + (h << 5) + p[i];
+    return h;
+}
+
+/*
+ * The parity folder is given relative to the store, and must stay inside it:
+ * two stores on a host would otherwise share the folder, and number their
+ * containers the same.
+ */
+static inline
+int is_inside_store(const char *path)
+{
+    if (path[0] == '/' || path[0] == '\0')
+        return 0;
+    for (const char *p = path; *p != '\0'; p += strspn(p, "/")) {
+        size_t n = strcspn(p, "/");
+        if (n == 2 && p[0] == '.' && p[1] == '.')
+            return 0;
+        p += n;
+    }
+    return 1;
+}
+
+/*
+ * The target whose eater gets the events of a file in phase 1. Only the
+ * `nowners` targets of the first run with a sharded database own files, so
+ * adding targets doesn't give the files new owners that lack their records.
+ */
+#define OWNER_ST(key, keylen, nowners) (simple_hash((key), (int)(keylen)) % (unsigned)(nowners))
+
+/*
+ * The database is sharded: the record of a file is only kept by the targets
+ * that have a chunk of it or its P block, and by the target that owns it and
+ * looks it up in phase 2.
+ *
+ * A stripe member has a single chunk and no P, and if its owner is the target
+ * of the chunk nobody else would have the record when that target is lost.
+ * The target after the owner keeps it as well then, so every record has at
+ * least two holders to rebuild it from.
+ */
+static inline
+uint64_t db_holders(const char *key, size_t keylen, uint64_t locations, int nowners)
+{
+    unsigned owner = OWNER_ST(key, keylen, nowners);
+    uint64_t holders = (locations & L_MASK) | (1ULL << owner);
+    if (GET_P(locations) != NO_P)
+        holders |= 1ULL << GET_P(locations);
+    if (__builtin_popcountll(holders) == 1 && nowners > 1)
+        holders |= 1ULL << ((owner + 1) % (unsigned)nowners);
+    return holders;
+}
+
 typedef struct {
     int read_dir;
     int is_rebuilding;
     int actual_P_st; /* <- Only valid when rebuilding */
     int tag;
     ProgressSample *sample;
+    /* The task covers range `range` of `nranges`, 0 ranges is the whole file */
+    int range;
+    int nranges;
+    /* The lane's container. The P target of a task sets `stored_at` when it
+     * puts the parity in the container, and reads it from there when
+     * rebuilding if `stored_at` is given */
+    ParityContainer *container;
+    ParityLocation *stored_at;
+    /* INLINE_PARITY_MAX bytes for parity that is kept in the database */
+    uint8_t *inline_parity;
+    /* The chunk of each target, for a stripe (see stripe.h). NULL when all
+     * the chunks have the name of the task */
+    const char *const *chunk_paths;
+    /* Shared by the ranges of a file, so they agree on the size of its
+     * parity. RANGE_MAX_CS_UNSET until the first of them has seen the chunk
+     * sizes, NULL when the task is the whole file */
+    uint64_t *range_max_cs;
 } TaskInfo;
 
+#define RANGE_MAX_CS_UNSET UINT64_MAX
+
 typedef struct { int id, rank; unsigned version; } Target;
 typedef struct {
     int ntargets;
     Target targetIDs[MAX_STORAGE_TARGETS];
+    /* See OWNER_ST. Data files from before it was kept are a RunData without
+     * it for every run, so only a file of exactly sizeof(RunData) has it */
+    int nowners;
 } RunData;
 
 #define MAX(a,b) ((a) > (b)? (a) : (b))
@@ -0,0 +1,180 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "db_snapshot.h"
+
+#define SNAPSHOT_MAGIC "bpsnap1"
+#define COPY_BUFFER_SIZE (1024*1024)
+
+int db_snapshot_open(DbSnapshot *s, const char *path)
+{
+    memset(s, 0, sizeof(DbSnapshot));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            return 0;
+        err(1, "Can't open snapshot '%s'", path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        err(1, "Can't stat snapshot '%s'", path);
+    if ((size_t)st.st_size < sizeof(SnapshotHeader))
+        errx(1, "Snapshot '%s' is truncated", path);
+    s->map_len = st.st_size;
+    s->map = mmap(NULL, s->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED)
+        err(1, "Can't mmap snapshot '%s'", path);
+    /* Scans go through it from one end to the other */
+    madvise(s->map, s->map_len, MADV_SEQUENTIAL);
+
+    const SnapshotHeader *h = s->map;
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0)
+        errx(1, "'%s' is not a snapshot", path);
+    if (h->nrecords > (s->map_len - sizeof(SnapshotHeader))/sizeof(SnapshotRecord)
+            || sizeof(SnapshotHeader) + h->nrecords*sizeof(SnapshotRecord) + h->heap_bytes != s->map_len)
+        errx(1, "Snapshot '%s' is truncated", path);
+    s->version = h->version;
+    s->nrecords = h->nrecords;
+    s->records = (const SnapshotRecord *)(h + 1);
+    s->heap = (const char *)(s->records + s->nrecords);
+    s->heap_bytes = h->heap_bytes;
+    for (uint64_t i = 0; i < s->nrecords; i++) {
+        const SnapshotRecord *r = &s->records[i];
+        if (r->key_offset >= h->heap_bytes
+                || r->key_len >= h->heap_bytes - r->key_offset
+                || s->heap[r->key_offset + r->key_len] != '\0')
+            errx(1, "Corrupt record in snapshot '%s'", path);
+    }
+    return 1;
+}
+
+void db_snapshot_close(DbSnapshot *s)
+{
+    munmap(s->map, s->map_len);
+    memset(s, 0, sizeof(DbSnapshot));
+}
+
+static
+int cmp_key(const DbSnapshot *s, const SnapshotRecord *r, const char *key, size_t keylen)
+{
+    size_t n = (r->key_len < keylen)? r->key_len : keylen;
+    int c = memcmp(s->heap + r->key_offset, key, n);
+    if (c != 0)
+        return c;
+    return (r->key_len > keylen) - (r->key_len < keylen);
+}
+
+uint64_t db_snapshot_lower_bound(const DbSnapshot *s, const char *key, size_t keylen)
+{
+    uint64_t lo = 0, hi = s->nrecords;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo)/2;
+        if (cmp_key(s, &s->records[mid], key, keylen) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+const void *db_snapshot_blob(const DbSnapshot *s, uint64_t offset, uint64_t len)
+{
+    if (offset > s->heap_bytes || len > s->heap_bytes - offset)
+        return NULL;
+    return s->heap + offset;
+}
+
+int db_snapshot_find(const DbSnapshot *s, const char *key, size_t keylen, FileInfo *val)
+{
+    uint64_t i = db_snapshot_lower_bound(s, key, keylen);
+    if (i == s->nrecords || cmp_key(s, &s->records[i], key, keylen) != 0)
+        return 0;
+    *val = s->records[i].info;
+    return 1;
+}
+
+void db_snapshot_create(DbSnapshotWriter *w, const char *path, uint64_t version)
+{
+    memset(w, 0, sizeof(DbSnapshotWriter));
+    w->version = version;
+    w->path = strdup(path);
+    w->tmp_path = malloc(strlen(path) + 5);
+    if (w->path == NULL || w->tmp_path == NULL)
+        err(1, "Out of memory for snapshot");
+    sprintf(w->tmp_path, "%s.tmp", path);
+    w->f = fopen(w->tmp_path, "w");
+    if (w->f == NULL)
+        err(1, "Can't create snapshot '%s'", w->tmp_path);
+    /* The keys go in a file of their own and are appended at the end */
+    w->heap = tmpfile();
+    if (w->heap == NULL)
+        err(1, "Can't create temporary file for snapshot keys");
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    if (fwrite(&h, sizeof(h), 1, w->f) != 1)
+        err(1, "Couldn't write snapshot");
+}
+
+void db_snapshot_add(DbSnapshotWriter *w, const char *key, size_t keylen, const FileInfo *info)
+{
+    SnapshotRecord r = {w->heap_bytes, keylen, *info};
+    if (fwrite(&r, sizeof(r), 1, w->f) != 1
+            || fwrite(key, 1, keylen, w->heap) != keylen
+            || fputc('\0', w->heap) == EOF)
+        err(1, "Couldn't write snapshot");
+    w->nrecords += 1;
+    w->heap_bytes += keylen + 1;
+}
+
+uint64_t db_snapshot_add_blob(DbSnapshotWriter *w, const void *data, size_t len)
+{
+    uint64_t offset = w->heap_bytes;
+    if (fwrite(data, 1, len, w->heap) != len)
+        err(1, "Couldn't write snapshot");
+    w->heap_bytes += len;
+    return offset;
+}
+
+void db_snapshot_finish(DbSnapshotWriter *w)
+{
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL)
+        err(1, "Out of memory for snapshot");
+    rewind(w->heap);
+    size_t n;
+    while ((n = fread(buffer, 1, COPY_BUFFER_SIZE, w->heap)) != 0)
+        if (fwrite(buffer, 1, n, w->f) != n)
+            err(1, "Couldn't write snapshot");
+    if (ferror(w->heap))
+        err(1, "Couldn't read snapshot keys");
+    free(buffer);
+    fclose(w->heap);
+
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.version = w->version;
+    h.nrecords = w->nrecords;
+    h.heap_bytes = w->heap_bytes;
+    if (fseek(w->f, 0, SEEK_SET) != 0
+            || fwrite(&h, sizeof(h), 1, w->f) != 1
+            || fflush(w->f) != 0
+            || fsync(fileno(w->f)) != 0
+            || fclose(w->f) != 0)
+        err(1, "Couldn't write snapshot");
+    if (rename(w->tmp_path, w->path) != 0)
+        err(1, "Couldn't move snapshot in to place as '%s'", w->path);
+    free(w->path);
+    free(w->tmp_path);
+    memset(w, 0, sizeof(DbSnapshotWriter));
+}
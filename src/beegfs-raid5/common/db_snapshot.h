@@ -0,0 +1,71 @@
+#ifndef __db_snapshot__
+#define __db_snapshot__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/*
+ * A read-only copy of the database in one file: a header, the records sorted
+ * by key, and then all the keys as they are stored in the database. A record
+ * is fixed size and points in to the key heap, where every key ends with a
+ * '\0' so plain text keys can be used as they are. The file is mmap'ed when
+ * read, so a scan doesn't go through leveldb's block decoding.
+ *
+ * The file is written under a temporary name and renamed in to place when it
+ * is complete.
+ *
+ * Values that are bigger than a record can put the rest in the heap as a blob,
+ * and keep where it is in the record.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t version;
+    uint64_t nrecords;
+    uint64_t heap_bytes;
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t key_offset;
+    uint64_t key_len;
+    FileInfo info;
+} SnapshotRecord;
+
+typedef struct {
+    void *map;
+    size_t map_len;
+    uint64_t version;
+    uint64_t nrecords;
+    const SnapshotRecord *records;
+    const char *heap;
+    uint64_t heap_bytes;
+} DbSnapshot;
+
+typedef struct {
+    FILE *f;
+    FILE *heap;
+    char *path;
+    char *tmp_path;
+    uint64_t version;
+    uint64_t nrecords;
+    uint64_t heap_bytes;
+} DbSnapshotWriter;
+
+/* Returns 0 if there is no snapshot, aborts if it is damaged */
+int db_snapshot_open(DbSnapshot *s, const char *path);
+void db_snapshot_close(DbSnapshot *s);
+int db_snapshot_find(const DbSnapshot *s, const char *key, size_t keylen, FileInfo *val);
+/* The index of the first record with a key that isn't smaller than `key` */
+uint64_t db_snapshot_lower_bound(const DbSnapshot *s, const char *key, size_t keylen);
+/* The blob at `offset`, or NULL if it doesn't fit in the heap */
+const void *db_snapshot_blob(const DbSnapshot *s, uint64_t offset, uint64_t len);
+
+/* The keys must be added in sorted order */
+void db_snapshot_create(DbSnapshotWriter *w, const char *path, uint64_t version);
+void db_snapshot_add(DbSnapshotWriter *w, const char *key, size_t keylen, const FileInfo *info);
+/* Returns the offset of the blob, for the record that is added next */
+uint64_t db_snapshot_add_blob(DbSnapshotWriter *w, const void *data, size_t len);
+void db_snapshot_finish(DbSnapshotWriter *w);
+
+#endif
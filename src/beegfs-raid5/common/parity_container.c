@@ -0,0 +1,278 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "parity_container.h"
+
+/* Containers where less than this part is live are compacted, and the ones
+ * smaller than COMPACT_SMALL_BYTES are merged */
+#define COMPACT_MAX_LIVE_FRACTION 0.5
+#define COMPACT_SMALL_BYTES (64*1024*1024)
+
+/* Containers are named by their number, in hex */
+static
+void container_name(uint32_t id, char name[static 9])
+{
+    snprintf(name, 9, "%08X", id);
+}
+
+static
+int parse_container_name(const char *name, uint32_t *id)
+{
+    if (strlen(name) != 8)
+        return 0;
+    char *end;
+    unsigned long v = strtoul(name, &end, 16);
+    if (*end != '\0' || v == 0 || v > UINT32_MAX)
+        return 0;
+    *id = v;
+    return 1;
+}
+
+/* A dup of the folder fd would share its read position, so a listing gets an
+ * fd of its own */
+static
+DIR *list_containers(const ParityContainers *set)
+{
+    int fd = openat(set->dir, ".", O_DIRECTORY | O_RDONLY);
+    DIR *dir = (fd < 0)? NULL : fdopendir(fd);
+    if (dir == NULL)
+        err(1, "Can't list the parity containers");
+    return dir;
+}
+
+void containers_open(ParityContainers *set, int parity_dir)
+{
+    memset(set, 0, sizeof(ParityContainers));
+    if (mkdirat(parity_dir, "containers", S_IRWXU) != 0 && errno != EEXIST)
+        err(1, "Can't create the parity containers folder");
+    set->dir = openat(parity_dir, "containers", O_DIRECTORY | O_RDONLY);
+    if (set->dir < 0)
+        err(1, "Can't open the parity containers folder");
+    /* New containers are numbered after the ones we have */
+    DIR *dir = list_containers(set);
+    uint32_t max_id = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        uint32_t id;
+        if (parse_container_name(entry->d_name, &id))
+            max_id = MAX(max_id, id);
+    }
+    closedir(dir);
+    set->first_new_id = max_id + 1;
+    set->next_id = max_id + 1;
+}
+
+void containers_close(ParityContainers *set)
+{
+    close(set->dir);
+    set->dir = -1;
+}
+
+void container_init(ParityContainer *c, ParityContainers *set)
+{
+    memset(c, 0, sizeof(ParityContainer));
+    c->set = set;
+    c->fd = -1;
+}
+
+int container_append(ParityContainer *c, uint64_t length, ParityLocation *loc)
+{
+    assert(length <= CONTAINER_MAX_ENTRY);
+    if (c->writing && c->size + length > CONTAINER_MAX_BYTES)
+        container_close(c);
+    if (!c->writing) {
+        container_close(c);
+        c->id = __sync_fetch_and_add(&c->set->next_id, 1);
+        char name[9];
+        container_name(c->id, name);
+        c->fd = openat(c->set->dir, name, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR|S_IWUSR);
+        if (c->fd < 0)
+            return -1;
+        c->writing = 1;
+        c->size = 0;
+    }
+    loc->container = c->id;
+    loc->offset = c->size;
+    loc->length = length;
+    c->size += length;
+    return c->fd;
+}
+
+int container_read(ParityContainer *c, uint32_t id)
+{
+    assert(!c->writing);
+    if (c->fd >= 0 && c->id == id)
+        return c->fd;
+    container_close(c);
+    char name[9];
+    container_name(id, name);
+    c->fd = openat(c->set->dir, name, O_RDONLY);
+    c->id = id;
+    return c->fd;
+}
+
+void container_close(ParityContainer *c)
+{
+    if (c->fd >= 0) {
+        if (c->writing && fsync(c->fd) != 0)
+            warn("Couldn't sync parity container %08X", c->id);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->writing = 0;
+}
+
+typedef struct {
+    uint64_t live;
+    uint64_t size;
+    int exists;
+    int move;
+    int failed;
+} ContainerUsage;
+
+typedef struct {
+    ParityContainers *set;
+    PersistentDB *pdb;
+    PdbBatch *batch;
+    int st;
+    ContainerUsage *usage;
+    uint32_t nusage;
+    ParityContainer reader;
+    ParityContainer writer;
+    uint8_t *buffer;
+} Compaction;
+
+/* An entry is live while we are the P target of a file that has chunks.
+ * Inline parity isn't in a container, and the `live` of 0 is never used. */
+static
+int count_live(void *arg, const char *key, size_t keylen, const ParityLocation *loc)
+{
+    Compaction *cp = arg;
+    FileInfo fi;
+    if (loc->container < cp->nusage
+            && pdb_get(cp->pdb, key, keylen, &fi)
+            && GET_P(fi.locations) == cp->st
+            && (fi.locations & L_MASK) != 0)
+        cp->usage[loc->container].live += loc->length;
+    else
+        pdb_batch_del_parity(cp->batch, key, keylen);
+    return 0;
+}
+
+static
+int move_entry(void *arg, const char *key, size_t keylen, const ParityLocation *loc)
+{
+    Compaction *cp = arg;
+    if (loc->container == INLINE_PARITY || loc->container >= cp->nusage)
+        return 0;
+    ContainerUsage *u = &cp->usage[loc->container];
+    if (!u->move || u->failed)
+        return 0;
+    ParityLocation new_loc;
+    int rfd = container_read(&cp->reader, loc->container);
+    if (rfd < 0 || pread(rfd, cp->buffer, loc->length, loc->offset) != (ssize_t)loc->length) {
+        warn("Couldn't read from parity container %08X", loc->container);
+        u->failed = 1;
+        return 0;
+    }
+    int wfd = container_append(&cp->writer, loc->length, &new_loc);
+    if (wfd < 0 || pwrite(wfd, cp->buffer, loc->length, new_loc.offset) != (ssize_t)loc->length) {
+        warn("Couldn't write to parity container %08X", new_loc.container);
+        u->failed = 1;
+        return 0;
+    }
+    pdb_batch_set_parity(cp->batch, key, keylen, &new_loc, NULL);
+    return 0;
+}
+
+uint64_t containers_compact(ParityContainers *set, PersistentDB *pdb, int st, uint64_t budget)
+{
+    assert(set->first_new_id <= set->next_id);
+    Compaction cp;
+    memset(&cp, 0, sizeof(cp));
+    cp.set = set;
+    cp.pdb = pdb;
+    cp.st = st;
+    cp.nusage = set->next_id;
+    cp.usage = calloc(cp.nusage, sizeof(ContainerUsage));
+    cp.buffer = malloc(CONTAINER_MAX_ENTRY);
+    if (cp.usage == NULL || cp.buffer == NULL)
+        err(1, "Out of memory for compaction");
+    cp.batch = pdb_batch_create(pdb);
+    pdb_iterate_parity(pdb, count_live, &cp);
+    /* The forgotten entries could point at containers we delete below */
+    pdb_batch_flush_sync(cp.batch);
+    pdb_batch_destroy(cp.batch);
+
+    /* Only the containers from before this run are done being written */
+    uint64_t freed = 0;
+    int nsmall = 0;
+    DIR *dir = list_containers(set);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        uint32_t id;
+        struct stat st_buf;
+        if (!parse_container_name(entry->d_name, &id)
+                || id >= set->first_new_id
+                || fstatat(set->dir, entry->d_name, &st_buf, 0) != 0)
+            continue;
+        ContainerUsage *u = &cp.usage[id];
+        u->size = st_buf.st_size;
+        if (u->live == 0) {
+            if (unlinkat(set->dir, entry->d_name, 0) == 0)
+                freed += u->size;
+            continue;
+        }
+        u->exists = 1;
+        nsmall += (u->size < COMPACT_SMALL_BYTES);
+    }
+    closedir(dir);
+    int nmoves = 0;
+    for (uint32_t id = 1; id < set->first_new_id; id++) {
+        ContainerUsage *u = &cp.usage[id];
+        if (!u->exists || u->live > budget)
+            continue;
+        if (u->live < COMPACT_MAX_LIVE_FRACTION*u->size
+                || (u->size < COMPACT_SMALL_BYTES && nsmall > 1)) {
+            u->move = 1;
+            budget -= u->live;
+            nmoves += 1;
+        }
+    }
+
+    if (nmoves != 0) {
+        container_init(&cp.reader, set);
+        container_init(&cp.writer, set);
+        /* The copies must be on disk before the database points at them, and
+         * the database must point at them on disk before the old ones go
+         * away - so nothing is committed until the end */
+        cp.batch = pdb_batch_create_held(pdb);
+        pdb_iterate_parity(pdb, move_entry, &cp);
+        container_close(&cp.reader);
+        container_close(&cp.writer);
+        pdb_batch_flush_sync(cp.batch);
+        pdb_batch_destroy(cp.batch);
+        for (uint32_t id = 1; id < cp.nusage; id++) {
+            ContainerUsage *u = &cp.usage[id];
+            if (!u->move || u->failed)
+                continue;
+            char name[9];
+            container_name(id, name);
+            if (unlinkat(set->dir, name, 0) == 0)
+                freed += u->size - u->live;
+        }
+    }
+    free(cp.buffer);
+    free(cp.usage);
+    return freed;
+}
@@ -0,0 +1,60 @@
+#ifndef __parity_container__
+#define __parity_container__
+
+#include <stdint.h>
+
+#include "common.h"
+#include "persistent_db.h"
+
+/*
+ * The parity of a small file costs more in creating the file than in writing
+ * the bytes, so parity of up to CONTAINER_MAX_ENTRY bytes is appended to a
+ * container file instead. Every lane has a container of its own that it is
+ * the only one to write to, and starts a new one when it gets to
+ * CONTAINER_MAX_BYTES. An entry has the same layout as a parity file, and
+ * its ParityLocation is kept in the database of the P target.
+ *
+ * Containers are never written to in the middle. When a file changes its
+ * parity goes at the end of a container, and the old entry is just garbage
+ * that compaction gets rid of later.
+ */
+#define CONTAINER_MAX_ENTRY (256*1024)
+#define CONTAINER_MAX_BYTES (1ULL << 30)
+
+/* The containers of a target, in the `containers` folder of its parity */
+typedef struct {
+    int dir;
+    /* Containers from before this run are the only ones compacted */
+    uint32_t first_new_id;
+    uint32_t next_id;
+} ParityContainers;
+
+struct ParityContainer {
+    ParityContainers *set;
+    uint32_t id;
+    int fd;
+    int writing;
+    uint64_t size;
+};
+
+void containers_open(ParityContainers *set, int parity_dir);
+void containers_close(ParityContainers *set);
+
+void container_init(ParityContainer *c, ParityContainers *set);
+/* Sets `loc` to `length` bytes at the end of the container and returns the
+ * fd to write them with, or -1 with errno set */
+int container_append(ParityContainer *c, uint64_t length, ParityLocation *loc);
+/* An fd to read container `id` with, open until another one is needed */
+int container_read(ParityContainer *c, uint32_t id);
+/* Makes sure what has been appended is on disk */
+void container_close(ParityContainer *c);
+
+/*
+ * Forgets the entries of files that this target isn't P of anymore, and
+ * moves the live entries out of old containers that are mostly garbage or
+ * small - until about `budget` bytes have been copied. Returns the number of
+ * bytes freed.
+ */
+uint64_t containers_compact(ParityContainers *set, PersistentDB *pdb, int st, uint64_t budget);
+
+#endif
@@ -0,0 +1,177 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "parity_writer.h"
+
+typedef struct {
+    int fd;
+    off_t offset;
+    size_t n;
+    uint8_t *buf;
+    ParityWrites *ws;
+} WriteJob;
+
+/*
+ * Every queued and every running write has a buffer, and so does every block
+ * that is being copied before it is queued. The copies count against the
+ * depth of the queue, so there are depth + nthreads buffers and a free one
+ * whenever the queue has room.
+ */
+struct ParityWriter {
+    pthread_t *threads;
+    int nthreads;
+    WriteJob *queue;
+    int depth;
+    int head;
+    int count;
+    int copying;
+    uint8_t **free_buffers;
+    int nfree;
+    size_t block_size;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t done;
+};
+
+static
+int write_all(int fd, const uint8_t *buf, size_t n, off_t offset)
+{
+    while (n > 0) {
+        ssize_t w = pwrite(fd, buf, n, offset);
+        if (w <= 0)
+            return (w < 0)? errno : EIO;
+        buf += w;
+        n -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+static
+void *writer_main(void *p)
+{
+    ParityWriter *w = p;
+    pthread_mutex_lock(&w->lock);
+    for (;;)
+    {
+        while (w->count == 0 && !w->stop)
+            pthread_cond_wait(&w->not_empty, &w->lock);
+        if (w->count == 0)
+            break;
+        WriteJob job = w->queue[w->head];
+        w->head = (w->head + 1) % w->depth;
+        w->count -= 1;
+        pthread_cond_signal(&w->not_full);
+        pthread_mutex_unlock(&w->lock);
+
+        int error = write_all(job.fd, job.buf, job.n, job.offset);
+
+        pthread_mutex_lock(&w->lock);
+        if (error != 0 && job.ws->error == 0)
+            job.ws->error = error;
+        job.ws->pending -= 1;
+        w->free_buffers[w->nfree++] = job.buf;
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+ParityWriter *parity_writer_start(int nthreads, int depth, size_t block_size)
+{
+    assert(nthreads > 0 && depth > 0);
+    ParityWriter *w = calloc(1, sizeof(ParityWriter));
+    if (w == NULL)
+        err(1, "Out of memory for the parity writer");
+    w->nthreads = nthreads;
+    w->depth = depth;
+    w->block_size = block_size;
+    w->threads = calloc(nthreads, sizeof(pthread_t));
+    w->queue = calloc(depth, sizeof(WriteJob));
+    w->free_buffers = calloc(depth + nthreads, sizeof(uint8_t *));
+    if (w->threads == NULL || w->queue == NULL || w->free_buffers == NULL)
+        err(1, "Out of memory for the parity writer");
+    for (w->nfree = 0; w->nfree < depth + nthreads; w->nfree++) {
+        w->free_buffers[w->nfree] = malloc(block_size);
+        if (w->free_buffers[w->nfree] == NULL)
+            err(1, "Out of memory for the parity writer");
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->not_empty, NULL);
+    pthread_cond_init(&w->not_full, NULL);
+    pthread_cond_init(&w->done, NULL);
+    for (int i = 0; i < nthreads; i++) {
+        int rc = pthread_create(&w->threads[i], NULL, writer_main, w);
+        if (rc)
+            errx(1, "Thread create failed (rc = %d)", rc);
+    }
+    return w;
+}
+
+/* Whatever is queued is written before the threads stop */
+void parity_writer_stop(ParityWriter *w)
+{
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->not_empty);
+    pthread_mutex_unlock(&w->lock);
+    for (int i = 0; i < w->nthreads; i++) {
+        int rc = pthread_join(w->threads[i], NULL);
+        if (rc)
+            errx(1, "Thread join error (rc = %d) on parity writer %d", rc, i);
+    }
+    for (int i = 0; i < w->nfree; i++)
+        free(w->free_buffers[i]);
+    pthread_cond_destroy(&w->done);
+    pthread_cond_destroy(&w->not_full);
+    pthread_cond_destroy(&w->not_empty);
+    pthread_mutex_destroy(&w->lock);
+    free(w->free_buffers);
+    free(w->queue);
+    free(w->threads);
+    free(w);
+}
+
+void parity_writer_submit(ParityWriter *w, ParityWrites *ws,
+        int fd, const void *buf, size_t n, off_t offset)
+{
+    assert(n <= w->block_size);
+    pthread_mutex_lock(&w->lock);
+    while (w->count + w->copying == w->depth)
+        pthread_cond_wait(&w->not_full, &w->lock);
+    assert(w->nfree > 0);
+    uint8_t *copy = w->free_buffers[--w->nfree];
+    w->copying += 1;
+    pthread_mutex_unlock(&w->lock);
+
+    /* The other lanes and the writers carry on while we copy */
+    memcpy(copy, buf, n);
+
+    pthread_mutex_lock(&w->lock);
+    w->copying -= 1;
+    WriteJob job = { fd, offset, n, copy, ws };
+    w->queue[(w->head + w->count) % w->depth] = job;
+    w->count += 1;
+    ws->pending += 1;
+    pthread_cond_signal(&w->not_empty);
+    pthread_mutex_unlock(&w->lock);
+}
+
+int parity_writer_wait(ParityWriter *w, ParityWrites *ws)
+{
+    pthread_mutex_lock(&w->lock);
+    while (ws->pending != 0)
+        pthread_cond_wait(&w->done, &w->lock);
+    int error = ws->error;
+    pthread_mutex_unlock(&w->lock);
+    return error;
+}
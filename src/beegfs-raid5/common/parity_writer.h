@@ -0,0 +1,36 @@
+#ifndef __parity_writer__
+#define __parity_writer__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * When the parity is on a device of its own, writing it doesn't have to hold
+ * up the lane that calculated it. A ParityWriter has threads of its own that
+ * write the blocks from a queue of up to `depth` blocks, each a copy of what
+ * was handed in, while the lanes go on with the next block. A full queue
+ * makes the lanes wait, so a slow device holds back the lanes instead of
+ * using up memory.
+ *
+ * A task keeps track of its writes with a ParityWrites, and waits for them
+ * before it closes the fd or records where its parity is.
+ */
+typedef struct ParityWriter ParityWriter;
+
+typedef struct {
+    int pending;
+    /* The errno of the first write that failed */
+    int error;
+} ParityWrites;
+
+/* Blocks can be up to `block_size` bytes */
+ParityWriter *parity_writer_start(int nthreads, int depth, size_t block_size);
+void parity_writer_stop(ParityWriter *w);
+
+void parity_writer_submit(ParityWriter *w, ParityWrites *ws,
+        int fd, const void *buf, size_t n, off_t offset);
+/* Returns 0, or the errno of the first write that failed */
+int parity_writer_wait(ParityWriter *w, ParityWrites *ws);
+
+#endif
@@ -4,23 +4,83 @@
 #include <memory.h>
 #include <assert.h>
 #include <err.h>
+#include <time.h>
+#include <string.h>
+#include <pthread.h>
 
 #include <leveldb/c.h>
 
 #include "persistent_db.h"
+#include "db_snapshot.h"
+#include "chunk_key.h"
 
 /* Not important what the key is, it just can't collide with a chunkname */
 #define FORMAT_VERSION_KEY "?db_version"
 
+/* Keys are stored with chunk_key_encode from DB_VERSION_TEXT_KEYS + 1 on */
+#define HAS_BINARY_KEYS(pdb) ((pdb)->version > DB_VERSION_TEXT_KEYS)
+#define KEY_BUFFER_SIZE (PDB_MAX_KEY_LEN + 2)
+
+/*
+ * The ParityLocations of a P target are stored under the packed key of the
+ * file with this tag in front, after all the records. They are the same size
+ * as a FileInfo, and go in the snapshot the same way. Inline parity follows
+ * its location in the value, and is a blob in the snapshot that the offset of
+ * the location points at.
+ */
+#define PARITY_KEY_TAG 0x02
+#define IS_PARITY_KEY(key, keylen) ((keylen) > 0 && (key)[0] == PARITY_KEY_TAG)
+typedef char parity_location_fits_in_a_record[(sizeof(ParityLocation) == sizeof(FileInfo))? 1 : -1];
+
+/*
+ * The members of a stripe are kept under its packed key with STRIPE_KEY_TAG,
+ * and the stripe of a member under the member's with STRIPE_OF_KEY_TAG. The
+ * values can have any length, so they are blobs in the snapshot and the
+ * record has a BlobRef to them.
+ */
+#define STRIPE_KEY_TAG 0x03
+#define STRIPE_OF_KEY_TAG 0x04
+#define IS_STRIPE_KEY(key, keylen) ((keylen) > 0 \
+        && ((key)[0] == STRIPE_KEY_TAG || (key)[0] == STRIPE_OF_KEY_TAG))
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} BlobRef;
+typedef char blob_ref_fits_in_a_record[(sizeof(BlobRef) == sizeof(FileInfo))? 1 : -1];
+
+/*
+ * How far pdb_get_many walks the iterator forwards before it seeks instead.
+ * Most of the time the next key is close by, and stepping is far cheaper
+ * than a seek - but a sparse list of keys shouldn't scan the whole DB.
+ */
+#define MAX_STEPS_BEFORE_SEEK 16
+
+/* When a PdbBatch is committed without being asked to */
+#define BATCH_MAX_UPDATES 4096
+#define BATCH_MAX_SECONDS 2.0
+
+/* Below this much in tables pdb_split counts the keys to find split points */
+#define SPLIT_MIN_TABLE_BYTES (4*1024*1024)
+
+typedef struct {
+    const char *key;
+    size_t keylen;
+    size_t index;
+} Lookup;
+
 struct PersistentDB {
     leveldb_options_t *options;
     leveldb_cache_t *cache;
     leveldb_readoptions_t *ropts;
+    leveldb_readoptions_t *scan_ropts;
     leveldb_writeoptions_t *wopts;
     leveldb_t *db;
+    uint64_t version;
+    /* Set when we read from a snapshot instead of leveldb */
+    DbSnapshot *snapshot;
 };
 
-PersistentDB* pdb_init(const char *db_folder, uint64_t expected_version)
+PersistentDB* pdb_init(const char *db_folder, uint64_t expected_version, uint64_t oldest_version)
 {
     leveldb_cache_t *cache = leveldb_cache_create_lru(100*1024*1024);
     leveldb_options_t *db_options = leveldb_options_create();
@@ -31,6 +91,9 @@ PersistentDB* pdb_init(const char *db_folder, uint64_t expected_version)
      * leveldb_options_set_compression(db_options, leveldb_snappy_compression);
     */
     leveldb_readoptions_t *read_options = leveldb_readoptions_create();
+    /* A batch lookup reads every block once, no point in caching them */
+    leveldb_readoptions_t *scan_options = leveldb_readoptions_create();
+    leveldb_readoptions_set_fill_cache(scan_options, 0);
     leveldb_writeoptions_t *write_options = leveldb_writeoptions_create();
     leveldb_writeoptions_set_sync(write_options, 0);
     char *errmsg = NULL;
@@ -46,7 +109,9 @@ PersistentDB* pdb_init(const char *db_folder, uint64_t expected_version)
     res->cache = cache;
     res->wopts = write_options;
     res->ropts = read_options;
+    res->scan_ropts = scan_options;
     res->db = db;
+    res->version = expected_version;
 
     size_t version_len;
     uint64_t *version = (uint64_t *)leveldb_get(
@@ -68,22 +133,202 @@ PersistentDB* pdb_init(const char *db_folder, uint64_t expected_version)
     }
     else if (version_len != sizeof(*version))
         errx(1, "Corrupt version field in database");
-    else if (*version != expected_version)
+    else if (*version < oldest_version || *version > expected_version)
         errx(1, "Incompatible DB (found: %lu, expected: %lu)",
                 *version, expected_version);
-    else
+    else {
+        res->version = *version;
         leveldb_free(version);
+    }
+
+    return res;
+}
+
+static
+int is_record(const char *key, size_t keylen, size_t vallen)
+{
+    return vallen == sizeof(FileInfo)
+        && !IS_PARITY_KEY(key, keylen)
+        && !IS_STRIPE_KEY(key, keylen)
+        && !(keylen == strlen(FORMAT_VERSION_KEY)
+            && memcmp(key, FORMAT_VERSION_KEY, keylen) == 0);
+}
+
+/* The key as it is stored in `pdb`, `buf` needs KEY_BUFFER_SIZE bytes */
+static
+const char *stored_key(const PersistentDB *pdb, const char *key, size_t keylen,
+        char *buf, size_t *stored_len)
+{
+    if (keylen > PDB_MAX_KEY_LEN)
+        errx(1, "Database key too long (%zu bytes)", keylen);
+    if (!HAS_BINARY_KEYS(pdb)) {
+        *stored_len = keylen;
+        return key;
+    }
+    *stored_len = chunk_key_encode(key, keylen, buf);
+    return buf;
+}
+
+/* The chunk name of a stored key, with a '\0' */
+static
+const char *name_of_key(const PersistentDB *pdb, const char *key, size_t keylen,
+        char *buf, size_t *name_len)
+{
+    if (HAS_BINARY_KEYS(pdb)) {
+        *name_len = chunk_key_decode(key, keylen, buf, KEY_BUFFER_SIZE);
+        return buf;
+    }
+    if (keylen > PDB_MAX_KEY_LEN)
+        errx(1, "Database key too long (%zu bytes)", keylen);
+    memcpy(buf, key, keylen);
+    buf[keylen] = '\0';
+    *name_len = keylen;
+    return buf;
+}
+
+/* A stored ParityLocation, with the inline parity if it has any */
+static
+int is_parity_value(const char *val, size_t vallen)
+{
+    ParityLocation loc;
+    if (vallen < sizeof(ParityLocation))
+        return 0;
+    memcpy(&loc, val, sizeof(loc));
+    if (loc.container != INLINE_PARITY)
+        return vallen == sizeof(ParityLocation);
+    return loc.length <= INLINE_PARITY_MAX && vallen == sizeof(ParityLocation) + loc.length;
+}
+
+/* The packed key of a file with `tag` in front, `buf` needs KEY_BUFFER_SIZE
+ * bytes */
+static
+const char *tagged_key(const PersistentDB *pdb, char tag, const char *name, size_t namelen,
+        char *buf, size_t *keylen)
+{
+    if (!HAS_BINARY_KEYS(pdb))
+        errx(1, "Parity locations and stripes need a database with packed keys");
+    if (namelen > PDB_MAX_KEY_LEN)
+        errx(1, "Database key too long (%zu bytes)", namelen);
+    buf[0] = tag;
+    *keylen = 1 + chunk_key_encode(name, namelen, buf + 1);
+    return buf;
+}
+
+#define parity_key(pdb, name, namelen, buf, keylen) \
+    tagged_key((pdb), PARITY_KEY_TAG, (name), (namelen), (buf), (keylen))
 
+PersistentDB* pdb_open_snapshot(const char *path, uint64_t expected_version, uint64_t oldest_version)
+{
+    DbSnapshot *snapshot = calloc(1, sizeof(DbSnapshot));
+    if (snapshot == NULL)
+        err(1, "Out of memory for snapshot");
+    if (!db_snapshot_open(snapshot, path)) {
+        free(snapshot);
+        return NULL;
+    }
+    if (snapshot->version < oldest_version || snapshot->version > expected_version)
+        errx(1, "Incompatible snapshot (found: %lu, expected: %lu)",
+                snapshot->version, expected_version);
+    PersistentDB *res = calloc(1, sizeof(PersistentDB));
+    res->version = snapshot->version;
+    res->snapshot = snapshot;
     return res;
 }
 
+void pdb_snapshot_path(const char *db_folder, char *path, size_t path_len)
+{
+    size_t n = strlen(db_folder);
+    while (n > 1 && db_folder[n - 1] == '/')
+        n--;
+    snprintf(path, path_len, "%.*s.snapshot", (int)n, db_folder);
+}
+
+void pdb_write_snapshot(const PersistentDB *pdb, const char *path)
+{
+    assert(pdb->snapshot == NULL);
+    DbSnapshotWriter w;
+    db_snapshot_create(&w, path, pdb->version);
+    leveldb_iterator_t *iter = leveldb_create_iterator(pdb->db, pdb->scan_ropts);
+    for (leveldb_iter_seek_to_first(iter); leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+        size_t keylen, vallen;
+        const char *key = leveldb_iter_key(iter, &keylen);
+        const char *val = leveldb_iter_value(iter, &vallen);
+        if (IS_STRIPE_KEY(key, keylen)) {
+            BlobRef ref = { db_snapshot_add_blob(&w, val, vallen), vallen };
+            FileInfo fi;
+            memcpy(&fi, &ref, sizeof(FileInfo));
+            db_snapshot_add(&w, key, keylen, &fi);
+            continue;
+        }
+        if (!is_record(key, keylen, vallen)
+                && !(IS_PARITY_KEY(key, keylen) && is_parity_value(val, vallen)))
+            continue;
+        FileInfo fi;
+        memcpy(&fi, val, sizeof(FileInfo));
+        if (vallen > sizeof(FileInfo)) {
+            ParityLocation loc;
+            memcpy(&loc, val, sizeof(loc));
+            loc.offset = db_snapshot_add_blob(&w, val + sizeof(loc), loc.length);
+            memcpy(&fi, &loc, sizeof(FileInfo));
+        }
+        db_snapshot_add(&w, key, keylen, &fi);
+    }
+    leveldb_iter_destroy(iter);
+    db_snapshot_finish(&w);
+}
+
+static
+void must_be_writable(const PersistentDB *pdb)
+{
+    if (pdb->snapshot != NULL)
+        errx(1, "Database snapshots are read-only");
+}
+
+struct PdbBatch {
+    PersistentDB *pdb;
+    leveldb_writebatch_t *wb;
+    size_t nupdates;
+    struct timespec first_update;
+    int held;
+};
+
+uint64_t pdb_version(const PersistentDB *pdb)
+{
+    return pdb->version;
+}
+
+void pdb_set_version(PersistentDB *pdb, uint64_t version)
+{
+    must_be_writable(pdb);
+    char *errmsg = NULL;
+    leveldb_put(
+            pdb->db,
+            pdb->wopts,
+            FORMAT_VERSION_KEY, strlen(FORMAT_VERSION_KEY),
+            (const char *)&version, sizeof(version),
+            &errmsg);
+    if (errmsg != NULL)
+        errx(1, "Couldn't update the database version: %s", errmsg);
+    pdb->version = version;
+}
+
 void pdb_term(PersistentDB *pdb)
 {
+    if (pdb->snapshot != NULL) {
+        db_snapshot_close(pdb->snapshot);
+        free(pdb->snapshot);
+        free(pdb);
+        return;
+    }
     leveldb_close(pdb->db);
 }
 
-void pdb_set(PersistentDB *pdb, const char *key, size_t keylen, const FileInfo *val)
+void pdb_set(PersistentDB *pdb, const char *name, size_t namelen, const FileInfo *val)
 {
+    must_be_writable(pdb);
+    char buf[KEY_BUFFER_SIZE];
+    size_t keylen;
+    const char *key = stored_key(pdb, name, namelen, buf, &keylen);
     char *errmsg = NULL;
     leveldb_put(
             pdb->db,
@@ -94,8 +339,12 @@ void pdb_set(PersistentDB *pdb, const char *key, size_t keylen, const FileInfo *
     leveldb_free(errmsg);
 }
 
-void pdb_del(PersistentDB *pdb, const char *key, size_t keylen)
+void pdb_del(PersistentDB *pdb, const char *name, size_t namelen)
 {
+    must_be_writable(pdb);
+    char buf[KEY_BUFFER_SIZE];
+    size_t keylen;
+    const char *key = stored_key(pdb, name, namelen, buf, &keylen);
     char *errmsg = NULL;
     leveldb_delete(
             pdb->db,
@@ -105,40 +354,667 @@ void pdb_del(PersistentDB *pdb, const char *key, size_t keylen)
     leveldb_free(errmsg);
 }
 
-int pdb_get(const PersistentDB *pdb, const char *key, size_t keylen, FileInfo *val)
+/* The value of a stored key that is `size` bytes */
+static
+int get_value(const PersistentDB *pdb, const char *key, size_t keylen, void *val, size_t size)
 {
-    size_t fi_len;
+    if (pdb->snapshot != NULL) {
+        FileInfo fi;
+        if (!db_snapshot_find(pdb->snapshot, key, keylen, &fi))
+            return 0;
+        memcpy(val, &fi, size);
+        return 1;
+    }
+    size_t len;
     char *errmsg = NULL;
-    FileInfo *pfi = (FileInfo *)leveldb_get(
+    char *stored = leveldb_get(
             pdb->db,
             pdb->ropts,
             key, keylen,
-            &fi_len,
+            &len,
             &errmsg);
     leveldb_free(errmsg);
-    if (pfi == NULL)
+    if (stored == NULL)
         return 0;
-    assert(fi_len == sizeof(FileInfo));
-    memcpy(val, pfi, fi_len);
-    leveldb_free(pfi);
+    assert(len == size);
+    memcpy(val, stored, size);
+    leveldb_free(stored);
     return 1;
 }
 
-void pdb_iterate(const PersistentDB *pdb, ProcessFileInfos f)
+int pdb_get(const PersistentDB *pdb, const char *name, size_t namelen, FileInfo *val)
+{
+    char buf[KEY_BUFFER_SIZE];
+    size_t keylen;
+    const char *key = stored_key(pdb, name, namelen, buf, &keylen);
+    return get_value(pdb, key, keylen, val, sizeof(FileInfo));
+}
+
+int pdb_get_parity(const PersistentDB *pdb, const char *name, size_t namelen,
+        ParityLocation *loc, uint8_t *inline_parity)
+{
+    char buf[KEY_BUFFER_SIZE];
+    size_t keylen;
+    const char *key = parity_key(pdb, name, namelen, buf, &keylen);
+    if (pdb->snapshot != NULL) {
+        FileInfo fi;
+        if (!db_snapshot_find(pdb->snapshot, key, keylen, &fi))
+            return 0;
+        memcpy(loc, &fi, sizeof(ParityLocation));
+        if (loc->container != INLINE_PARITY)
+            return 1;
+        const void *blob = db_snapshot_blob(pdb->snapshot, loc->offset, loc->length);
+        if (blob == NULL || loc->length > INLINE_PARITY_MAX)
+            errx(1, "Corrupt parity location in snapshot");
+        memcpy(inline_parity, blob, loc->length);
+        return 1;
+    }
+    size_t len;
+    char *errmsg = NULL;
+    char *stored = leveldb_get(
+            pdb->db,
+            pdb->ropts,
+            key, keylen,
+            &len,
+            &errmsg);
+    leveldb_free(errmsg);
+    if (stored == NULL)
+        return 0;
+    if (!is_parity_value(stored, len))
+        errx(1, "Corrupt parity location in database");
+    memcpy(loc, stored, sizeof(ParityLocation));
+    if (loc->container == INLINE_PARITY)
+        memcpy(inline_parity, stored + sizeof(ParityLocation), loc->length);
+    leveldb_free(stored);
+    return 1;
+}
+
+/* A value of up to `maxlen` bytes under a tagged key, returns its length */
+static
+size_t get_tagged(const PersistentDB *pdb, char tag, const char *name, size_t namelen,
+        void *val, size_t maxlen)
+{
+    char buf[KEY_BUFFER_SIZE];
+    size_t keylen;
+    const char *key = tagged_key(pdb, tag, name, namelen, buf, &keylen);
+    if (pdb->snapshot != NULL) {
+        FileInfo fi;
+        BlobRef ref;
+        if (!db_snapshot_find(pdb->snapshot, key, keylen, &fi))
+            return 0;
+        memcpy(&ref, &fi, sizeof(ref));
+        const void *blob = db_snapshot_blob(pdb->snapshot, ref.offset, ref.length);
+        if (blob == NULL || ref.length > maxlen)
+            errx(1, "Corrupt stripe in snapshot");
+        memcpy(val, blob, ref.length);
+        return ref.length;
+    }
+    size_t len;
+    char *errmsg = NULL;
+    char *stored = leveldb_get(
+            pdb->db,
+            pdb->ropts,
+            key, keylen,
+            &len,
+            &errmsg);
+    leveldb_free(errmsg);
+    if (stored == NULL)
+        return 0;
+    if (len > maxlen)
+        errx(1, "Corrupt stripe in database");
+    memcpy(val, stored, len);
+    leveldb_free(stored);
+    return len;
+}
+
+size_t pdb_get_stripe(const PersistentDB *pdb, const char *name, size_t namelen,
+        uint8_t *list, size_t maxlen)
+{
+    return get_tagged(pdb, STRIPE_KEY_TAG, name, namelen, list, maxlen);
+}
+
+size_t pdb_get_stripe_of(const PersistentDB *pdb, const char *name, size_t namelen,
+        char *stripe)
+{
+    size_t len = get_tagged(pdb, STRIPE_OF_KEY_TAG, name, namelen, stripe, PDB_MAX_KEY_LEN);
+    stripe[len] = '\0';
+    return len;
+}
+
+PdbBatch* pdb_batch_create(PersistentDB *pdb)
+{
+    must_be_writable(pdb);
+    PdbBatch *batch = calloc(1, sizeof(PdbBatch));
+    if (batch == NULL)
+        err(1, "Out of memory for database batch");
+    batch->pdb = pdb;
+    batch->wb = leveldb_writebatch_create();
+    return batch;
+}
+
+PdbBatch* pdb_batch_create_held(PersistentDB *pdb)
+{
+    PdbBatch *batch = pdb_batch_create(pdb);
+    batch->held = 1;
+    return batch;
+}
+
+static
+void batch_write(PdbBatch *batch, const leveldb_writeoptions_t *wopts)
+{
+    if (batch->nupdates == 0)
+        return;
+    char *errmsg = NULL;
+    leveldb_write(batch->pdb->db, wopts, batch->wb, &errmsg);
+    if (errmsg != NULL)
+        errx(1, "Database write failed: %s", errmsg);
+    leveldb_writebatch_clear(batch->wb);
+    batch->nupdates = 0;
+}
+
+void pdb_batch_flush(PdbBatch *batch)
+{
+    batch_write(batch, batch->pdb->wopts);
+}
+
+void pdb_batch_flush_sync(PdbBatch *batch)
+{
+    leveldb_writeoptions_t *sync_opts = leveldb_writeoptions_create();
+    leveldb_writeoptions_set_sync(sync_opts, 1);
+    batch_write(batch, sync_opts);
+    leveldb_writeoptions_destroy(sync_opts);
+}
+
+static
+void batch_added(PdbBatch *batch)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (batch->nupdates++ == 0)
+        batch->first_update = now;
+    double age = (now.tv_sec - batch->first_update.tv_sec)
+        + (now.tv_nsec - batch->first_update.tv_nsec) * 1e-9;
+    if (!batch->held && (batch->nupdates >= BATCH_MAX_UPDATES || age >= BATCH_MAX_SECONDS))
+        pdb_batch_flush(batch);
+}
+
+void pdb_batch_set(PdbBatch *batch, const char *name, size_t namelen, const FileInfo *val)
+{
+    char buf[KEY_BUFFER_SIZE];
+    size_t keylen;
+    const char *key = stored_key(batch->pdb, name, namelen, buf, &keylen);
+    leveldb_writebatch_put(batch->wb, key, keylen, (const char *)val, sizeof(FileInfo));
+    batch_added(batch);
+}
+
+void pdb_batch_del(PdbBatch *batch, const char *name, size_t namelen)
+{
+    char buf[KEY_BUFFER_SIZE];
+    size_t keylen;
+    const char *key = stored_key(batch->pdb, name, namelen, buf, &keylen);
+    leveldb_writebatch_delete(batch->wb, key, keylen);
+    batch_added(batch);
+}
+
+void pdb_batch_set_parity(PdbBatch *batch, const char *name, size_t namelen,
+        const ParityLocation *loc, const uint8_t *inline_parity)
+{
+    char buf[KEY_BUFFER_SIZE];
+    size_t keylen;
+    const char *key = parity_key(batch->pdb, name, namelen, buf, &keylen);
+    char val[sizeof(ParityLocation) + INLINE_PARITY_MAX];
+    size_t vallen = sizeof(ParityLocation);
+    memcpy(val, loc, sizeof(ParityLocation));
+    if (loc->container == INLINE_PARITY) {
+        assert(loc->length <= INLINE_PARITY_MAX);
+        memcpy(val + vallen, inline_parity, loc->length);
+        vallen += loc->length;
+    }
+    leveldb_writebatch_put(batch->wb, key, keylen, val, vallen);
+    batch_added(batch);
+}
+
+void pdb_batch_del_parity(PdbBatch *batch, const char *name, size_t namelen)
+{
+    char buf[KEY_BUFFER_SIZE];
+    size_t keylen;
+    const char *key = parity_key(batch->pdb, name, namelen, buf, &keylen);
+    leveldb_writebatch_delete(batch->wb, key, keylen);
+    batch_added(batch);
+}
+
+static
+void batch_put_tagged(PdbBatch *batch, char tag, const char *name, size_t namelen,
+        const void *val, size_t vallen)
+{
+    char buf[KEY_BUFFER_SIZE];
+    size_t keylen;
+    const char *key = tagged_key(batch->pdb, tag, name, namelen, buf, &keylen);
+    if (val != NULL)
+        leveldb_writebatch_put(batch->wb, key, keylen, val, vallen);
+    else
+        leveldb_writebatch_delete(batch->wb, key, keylen);
+    batch_added(batch);
+}
+
+void pdb_batch_set_stripe(PdbBatch *batch, const char *name, size_t namelen,
+        const uint8_t *list, size_t len)
+{
+    batch_put_tagged(batch, STRIPE_KEY_TAG, name, namelen, list, len);
+}
+
+void pdb_batch_del_stripe(PdbBatch *batch, const char *name, size_t namelen)
+{
+    batch_put_tagged(batch, STRIPE_KEY_TAG, name, namelen, NULL, 0);
+}
+
+void pdb_batch_set_stripe_of(PdbBatch *batch, const char *name, size_t namelen,
+        const char *stripe, size_t stripe_len)
+{
+    batch_put_tagged(batch, STRIPE_OF_KEY_TAG, name, namelen, stripe, stripe_len);
+}
+
+void pdb_batch_del_stripe_of(PdbBatch *batch, const char *name, size_t namelen)
+{
+    batch_put_tagged(batch, STRIPE_OF_KEY_TAG, name, namelen, NULL, 0);
+}
+
+void pdb_batch_destroy(PdbBatch *batch)
+{
+    pdb_batch_flush(batch);
+    leveldb_writebatch_destroy(batch->wb);
+    free(batch);
+}
+
+/* Same order as the default leveldb comparator */
+static
+int cmp_keys(const char *a, size_t alen, const char *b, size_t blen)
 {
+    int r = memcmp(a, b, (alen < blen)? alen : blen);
+    if (r != 0)
+        return r;
+    return (alen > blen) - (alen < blen);
+}
+
+static
+int cmp_lookups(const void *pa, const void *pb)
+{
+    const Lookup *a = pa;
+    const Lookup *b = pb;
+    return cmp_keys(a->key, a->keylen, b->key, b->keylen);
+}
+
+size_t pdb_get_many(const PersistentDB *pdb,
+        const char *const *keys, const size_t *keylens, size_t n,
+        FileInfo *vals, int *found)
+{
+    if (n == 0)
+        return 0;
+    if (pdb->snapshot != NULL) {
+        size_t nfound = 0;
+        for (size_t i = 0; i < n; i++) {
+            found[i] = pdb_get(pdb, keys[i], keylens[i], &vals[i]);
+            nfound += found[i];
+        }
+        return nfound;
+    }
+    /* The stored keys are what is sorted, they all go in one buffer */
+    size_t encoded_bytes = 0;
+    if (HAS_BINARY_KEYS(pdb))
+        for (size_t i = 0; i < n; i++)
+            encoded_bytes += CHUNK_KEY_MAX(keylens[i]);
+    Lookup *lookups = malloc(n*sizeof(Lookup));
+    char *encoded = malloc(MAX(encoded_bytes, (size_t)1));
+    if (lookups == NULL || encoded == NULL)
+        err(1, "Out of memory for database lookup");
+    char *pos = encoded;
+    for (size_t i = 0; i < n; i++) {
+        if (HAS_BINARY_KEYS(pdb)) {
+            lookups[i].key = pos;
+            lookups[i].keylen = chunk_key_encode(keys[i], keylens[i], pos);
+            pos += lookups[i].keylen;
+        }
+        else {
+            lookups[i].key = keys[i];
+            lookups[i].keylen = keylens[i];
+        }
+        lookups[i].index = i;
+        found[i] = 0;
+    }
+    qsort(lookups, n, sizeof(Lookup), cmp_lookups);
+
+    size_t nfound = 0;
+    leveldb_iterator_t *iter = leveldb_create_iterator(pdb->db, pdb->scan_ropts);
+    leveldb_iter_seek(iter, lookups[0].key, lookups[0].keylen);
+    for (size_t i = 0; i < n && leveldb_iter_valid(iter); i++) {
+        const Lookup *l = &lookups[i];
+        size_t keylen;
+        const char *key = leveldb_iter_key(iter, &keylen);
+        int c = cmp_keys(key, keylen, l->key, l->keylen);
+        for (int steps = 0; c < 0; steps++) {
+            if (steps == MAX_STEPS_BEFORE_SEEK)
+                leveldb_iter_seek(iter, l->key, l->keylen);
+            else
+                leveldb_iter_next(iter);
+            if (!leveldb_iter_valid(iter))
+                break;
+            key = leveldb_iter_key(iter, &keylen);
+            c = cmp_keys(key, keylen, l->key, l->keylen);
+        }
+        if (c != 0 || !leveldb_iter_valid(iter))
+            continue;
+        size_t vallen;
+        const char *val = leveldb_iter_value(iter, &vallen);
+        assert(vallen == sizeof(FileInfo));
+        memcpy(&vals[l->index], val, sizeof(FileInfo));
+        found[l->index] = 1;
+        nfound += 1;
+        /* Duplicate keys in the list find the same entry */
+        if (i + 1 < n && cmp_lookups(l, l + 1) != 0)
+            leveldb_iter_next(iter);
+    }
+    char *errmsg = NULL;
+    leveldb_iter_get_error(iter, &errmsg);
+    if (errmsg != NULL)
+        errx(1, "Database lookup failed: %s", errmsg);
+    leveldb_iter_destroy(iter);
+    free(lookups);
+    free(encoded);
+    return nfound;
+}
+
+void pdb_keep_shard(PersistentDB *pdb, int st, int nowners, uint64_t new_version)
+{
+    must_be_writable(pdb);
+    char buf[KEY_BUFFER_SIZE];
+    PdbBatch *batch = pdb_batch_create(pdb);
+    leveldb_iterator_t *iter = leveldb_create_iterator(pdb->db, pdb->scan_ropts);
+    for (leveldb_iter_seek_to_first(iter); leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+        size_t keylen, vallen;
+        const char *key = leveldb_iter_key(iter, &keylen);
+        const char *val = leveldb_iter_value(iter, &vallen);
+        if (!is_record(key, keylen, vallen))
+            continue;
+        FileInfo fi;
+        memcpy(&fi, val, sizeof(FileInfo));
+        size_t namelen;
+        const char *name = name_of_key(pdb, key, keylen, buf, &namelen);
+        if (!TEST_BIT(db_holders(name, namelen, fi.locations, nowners), st))
+            pdb_batch_del(batch, name, namelen);
+    }
+    leveldb_iter_destroy(iter);
+    pdb_batch_destroy(batch);
+    pdb_set_version(pdb, new_version);
+}
+
+void pdb_convert_keys(PersistentDB *pdb, uint64_t new_version)
+{
+    must_be_writable(pdb);
+    assert(!HAS_BINARY_KEYS(pdb) && new_version > DB_VERSION_TEXT_KEYS);
+    char buf[KEY_BUFFER_SIZE];
+    PdbBatch *batch = pdb_batch_create(pdb);
+    leveldb_iterator_t *iter = leveldb_create_iterator(pdb->db, pdb->scan_ropts);
+    for (leveldb_iter_seek_to_first(iter); leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+        size_t keylen, vallen;
+        const char *key = leveldb_iter_key(iter, &keylen);
+        const char *val = leveldb_iter_value(iter, &vallen);
+        /* Converted by an earlier attempt that didn't finish */
+        if (!is_record(key, keylen, vallen) || chunk_key_is_encoded(key, keylen))
+            continue;
+        if (keylen > PDB_MAX_KEY_LEN)
+            errx(1, "Database key too long (%zu bytes)", keylen);
+        FileInfo fi;
+        memcpy(&fi, val, sizeof(FileInfo));
+        size_t encoded_len = chunk_key_encode(key, keylen, buf);
+        pdb_batch_set(batch, buf, encoded_len, &fi);
+        pdb_batch_del(batch, key, keylen);
+    }
+    leveldb_iter_destroy(iter);
+    pdb_batch_destroy(batch);
+    pdb_set_version(pdb, new_version);
+}
+
+/* The parity locations come after the records in a snapshot */
+static
+uint64_t snapshot_records_end(const DbSnapshot *snapshot)
+{
+    const char tag = PARITY_KEY_TAG;
+    return db_snapshot_lower_bound(snapshot, &tag, 1);
+}
+
+/* Stored keys from `from` up to but not including `to`, NULL is no limit */
+typedef struct {
+    const PersistentDB *pdb;
+    const PdbSplit *from;
+    const PdbSplit *to;
+    ProcessRangeFileInfos f;
+    void *arg;
+} RangeScan;
+
+static
+void *scan_range(void *p)
+{
+    const RangeScan *scan = p;
+    const PersistentDB *pdb = scan->pdb;
     int is_done = 0;
-    char tmp_key[200];
+    char tmp_key[KEY_BUFFER_SIZE];
+    size_t namelen;
+    if (pdb->snapshot != NULL) {
+        /* Plain keys in the snapshot already end with a '\0' */
+        const DbSnapshot *snapshot = pdb->snapshot;
+        /* The splits can come from another database, and reach in to the
+         * parity locations */
+        uint64_t records_end = snapshot_records_end(snapshot);
+        uint64_t first = (scan->from == NULL)? 0
+            : db_snapshot_lower_bound(snapshot, scan->from->key, scan->from->len);
+        uint64_t end = (scan->to == NULL)? records_end
+            : db_snapshot_lower_bound(snapshot, scan->to->key, scan->to->len);
+        end = MIN(end, records_end);
+        for (uint64_t i = first; !is_done && i < end; i++) {
+            const SnapshotRecord *r = &snapshot->records[i];
+            const char *key = snapshot->heap + r->key_offset;
+            if (HAS_BINARY_KEYS(pdb))
+                key = name_of_key(pdb, key, r->key_len, tmp_key, &namelen);
+            else
+                namelen = r->key_len;
+            is_done = scan->f(scan->arg, key, namelen, &r->info);
+        }
+        return NULL;
+    }
     leveldb_iterator_t *iter = leveldb_create_iterator(pdb->db, pdb->ropts);
-    leveldb_iter_seek_to_first(iter);
+    if (scan->from == NULL)
+        leveldb_iter_seek_to_first(iter);
+    else
+        leveldb_iter_seek(iter, scan->from->key, scan->from->len);
     while (!is_done && leveldb_iter_valid(iter)) {
         size_t keylen;
         const char *key = leveldb_iter_key(iter, &keylen);
-        memcpy(tmp_key, key, keylen);
-        tmp_key[keylen] = '\0';
+        if (scan->to != NULL && cmp_keys(key, keylen, scan->to->key, scan->to->len) >= 0)
+            break;
+        /* Only the parity locations, stripes and the version come after the
+         * records */
+        if (HAS_BINARY_KEYS(pdb) && keylen > 0 && (uint8_t)key[0] >= PARITY_KEY_TAG)
+            break;
         size_t vallen;
         const char *val = leveldb_iter_value(iter, &vallen);
-        if (strcmp(tmp_key, FORMAT_VERSION_KEY) != 0 && vallen == sizeof(FileInfo))
-            is_done = f(tmp_key, keylen, (const FileInfo*)val);
+        if (is_record(key, keylen, vallen)) {
+            name_of_key(pdb, key, keylen, tmp_key, &namelen);
+            is_done = scan->f(scan->arg, tmp_key, namelen, (const FileInfo*)val);
+        }
+        leveldb_iter_next(iter);
+    }
+    leveldb_iter_destroy(iter);
+    return NULL;
+}
+
+static
+int call_process_file_infos(void *arg, const char *key, size_t keylen, const FileInfo *info)
+{
+    const ProcessFileInfos *f = arg;
+    return (*f)(key, keylen, info);
+}
+
+void pdb_iterate(const PersistentDB *pdb, ProcessFileInfos f)
+{
+    RangeScan scan = { pdb, NULL, NULL, call_process_file_infos, &f };
+    scan_range(&scan);
+}
+
+/* Evenly spaced records */
+static
+void count_keys(const PersistentDB *pdb, int nparts, PdbSplit *splits)
+{
+    leveldb_iterator_t *iter = leveldb_create_iterator(pdb->db, pdb->scan_ropts);
+    size_t n = 0;
+    for (leveldb_iter_seek_to_first(iter); leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+        size_t keylen, vallen;
+        const char *key = leveldb_iter_key(iter, &keylen);
+        leveldb_iter_value(iter, &vallen);
+        n += is_record(key, keylen, vallen);
+    }
+    int part = 1;
+    size_t i = 0;
+    for (leveldb_iter_seek_to_first(iter); leveldb_iter_valid(iter) && part < nparts; leveldb_iter_next(iter)) {
+        size_t keylen, vallen;
+        const char *key = leveldb_iter_key(iter, &keylen);
+        leveldb_iter_value(iter, &vallen);
+        if (!is_record(key, keylen, vallen) || i++ < n*part/nparts)
+            continue;
+        splits[part - 1].len = keylen;
+        memcpy(splits[part - 1].key, key, keylen);
+        part += 1;
+    }
+    leveldb_iter_destroy(iter);
+    /* Fewer keys than parts, the rest of the parts are empty */
+    for (; part < nparts; part++) {
+        if (part == 1)
+            splits[0].len = 0;
+        else
+            splits[part - 1] = splits[part - 2];
+    }
+}
+
+/* The approximate on-disk size of the keys before an 8 byte prefix */
+static
+uint64_t size_before(const PersistentDB *pdb, uint64_t prefix)
+{
+    char limit[8];
+    for (int i = 0; i < 8; i++)
+        limit[i] = (char)(prefix >> (56 - 8*i));
+    const char *start = "";
+    size_t start_len = 0;
+    const char *limit_key = limit;
+    size_t limit_len = sizeof(limit);
+    uint64_t size;
+    leveldb_approximate_sizes(pdb->db, 1, &start, &start_len, &limit_key, &limit_len, &size);
+    return size;
+}
+
+void pdb_split(const PersistentDB *pdb, int nparts, PdbSplit *splits)
+{
+    if (nparts <= 1)
+        return;
+    if (pdb->snapshot != NULL) {
+        const DbSnapshot *snapshot = pdb->snapshot;
+        uint64_t nrecords = snapshot_records_end(snapshot);
+        for (int part = 1; part < nparts; part++) {
+            uint64_t i = nrecords*part/nparts;
+            /* Only an empty snapshot gets here, and every part is empty */
+            if (i == nrecords) {
+                splits[part - 1].len = 0;
+                continue;
+            }
+            const SnapshotRecord *r = &snapshot->records[i];
+            splits[part - 1].len = r->key_len;
+            memcpy(splits[part - 1].key, snapshot->heap + r->key_offset, r->key_len);
+        }
+        return;
+    }
+    /*
+     * leveldb only knows the size of what has been written to tables, what
+     * is still in the log is invisible to it. If there is too little on disk
+     * to go by we count the keys instead.
+     */
+    uint64_t total = size_before(pdb, HAS_BINARY_KEYS(pdb)? (uint64_t)PARITY_KEY_TAG << 56 : UINT64_MAX);
+    if (total < SPLIT_MIN_TABLE_BYTES) {
+        count_keys(pdb, nparts, splits);
+        return;
+    }
+    uint64_t lo = 0;
+    for (int part = 1; part < nparts; part++) {
+        uint64_t target = total/nparts*part;
+        uint64_t hi = UINT64_MAX;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo)/2;
+            if (size_before(pdb, mid) < target)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        splits[part - 1].len = 8;
+        for (int i = 0; i < 8; i++)
+            splits[part - 1].key[i] = (char)(lo >> (56 - 8*i));
+    }
+}
+
+void pdb_iterate_parallel(const PersistentDB *pdb, int nparts, const PdbSplit *splits,
+        ProcessRangeFileInfos f, void *const *args)
+{
+    RangeScan *scans = calloc(nparts, sizeof(RangeScan));
+    pthread_t *threads = calloc(nparts, sizeof(pthread_t));
+    if (scans == NULL || threads == NULL)
+        err(1, "Out of memory for database scan");
+    for (int part = 0; part < nparts; part++) {
+        scans[part].pdb = pdb;
+        scans[part].from = (part == 0)? NULL : &splits[part - 1];
+        scans[part].to = (part == nparts - 1)? NULL : &splits[part];
+        scans[part].f = f;
+        scans[part].arg = args[part];
+        int rc = pthread_create(&threads[part], NULL, scan_range, &scans[part]);
+        if (rc != 0)
+            errx(1, "Couldn't start database scan thread: %s", strerror(rc));
+    }
+    for (int part = 0; part < nparts; part++)
+        pthread_join(threads[part], NULL);
+    free(threads);
+    free(scans);
+}
+
+void pdb_iterate_parity(const PersistentDB *pdb, ProcessParityLocations f, void *arg)
+{
+    const char tag = PARITY_KEY_TAG;
+    char name[KEY_BUFFER_SIZE];
+    int is_done = 0;
+    if (!HAS_BINARY_KEYS(pdb))
+        return;
+    if (pdb->snapshot != NULL) {
+        const DbSnapshot *snapshot = pdb->snapshot;
+        for (uint64_t i = snapshot_records_end(snapshot); !is_done && i < snapshot->nrecords; i++) {
+            const SnapshotRecord *r = &snapshot->records[i];
+            const char *key = snapshot->heap + r->key_offset;
+            if (!IS_PARITY_KEY(key, r->key_len))
+                break;
+            ParityLocation loc;
+            memcpy(&loc, &r->info, sizeof(loc));
+            size_t namelen = chunk_key_decode(key + 1, r->key_len - 1, name, sizeof(name));
+            is_done = f(arg, name, namelen, &loc);
+        }
+        return;
+    }
+    leveldb_iterator_t *iter = leveldb_create_iterator(pdb->db, pdb->scan_ropts);
+    leveldb_iter_seek(iter, &tag, 1);
+    while (!is_done && leveldb_iter_valid(iter)) {
+        size_t keylen, vallen;
+        const char *key = leveldb_iter_key(iter, &keylen);
+        const char *val = leveldb_iter_value(iter, &vallen);
+        if (!IS_PARITY_KEY(key, keylen))
+            break;
+        if (!is_parity_value(val, vallen))
+            errx(1, "Corrupt parity location in database");
+        ParityLocation loc;
+        memcpy(&loc, val, sizeof(loc));
+        size_t namelen = chunk_key_decode(key + 1, keylen - 1, name, sizeof(name));
+        is_done = f(arg, name, namelen, &loc);
         leveldb_iter_next(iter);
     }
     leveldb_iter_destroy(iter);
@@ -5,14 +5,117 @@
 
 #include "common.h"
 
+/*
+ * Keys are chunk names, with a '\0' when the database hands them out. How
+ * they are stored depends on the version, see chunk_key.h.
+ */
+#define PDB_MAX_KEY_LEN 4096
+
 typedef struct PersistentDB PersistentDB;
+typedef struct PdbBatch PdbBatch;
 typedef int (*ProcessFileInfos)(const char *key, size_t keylen, const FileInfo* info);
+typedef int (*ProcessRangeFileInfos)(void *arg, const char *key, size_t keylen, const FileInfo *info);
+typedef int (*ProcessParityLocations)(void *arg, const char *key, size_t keylen, const ParityLocation *loc);
+
+/* A position in the stored keys, see pdb_split */
+typedef struct {
+    size_t len;
+    char key[PDB_MAX_KEY_LEN + 2];
+} PdbSplit;
 
-PersistentDB* pdb_init(const char *db_folder, uint64_t expected_version);
+/* Opens databases from oldest_version up to expected_version, a new one gets
+ * expected_version */
+PersistentDB* pdb_init(const char *db_folder, uint64_t expected_version, uint64_t oldest_version);
+uint64_t pdb_version(const PersistentDB *pdb);
+/* For upgrades that don't change anything that is already stored */
+void pdb_set_version(PersistentDB *pdb, uint64_t version);
+/*
+ * A snapshot is a read-only copy of the database in a single file, see
+ * db_snapshot.h. pdb_open_snapshot returns NULL if there is no snapshot, and
+ * otherwise a database where everything but the writes works.
+ */
+PersistentDB* pdb_open_snapshot(const char *path, uint64_t expected_version, uint64_t oldest_version);
+void pdb_write_snapshot(const PersistentDB *pdb, const char *path);
+/* The snapshot of a database lives next to its folder */
+void pdb_snapshot_path(const char *db_folder, char *path, size_t path_len);
 void pdb_term(PersistentDB *pdb);
 void pdb_set(PersistentDB *pdb, const char *key, size_t keylen, const FileInfo *val);
 void pdb_del(PersistentDB *pdb, const char *key, size_t keylen);
 int pdb_get(const PersistentDB *pdb, const char *key, size_t keylen, FileInfo *val);
+/*
+ * Looks up n keys in one pass over the database: the keys are sorted and
+ * matched against a single iterator, instead of a random read for each.
+ * The results go in to vals[i] and found[i] in the order the keys were given.
+ * Returns the number of keys found.
+ */
+size_t pdb_get_many(const PersistentDB *pdb,
+        const char *const *keys, const size_t *keylens, size_t n,
+        FileInfo *vals, int *found);
+/*
+ * Updates collected by one thread and written to the database together.
+ * The batch is committed on its own when it gets big or old enough, and by
+ * pdb_batch_flush; pdb_batch_destroy commits what is left.
+ */
+PdbBatch* pdb_batch_create(PersistentDB *pdb);
+void pdb_batch_set(PdbBatch *batch, const char *key, size_t keylen, const FileInfo *val);
+void pdb_batch_del(PdbBatch *batch, const char *key, size_t keylen);
+void pdb_batch_flush(PdbBatch *batch);
+/*
+ * A held batch is never committed on its own, for updates that mustn't reach
+ * the database before something else is done. pdb_batch_flush_sync commits a
+ * batch and waits for it to be on disk.
+ */
+PdbBatch* pdb_batch_create_held(PersistentDB *pdb);
+void pdb_batch_flush_sync(PdbBatch *batch);
+/*
+ * The P target of a small file keeps where its parity is in a container,
+ * apart from the record of the file. Needs a database with packed keys.
+ * A location with INLINE_PARITY comes with the parity itself, in
+ * `inline_parity` of INLINE_PARITY_MAX bytes.
+ */
+int pdb_get_parity(const PersistentDB *pdb, const char *key, size_t keylen,
+        ParityLocation *loc, uint8_t *inline_parity);
+void pdb_batch_set_parity(PdbBatch *batch, const char *key, size_t keylen,
+        const ParityLocation *loc, const uint8_t *inline_parity);
+void pdb_batch_del_parity(PdbBatch *batch, const char *key, size_t keylen);
+void pdb_iterate_parity(const PersistentDB *pdb, ProcessParityLocations f, void *arg);
+/*
+ * The member list of a stripe (see stripe.h), and the stripe a file is a
+ * member of. The getters return the length, 0 if there is none, and
+ * `stripe` needs PDB_MAX_KEY_LEN + 1 bytes. Needs packed keys as well.
+ */
+size_t pdb_get_stripe(const PersistentDB *pdb, const char *key, size_t keylen,
+        uint8_t *list, size_t maxlen);
+size_t pdb_get_stripe_of(const PersistentDB *pdb, const char *key, size_t keylen,
+        char *stripe);
+void pdb_batch_set_stripe(PdbBatch *batch, const char *key, size_t keylen,
+        const uint8_t *list, size_t len);
+void pdb_batch_del_stripe(PdbBatch *batch, const char *key, size_t keylen);
+void pdb_batch_set_stripe_of(PdbBatch *batch, const char *key, size_t keylen,
+        const char *stripe, size_t stripe_len);
+void pdb_batch_del_stripe_of(PdbBatch *batch, const char *key, size_t keylen);
+void pdb_batch_destroy(PdbBatch *batch);
+/*
+ * The shard of target st is the records it is one of the db_holders of.
+ * pdb_keep_shard deletes everything else and stamps the database with
+ * new_version.
+ */
+void pdb_keep_shard(PersistentDB *pdb, int st, int nowners, uint64_t new_version);
+/* Converts the keys of a database with DB_VERSION_TEXT_KEYS in place */
+void pdb_convert_keys(PersistentDB *pdb, uint64_t new_version);
 void pdb_iterate(const PersistentDB *pdb, ProcessFileInfos f);
+/*
+ * Splits the keys in to nparts ranges of about the same size and puts the
+ * nparts-1 points between them in `splits`. Part i is everything from
+ * splits[i-1] up to splits[i], and the first and last parts are open ended.
+ * The points are in terms of stored keys, so they can be used on any database
+ * of the same version - the ranges just won't be as even.
+ *
+ * pdb_iterate_parallel scans every part on a thread of its own, in key order
+ * within the part, and calls f with args[i] for the records of part i.
+ */
+void pdb_split(const PersistentDB *pdb, int nparts, PdbSplit *splits);
+void pdb_iterate_parallel(const PersistentDB *pdb, int nparts, const PdbSplit *splits,
+        ProcessRangeFileInfos f, void *const *args);
 
 #endif
@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "stripe.h"
+
+int is_stripe_name(const char *key, size_t keylen)
+{
+    size_t n = strlen(STRIPE_PREFIX);
+    return keylen > n && memcmp(key, STRIPE_PREFIX, n) == 0;
+}
+
+size_t stripe_encode(const StripeMembers *m, uint8_t *list)
+{
+    size_t pos = 0;
+    for (int i = 0; i < m->nmembers; i++) {
+        uint16_t len = strlen(m->names[i]);
+        list[pos] = (uint8_t)m->st[i];
+        memcpy(list + pos + 1, &len, sizeof(len));
+        memcpy(list + pos + 3, m->names[i], len + 1);
+        pos += 3 + len + 1;
+    }
+    return pos;
+}
+
+int stripe_decode(const uint8_t *list, size_t len, StripeMembers *m)
+{
+    m->nmembers = 0;
+    for (size_t pos = 0; pos < len; ) {
+        uint16_t name_len;
+        if (m->nmembers == STRIPE_MAX_MEMBERS || len - pos < 3)
+            return 0;
+        memcpy(&name_len, list + pos + 1, sizeof(name_len));
+        if (len - pos - 3 < (size_t)name_len + 1
+                || list[pos + 3 + name_len] != '\0'
+                || list[pos] >= MAX_STORAGE_TARGETS)
+            return 0;
+        m->st[m->nmembers] = list[pos];
+        m->names[m->nmembers] = (const char *)list + pos + 3;
+        m->nmembers += 1;
+        pos += 3 + name_len + 1;
+    }
+    return 1;
+}
+
+void stripe_chunk_paths(const StripeMembers *m, const char *paths[MAX_STORAGE_TARGETS])
+{
+    for (int st = 0; st < MAX_STORAGE_TARGETS; st++)
+        paths[st] = NULL;
+    for (int i = 0; i < m->nmembers; i++)
+        paths[m->st[i]] = m->names[i];
+}
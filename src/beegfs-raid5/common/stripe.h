@@ -0,0 +1,45 @@
+#ifndef __stripe__
+#define __stripe__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "persistent_db.h"
+
+/*
+ * The parity of a file with a single chunk is a copy of it. Such files, on
+ * different targets, are put together in a stripe instead - one parity block
+ * for up to STRIPE_MAX_MEMBERS files, on a target none of them are on.
+ *
+ * A stripe is a record of its own, with a name that starts with
+ * STRIPE_PREFIX, the targets of its members and its P. It works like a file
+ * that has a member as its chunk on each of those targets. The record of a
+ * member has its one chunk and no P, and the database keeps which stripe it
+ * is in as well as the members of each stripe, see pdb_get_stripe.
+ *
+ * The list of members is encoded as a target byte, the length of the name as
+ * a uint16_t and the name with a '\0' for each of them.
+ */
+#define STRIPE_PREFIX "stripe/"
+#define STRIPE_MAX_MEMBERS 8
+#define STRIPE_LIST_MAX (STRIPE_MAX_MEMBERS*(3 + PDB_MAX_KEY_LEN + 1))
+/* What the record of a member looks like, it still has to be in a stripe */
+#define IS_STRIPE_MEMBER(loc) \
+    (GET_P(loc) == NO_P && __builtin_popcountll((loc) & L_MASK) == 1)
+
+typedef struct {
+    int nmembers;
+    int st[STRIPE_MAX_MEMBERS];
+    const char *names[STRIPE_MAX_MEMBERS];
+} StripeMembers;
+
+int is_stripe_name(const char *key, size_t keylen);
+/* `list` needs STRIPE_LIST_MAX bytes, returns the length */
+size_t stripe_encode(const StripeMembers *m, uint8_t *list);
+/* The names point in to `list`. Returns 0 if it is malformed */
+int stripe_decode(const uint8_t *list, size_t len, StripeMembers *m);
+/* The chunk_paths of a task on the stripe, NULL for targets without a member */
+void stripe_chunk_paths(const StripeMembers *m, const char *paths[MAX_STORAGE_TARGETS]);
+
+#endif
@@ -16,8 +16,8 @@
 
 #include "common.h"
 #include "task_processing.h"
-
-#define FILE_TRANSFER_BUFFER_SIZE (10*1024*1024)
+#include "parity_container.h"
+#include "parity_writer.h"
 
 #define LOGERR(format, ...) do {\
     fprintf(hs->log, "%s:%d (%s): " format, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__);\
@@ -78,6 +78,26 @@ int open_fileid_new_parity(int wdir, const char *id, ssize_t expected_size)
     return fd;
 }
 
+/*
+ * The other ranges of the file may be writing to it already, so it can't be
+ * truncated to zero - but they all agree on the final size.
+ */
+static
+int open_fileid_parity_range(int wdir, const char *id, ssize_t final_size, off_t offset, off_t len)
+{
+    mkdir_for_file(wdir, id);
+    int fd = openat(wdir, id, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR);
+    if (fd > 0) {
+        if (ftruncate(fd, final_size) != 0) {
+            close(fd);
+            return -1;
+        }
+        if (len > 0)
+            posix_fallocate(fd, offset, len);
+    }
+    return fd;
+}
+
 #define P_rank(fi) (st2rank[GET_P((fi)->locations)])
 
 static
@@ -93,6 +113,21 @@ uint64_t div_round_up(uint64_t a, uint64_t b)
     return (a + (b - 1)) / b;
 }
 
+/* The part of chunks up to `max_cs` bytes long that the task covers */
+static
+void task_range(TaskInfo ti, uint64_t max_cs, uint64_t *start, uint64_t *len)
+{
+    if (ti.nranges <= 1) {
+        *start = 0;
+        *len = max_cs;
+        return;
+    }
+    uint64_t s = MIN((uint64_t)ti.range*TASK_RANGE_SIZE, max_cs);
+    uint64_t e = (ti.range + 1 == ti.nranges)? max_cs : MIN(s + TASK_RANGE_SIZE, max_cs);
+    *start = s;
+    *len = e - s;
+}
+
 static
 void xor_parity(uint8_t *restrict dst, size_t nbytes, const uint8_t *data, int nsources)
 {
@@ -108,6 +143,28 @@ void xor_parity(uint8_t *restrict dst, size_t nbytes, const uint8_t *data, int n
     }
 }
 
+/* Parity goes to `fd`, or to the inline parity if there is any */
+static
+ssize_t write_parity(int fd, uint8_t *inline_parity, const void *buf, size_t n, off_t offset)
+{
+    if (inline_parity == NULL)
+        return pwrite(fd, buf, n, offset);
+    memcpy(inline_parity + offset, buf, n);
+    return n;
+}
+
+/* Like pread, from `fd` or the `inline_len` bytes of inline parity */
+static
+ssize_t read_stored(int fd, const uint8_t *inline_parity, uint64_t inline_len,
+        void *buf, size_t n, off_t offset)
+{
+    if (inline_parity == NULL)
+        return pread(fd, buf, n, offset);
+    n = ((uint64_t)offset < inline_len)? MIN(n, inline_len - offset) : 0;
+    memcpy(buf, inline_parity + offset, n);
+    return n;
+}
+
 /*
  * Roles:
  *  chunk_sender - open file and start sending parts to P-rank
@@ -117,6 +174,9 @@ void xor_parity(uint8_t *restrict dst, size_t nbytes, const uint8_t *data, int n
 static
 void parity_generator(const char *path, const FileInfo *task, TaskInfo ti, HostState *hs)
 {
+    /* What we rebuild is the chunk of the target we are rebuilding */
+    if (ti.is_rebuilding && ti.chunk_paths != NULL)
+        path = ti.chunk_paths[hs->storage_target];
 #define IRECV_ALL(ii, loc, size) do { \
     for (int ii = 0; ii < active_source_ranks; ii++) \
         MPI_Irecv((loc), (size), MPI_BYTE, ranks[ii], \
@@ -163,6 +223,15 @@ void parity_generator(const char *path, const FileInfo *task, TaskInfo ti, HostS
     uint64_t max_cs = 0;
     for (int i = 0; i < active_source_ranks; i++)
         max_cs = MAX(max_cs, chunk_sizes[i]);
+    /* A chunk can change between the ranges of a file, so they all go with
+     * the size the first of them saw - and so does the header */
+    if (ti.range_max_cs != NULL) {
+        uint64_t first = __sync_val_compare_and_swap(ti.range_max_cs, RANGE_MAX_CS_UNSET, max_cs);
+        if (first != RANGE_MAX_CS_UNSET)
+            max_cs = first;
+        for (int i = 0; i < active_source_ranks; i++)
+            chunk_sizes[i] = MIN(chunk_sizes[i], max_cs);
+    }
     SEND_ALL(&max_cs, sizeof(max_cs));
 
     size_t final_parity_chunk_size = max_cs + active_source_ranks*sizeof(uint64_t);
@@ -173,18 +242,44 @@ void parity_generator(const char *path, const FileInfo *task, TaskInfo ti, HostS
         final_parity_chunk_size = chunk_sizes[my_index];
     }
 
+    uint64_t range_start, range_len;
+    task_range(ti, max_cs, &range_start, &range_len);
+    /* When rebuilding there are no chunk sizes in front of the data */
+    off_t data_offset = ti.is_rebuilding? 0 : active_source_ranks*sizeof(uint64_t);
+
     uint8_t *data_a = malloc(active_source_ranks * FILE_TRANSFER_BUFFER_SIZE);
     uint8_t *data_b = malloc(active_source_ranks * FILE_TRANSFER_BUFFER_SIZE);
     uint8_t *P_block = malloc(FILE_TRANSFER_BUFFER_SIZE);
-    uint64_t data_left = max_cs;
-    size_t buffer_size = MIN(FILE_TRANSFER_BUFFER_SIZE, max_cs);
+    uint64_t data_left = range_len;
+    size_t buffer_size = MIN(FILE_TRANSFER_BUFFER_SIZE, range_len);
     size_t final_size = max_cs + active_source_ranks*8;
-    int expected_messages = div_round_up(max_cs, FILE_TRANSFER_BUFFER_SIZE);
+    int expected_messages = div_round_up(range_len, FILE_TRANSFER_BUFFER_SIZE);
     int P_fd = hs->fd_null;
+    /* Where the parity starts in P_fd, it is only 0 for a file of its own */
+    off_t base = 0;
+    int in_container = 0;
+    /* Or the parity goes in the database */
+    uint8_t *P_inline = NULL;
     int have_had_error = hs->error;
     if (have_had_error == 0) {
-        P_fd = open_fileid_new_parity(hs->write_dir, path, final_size);
-        if (P_fd <= 0) {
+        if (ti.nranges > 1)
+            P_fd = open_fileid_parity_range(hs->write_dir, path, final_size,
+                    data_offset + range_start, range_len);
+        else if (!ti.is_rebuilding && ti.inline_parity != NULL && final_size <= INLINE_PARITY_MAX) {
+            P_inline = ti.inline_parity;
+            *ti.stored_at = (ParityLocation){ INLINE_PARITY, final_size, 0 };
+            unlinkat(hs->write_dir, path, 0);
+        }
+        else if (!ti.is_rebuilding && ti.container != NULL && final_size <= CONTAINER_MAX_ENTRY) {
+            P_fd = container_append(ti.container, final_size, ti.stored_at);
+            in_container = (P_fd > 0);
+            base = ti.stored_at->offset;
+            /* A parity file from when the file was bigger is stale now */
+            unlinkat(hs->write_dir, path, 0);
+        }
+        else
+            P_fd = open_fileid_new_parity(hs->write_dir, path, final_size);
+        if (P_inline == NULL && P_fd <= 0) {
             have_had_error = errno;
             LOGERR("opened parity chunk '%s' with error = '%s'\n",
                     path, strerror(errno));
@@ -194,11 +289,21 @@ void parity_generator(const char *path, const FileInfo *task, TaskInfo ti, HostS
         LOGERR("using null for '%s', we already have global errno %d\n",
                 path, hs->error);
 
+    /* With writer threads for the parity we only queue up the writes, and
+     * collect any error once they are all done */
+    ParityWrites writes = { 0, 0 };
+    int queued = hs->parity_writer != NULL && !ti.is_rebuilding
+        && P_inline == NULL && P_fd != hs->fd_null;
+
     /* If we are not rebuilding, we store all chunk sizes at the start of the
      * parity file. */
-    if (!ti.is_rebuilding)
-        if (write(P_fd, chunk_sizes, sizeof(uint64_t)*active_source_ranks) <= 0)
+    if (!ti.is_rebuilding && ti.range == 0) {
+        size_t n = sizeof(uint64_t)*active_source_ranks;
+        if (queued)
+            parity_writer_submit(hs->parity_writer, &writes, P_fd, chunk_sizes, n, base);
+        else if (write_parity(P_fd, P_inline, chunk_sizes, n, base) <= 0)
             have_had_error = errno;
+    }
 
     for (int msg_i = 0; msg_i < expected_messages; msg_i++)
     {
@@ -211,11 +316,16 @@ void parity_generator(const char *path, const FileInfo *task, TaskInfo ti, HostS
         xor_parity(P_block, buffer_size, data_a, active_source_ranks);
         if (!have_had_error) {
             ssize_t wsize = MIN(buffer_size, data_left);
-            ssize_t w = write(P_fd, P_block, wsize);
+            off_t offset = data_offset + range_start + (range_len - data_left);
+            ssize_t w = wsize;
+            if (queued)
+                parity_writer_submit(hs->parity_writer, &writes, P_fd, P_block, wsize, base + offset);
+            else
+                w = write_parity(P_fd, P_inline, P_block, wsize, base + offset);
             if (w <= 0) {
                 have_had_error = errno;
-                LOGERR("writing '%s' caused new error %d (%s) after %zu bytes\n",
-                        path, errno, strerror(errno), final_size - data_left);
+                LOGERR("writing '%s' caused new error %d (%s) at offset %zu\n",
+                        path, errno, strerror(errno), (size_t)offset);
             }
             data_left -= wsize;
         }
@@ -229,16 +339,28 @@ void parity_generator(const char *path, const FileInfo *task, TaskInfo ti, HostS
         ftruncate(P_fd, final_parity_chunk_size);
     }
 
+    if (queued) {
+        int e = parity_writer_wait(hs->parity_writer, &writes);
+        if (e != 0 && !have_had_error) {
+            have_had_error = e;
+            LOGERR("writing '%s' caused new error %d (%s)\n",
+                    path, e, strerror(e));
+        }
+    }
+
     if (hs->error == 0 && have_had_error != 0) {
         LOGERR("local error on '%s' elevated to global error\n", path);
         hs->error = have_had_error;
         hs->error_path = strdup(path);
     }
+    /* The entry in the container isn't worth pointing at */
+    if ((in_container || P_inline != NULL) && have_had_error != 0)
+        ti.stored_at->length = 0;
 
     free(P_block);
     free(data_a);
     free(data_b);
-    if (P_fd != hs->fd_null)
+    if (P_fd != hs->fd_null && !in_container)
         close(P_fd);
 #undef SEND_ALL
 #undef IRECV_ALL
@@ -248,17 +370,33 @@ static
 void chunk_sender(const char *path, const FileInfo *task, TaskInfo ti, HostState *hs)
 {
     int my_st = hs->storage_target;
+    /* Our chunk of a stripe is a file of its own, the parity isn't */
+    if (ti.chunk_paths != NULL && !(ti.is_rebuilding && ti.actual_P_st == my_st))
+        path = ti.chunk_paths[my_st];
     int coordinator = P_rank(task);
     int ntargets = active_ranks(task->locations);
     uint64_t fd_size = 0;
     int have_had_error = 0;
-    int fd = open_fileid_readonly(ti.read_dir, path);
+    /* The stored parity is either a file of its own, an entry in a
+     * container that starts at `base` or inline parity from the database */
+    int in_container = ti.is_rebuilding && ti.actual_P_st == my_st
+        && ti.stored_at != NULL && ti.stored_at->length != 0;
+    const uint8_t *P_inline = (in_container && ti.stored_at->container == INLINE_PARITY)?
+        ti.inline_parity : NULL;
+    uint64_t inline_len = (P_inline != NULL)? ti.stored_at->length : 0;
+    off_t base = (in_container && P_inline == NULL)? (off_t)ti.stored_at->offset : 0;
+    int fd = (P_inline != NULL)? hs->fd_zero
+        : in_container? container_read(ti.container, ti.stored_at->container)
+        : open_fileid_readonly(ti.read_dir, path);
     if (fd <= 0) {
         have_had_error = errno;
         fd = hs->fd_zero;
         LOGERR("opening '%s' caused new error %d (%s)\n",
                 path, errno, strerror(errno));
     }
+    else if (in_container) {
+        fd_size = ti.stored_at->length - ntargets*sizeof(uint64_t);
+    }
     else {
         struct stat st;
         fstat(fd, &st);
@@ -273,14 +411,18 @@ void chunk_sender(const char *path, const FileInfo *task, TaskInfo ti, HostState
 
     if (ti.is_rebuilding && ti.actual_P_st == my_st) {
         uint64_t chunk_sizes[MAX_STORAGE_TARGETS];
-        read(fd, chunk_sizes, ntargets*sizeof(uint64_t));
+        read_stored(fd, P_inline, inline_len, chunk_sizes, ntargets*sizeof(uint64_t), base);
         send_sync_message_to(coordinator, ti.tag, ntargets*sizeof(uint64_t), (uint8_t*)chunk_sizes);
     }
     else if (!ti.is_rebuilding)
         send_sync_message_to(coordinator, ti.tag, sizeof(fd_size), (uint8_t *)&fd_size);
 
-    uint64_t data_to_send = 0;
-    recv_sync_message_from(coordinator, ti.tag, sizeof(data_to_send), &data_to_send);
+    uint64_t max_cs = 0;
+    recv_sync_message_from(coordinator, ti.tag, sizeof(max_cs), &max_cs);
+    uint64_t range_start, data_to_send;
+    task_range(ti, max_cs, &range_start, &data_to_send);
+    /* A stored parity chunk has the chunk sizes in front of the data */
+    off_t data_offset = base + ((ti.is_rebuilding && ti.actual_P_st == my_st)? ntargets*sizeof(uint64_t) : 0);
 
     size_t buffer_size = MIN(FILE_TRANSFER_BUFFER_SIZE, data_to_send);
     uint8_t *data = malloc(FILE_TRANSFER_BUFFER_SIZE);
@@ -291,17 +433,21 @@ void chunk_sender(const char *path, const FileInfo *task, TaskInfo ti, HostState
     while (data_sent < data_to_send)
     {
         size_t data_left = data_to_send - data_sent;
-        if (have_had_error == 0 && data_sent < fd_size) {
-            ssize_t r = read(fd, data, MIN(buffer_size, data_left));
+        uint64_t pos = range_start + data_sent;
+        if (have_had_error == 0 && pos < fd_size) {
+            ssize_t r = read_stored(fd, P_inline, inline_len, data, MIN(buffer_size, data_left), data_offset + pos);
             if (r < 0) {
                 have_had_error = errno;
                 memset(data, 0, buffer_size);
-                LOGERR("reading '%s' caused new error %d (%s) after %zu bytes\n",
-                        path, errno, strerror(errno), data_sent);
+                LOGERR("reading '%s' caused new error %d (%s) at offset %zu\n",
+                        path, errno, strerror(errno), (size_t)pos);
             }
             if (r >= 0 && (size_t)r < buffer_size)
                 memset(data + r, 0, (buffer_size - r));
         }
+        /* Past the end of a short chunk we send zeros, not the last read */
+        else if (have_had_error == 0)
+            memset(data, 0, buffer_size);
         ti.sample->bytes_read += buffer_size;
         data_sent += buffer_size;
         send_sync_message_to(coordinator, ti.tag, buffer_size, data);
@@ -317,7 +463,7 @@ void chunk_sender(const char *path, const FileInfo *task, TaskInfo ti, HostState
     }
 
     free(data);
-    if (fd != hs->fd_zero)
+    if (fd != hs->fd_zero && !in_container)
         close(fd);
 }
 
@@ -3,6 +3,18 @@
 
 #include "common.h"
 #include "progress_reporting.h"
+#include "parity_writer.h"
+
+/*
+ * Large files can be split in to tasks for ranges of this many bytes of every
+ * chunk, where the last range takes whatever is left. The ranges of a file
+ * write to their own part of the parity file, so they can run at the same
+ * time on different lanes.
+ */
+#define TASK_RANGE_SIZE (1ULL << 30)
+
+/* Chunk data is sent, and parity written, in blocks of up to this size */
+#define FILE_TRANSFER_BUFFER_SIZE (10*1024*1024)
 
 typedef struct {
     int storage_target;
@@ -14,6 +26,8 @@ typedef struct {
     int write_dir;
     int read_chunk_dir;
     int read_parity_dir;
+    /* Writes the parity when set, otherwise the lanes write it themselves */
+    ParityWriter *parity_writer;
     FILE *log;
 } HostState;
 
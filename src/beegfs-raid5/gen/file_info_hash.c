@@ -1,22 +1,110 @@
 #include "file_info_hash.h"
 
-#include "khash.h"
-KHASH_MAP_INIT_STR(fih, size_t)
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+/*
+ * Open addressing with linear probing. A slot holds the full 64-bit hash and
+ * the index of the key, so a probe only touches the slot array until the
+ * hashes match - which for 64 bits means we have almost certainly found the
+ * key and the string compare is just a check.
+ *
+ * A hash of 0 marks an empty slot.
+ */
+typedef struct {
+    uint64_t hash;
+    uint64_t val;
+} Slot;
+
+/* Keys are interned in blocks that double in size up to the max, and never move */
+#define NAME_BLOCK_MIN_SIZE (64*1024)
+#define NAME_BLOCK_MAX_SIZE (16*1024*1024)
+#define MIN_SLOTS 1024
+/* How many keys of a batch are hashed and prefetched ahead of the probes */
+#define PREFETCH_GROUP 16
+
+typedef struct NameBlock {
+    struct NameBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} NameBlock;
 
 struct FileInfoHash {
-    khash_t(fih) *h;
+    Slot *slots;
+    size_t nslots; /* always a power of 2 */
+    size_t nkeys;
+    const char **keys; /* indexed by val */
+    size_t keys_capacity;
+    NameBlock *names;
+    size_t name_bytes;
 };
 
+static
+uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
+static
+uint64_t hash_key(const char *key, size_t len)
+{
+    uint64_t h = UINT64_C(0x9e3779b97f4a7c15) ^ len;
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, key, 8);
+        h = (h ^ w) * UINT64_C(0xbf58476d1ce4e5b9);
+        h ^= h >> 31;
+        key += 8;
+        len -= 8;
+    }
+    uint64_t w = 0;
+    memcpy(&w, key, len);
+    h = mix64(h ^ w);
+    return h? h : 1;
+}
+
+static
+void *checked_realloc(void *p, size_t size)
+{
+    void *res = realloc(p, size);
+    if (res == NULL)
+        err(1, "Out of memory in file info hash (wanted %zu bytes)", size);
+    return res;
+}
+
 FileInfoHash* fih_init()
 {
     FileInfoHash *res = calloc(1, sizeof(FileInfoHash));
-    res->h = kh_init(fih);
+    res->nslots = MIN_SLOTS;
+    res->slots = checked_realloc(NULL, MIN_SLOTS*sizeof(Slot));
+    memset(res->slots, 0, MIN_SLOTS*sizeof(Slot));
     return res;
 }
 
+void fih_clear(FileInfoHash *fih)
+{
+    while (fih->names != NULL) {
+        NameBlock *next = fih->names->next;
+        free(fih->names);
+        fih->names = next;
+    }
+    fih->name_bytes = 0;
+    fih->nkeys = 0;
+    memset(fih->slots, 0, fih->nslots*sizeof(Slot));
+}
+
 void fih_term(FileInfoHash *fih)
 {
-    kh_destroy(fih, fih->h);
+    fih_clear(fih);
+    free(fih->slots);
+    free(fih->keys);
     memset(fih, 0, sizeof(FileInfoHash));
     free(fih);
 }
@@ -30,19 +118,134 @@ void fih_add_info(FatFileInfo *fi, int src, int64_t time, int rm)
         fi->modified |= (1ULL << src);
 }
 
-int fih_get_or_create(const FileInfoHash *fih, const char *key, size_t *val)
+/* Combines what two sets of events say about the same file */
+void fih_merge_info(FatFileInfo *dst, const FatFileInfo *src)
 {
-    khash_t(fih) *h = fih->h;
-    khint_t it = kh_get(fih, h, key);
-    if (it != kh_end(h))
-    {
-        *val = kh_val(h, it);
-        return FIH_OLD;
+    dst->timestamp = MAX(dst->timestamp, src->timestamp);
+    dst->modified |= src->modified;
+    dst->deleted |= src->deleted;
+}
+
+static
+const char *intern(FileInfoHash *fih, const char *key, size_t key_len)
+{
+    NameBlock *block = fih->names;
+    if (block == NULL || block->size - block->used < key_len + 1) {
+        size_t size = (block == NULL)? NAME_BLOCK_MIN_SIZE : MIN(2*block->size, NAME_BLOCK_MAX_SIZE);
+        size = MAX(size, key_len + 1);
+        block = checked_realloc(NULL, sizeof(NameBlock) + size);
+        block->next = fih->names;
+        block->used = 0;
+        block->size = size;
+        fih->names = block;
+        fih->name_bytes += size;
     }
-    *val = kh_size(h);
-    int r;
-    it = kh_put_fih(h, key, &r);
-    kh_val(h, it) = *val;
+    char *n = block->data + block->used;
+    memcpy(n, key, key_len);
+    n[key_len] = '\0';
+    block->used += key_len + 1;
+    return n;
+}
+
+static
+void grow(FileInfoHash *fih)
+{
+    size_t nslots = 2*fih->nslots;
+    Slot *slots = checked_realloc(NULL, nslots*sizeof(Slot));
+    memset(slots, 0, nslots*sizeof(Slot));
+    for (size_t i = 0; i < fih->nslots; i++) {
+        Slot s = fih->slots[i];
+        if (s.hash == 0)
+            continue;
+        size_t j = s.hash & (nslots - 1);
+        while (slots[j].hash != 0)
+            j = (j + 1) & (nslots - 1);
+        slots[j] = s;
+    }
+    free(fih->slots);
+    fih->slots = slots;
+    fih->nslots = nslots;
+}
+
+static
+int get_or_create_hashed(FileInfoHash *fih, uint64_t h, const char *key, size_t key_len, size_t *val)
+{
+    size_t mask = fih->nslots - 1;
+    size_t i = h & mask;
+    for (;;) {
+        Slot *s = &fih->slots[i];
+        if (s->hash == 0)
+            break;
+        if (s->hash == h) {
+            const char *k = fih->keys[s->val];
+            if (strncmp(k, key, key_len) == 0 && k[key_len] == '\0') {
+                *val = s->val;
+                return FIH_OLD;
+            }
+        }
+        i = (i + 1) & mask;
+    }
+    if (fih->nkeys == fih->keys_capacity) {
+        fih->keys_capacity = MAX(2*fih->keys_capacity, MIN_SLOTS);
+        fih->keys = checked_realloc(fih->keys, fih->keys_capacity*sizeof(char *));
+    }
+    *val = fih->nkeys;
+    fih->keys[fih->nkeys++] = intern(fih, key, key_len);
+    fih->slots[i].hash = h;
+    fih->slots[i].val = *val;
+    /* Keep the load factor at or below 3/4 */
+    if (4*fih->nkeys > 3*fih->nslots)
+        grow(fih);
     return FIH_NEW;
 }
 
+int fih_get_or_create(FileInfoHash *fih, const char *key, size_t key_len, size_t *val)
+{
+    return get_or_create_hashed(fih, hash_key(key, key_len), key, key_len, val);
+}
+
+/*
+ * Same as calling fih_get_or_create on each key in turn, but the keys are
+ * hashed a group at a time and their slots prefetched before probing, so the
+ * cache misses of a group overlap instead of following each other.
+ */
+void fih_get_or_create_many(
+        FileInfoHash *fih,
+        size_t n,
+        const char *const *keys,
+        const size_t *key_lens,
+        size_t *vals,
+        int *status)
+{
+    uint64_t hashes[PREFETCH_GROUP];
+    for (size_t first = 0; first < n; first += PREFETCH_GROUP) {
+        size_t group = MIN((size_t)PREFETCH_GROUP, n - first);
+        size_t mask = fih->nslots - 1;
+        for (size_t j = 0; j < group; j++) {
+            hashes[j] = hash_key(keys[first + j], key_lens[first + j]);
+            __builtin_prefetch(&fih->slots[hashes[j] & mask]);
+        }
+        for (size_t j = 0; j < group; j++) {
+            size_t k = first + j;
+            status[k] = get_or_create_hashed(fih, hashes[j], keys[k], key_lens[k], &vals[k]);
+        }
+    }
+}
+
+const char *fih_key(const FileInfoHash *fih, size_t val)
+{
+    return fih->keys[val];
+}
+
+size_t fih_size(const FileInfoHash *fih)
+{
+    return fih->nkeys;
+}
+
+size_t fih_memory_use(const FileInfoHash *fih)
+{
+    return sizeof(FileInfoHash)
+        + fih->nslots*sizeof(Slot)
+        + fih->keys_capacity*sizeof(char *)
+        + fih->name_bytes;
+}
@@ -15,11 +15,28 @@ typedef struct {
     uint64_t deleted;
 } FatFileInfo;
 
+/*
+ * Maps paths to consecutive indices (0, 1, 2, ...) in the order they are first
+ * seen. The table interns the paths itself, so a key is only copied the first
+ * time it shows up, and the copies stay put until fih_clear/fih_term.
+ */
 typedef struct FileInfoHash FileInfoHash;
 
 FileInfoHash* fih_init();
 void fih_term(FileInfoHash *fih);
+void fih_clear(FileInfoHash *fih);
 void fih_add_info(FatFileInfo *fi, int src, int64_t time, int rm);
-int fih_get_or_create(const FileInfoHash *fih, const char *key, size_t *val);
+void fih_merge_info(FatFileInfo *dst, const FatFileInfo *src);
+int fih_get_or_create(FileInfoHash *fih, const char *key, size_t key_len, size_t *val);
+void fih_get_or_create_many(
+        FileInfoHash *fih,
+        size_t n,
+        const char *const *keys,
+        const size_t *key_lens,
+        size_t *vals,
+        int *status);
+const char *fih_key(const FileInfoHash *fih, size_t val);
+size_t fih_size(const FileInfoHash *fih);
+size_t fih_memory_use(const FileInfoHash *fih);
 
 #endif
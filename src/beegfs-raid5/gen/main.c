@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +16,7 @@
 #include <sys/statvfs.h>
 
 #include <pthread.h>
+#include <getopt.h>
 
 #include <mpi.h>
 
@@ -22,16 +24,41 @@
 #include "../common/persistent_db.h"
 #include "../common/progress_reporting.h"
 #include "../common/task_processing.h"
+#include "../common/parity_container.h"
+#include "../common/stripe.h"
 #include "file_info_hash.h"
-#include "assign_lanes.h"
+#include "spill_run.h"
+#include "wire_format.h"
+#include "task_scheduler.h"
+#include "size_sort.h"
 
 #define MAX_TARGETS MAX_STORAGE_TARGETS
 #define TARGET_BUFFER_SIZE (10*1024*1024)
 #define TARGET_SEND_THRESHOLD (1*1024*1024)
-
-#ifndef MAX_WORKITEMS
-#error "MAX_WORKITEMS should be defined in ../../src/beegfs-conf.sh!"
-#endif
+/* Feeders send a watermark to every eater after this many chunks */
+#define WATERMARK_INTERVAL 100000
+/* Minimum number of seconds between the starts of pipelined batches */
+#define PIPELINE_BATCH_INTERVAL 60
+
+/* Number of worklist entries encoded and exchanged at a time, over all eaters */
+#define KEYS_PER_BCAST (256*1024)
+/* Spilled runs are merged in to one when there are this many open */
+#define MAX_SPILL_RUNS 64
+/* Number of threads working on tasks in phase 2, each task is on one lane */
+#define N_LANES 12
+/* Bytes of live parity that compaction may copy at the end of a wave */
+#define COMPACTION_BUDGET (1ULL << 30)
+/* Files with a single chunk of up to this size are put in stripes */
+#define STRIPE_MAX_CHUNK (128*1024)
+/* The names of the worklist entries we make up are copied in to blocks of
+ * this size */
+#define NAME_BLOCK_SIZE (1024*1024)
+
+/* What a worklist entry is to the stripes, see stripe.h. A member comes
+ * right before its stripe in the worklist, with the other members. */
+#define STRIPE_ROLE_NONE 0
+#define STRIPE_ROLE_LEFT 1
+#define STRIPE_ROLE_MEMBER 2
 
 #define PROF_START(name) \
     struct timespec t_##name##_0; \
@@ -46,15 +73,27 @@
 static const int global_coordinator = 0;
 static int mpi_rank;
 static int mpi_world_size;
+/* Phase 1 runs concurrently with phase 2, so it gets its own communicator */
+static MPI_Comm p1_comm;
 
 int st2rank[MAX_STORAGE_TARGETS];
 int rank2st[MAX_STORAGE_TARGETS*2+1];
 int st_weight[MAX_STORAGE_TARGETS];
+/*
+ * The storage targets on the same host and behind the same switch as each
+ * target. Without a topology file every target is its own host, and they are
+ * all behind one switch.
+ */
+static uint64_t same_host[MAX_STORAGE_TARGETS];
+static uint64_t same_rack[MAX_STORAGE_TARGETS];
+static int have_topology;
+/* The targets that own files, see OWNER_ST */
+static int nowners;
 
 static
 void send_sync_message_to(int recieving_rank, int msg_size, void *msg)
 {
-    MPI_Send(msg, msg_size, MPI_BYTE, recieving_rank, 0, MPI_COMM_WORLD);
+    MPI_Send(msg, msg_size, MPI_BYTE, recieving_rank, 0, p1_comm);
 }
 
 static
@@ -64,15 +103,6 @@ int sts_in_use(uint64_t locations)
     return __builtin_popcountll(locations & L_MASK);
 }
 
-static
-unsigned simple_hash(const char *p, int len)
-{
-    unsigned h = 5381;
-    for (int i = 0; i < len; i++)
-        h = h + (h << 5) + p[i];
-    return h;
-}
-
 static
 int eater_rank_from_st(int storage_target)
 {
@@ -99,20 +129,141 @@ static void fill_in_missing_fields(FileInfo *dst, const FileInfo *src)
         dst->locations = WITH_P(dst->locations, NO_P);
 }
 
+/*
+ * A task: where its file is in the worklist, the lane it runs on, and which
+ * range of the file it covers
+ */
+typedef struct {
+    uint32_t item;
+    uint32_t lane;
+    uint32_t range;
+    uint32_t nranges;
+} TaskRef;
+
+/*
+ * What the lanes of a rank share about a file split in to ranges: how many of
+ * its ranges haven't finished yet, and the chunk size all of them use.
+ */
+typedef struct {
+    uint32_t ranges_left;
+    uint64_t max_cs;
+} RangeState;
+
 typedef struct {
     HostState *hs;
     PersistentDB *pdb;
-    const char *worklist_keys;
+    const char **worklist_keys;
     FileInfo *worklist_info;
-    int *worklist_lanes;
+    const u64 *worklist_dropped;
+    const uint8_t *involved;
+    const uint8_t *stripe_role;
     size_t nitems;
+    RangeState *ranges;
+    const TaskRef *tasks;
+    size_t ntasks;
     ProgressSample *sample;
     int *working_counter;
     pthread_mutex_t *lock;
     int lane;
     int nlanes;
+    ParityContainer *container;
 } ListParams;
 
+/*
+ * Only the db_holders of a file keep its record. Targets that held the old
+ * record but aren't holders anymore are told so by `dropped`, and delete it.
+ */
+static
+void update_db(PdbBatch *updates, const char *key, const FileInfo *fi,
+        u64 dropped, int st)
+{
+    size_t len = strlen(key);
+    u64 holders = db_holders(key, len, fi->locations, nowners);
+    if ((fi->locations & L_MASK) && TEST_BIT(holders, st))
+        pdb_batch_set(updates, key, len, fi);
+    else if (TEST_BIT(holders | dropped, st))
+        pdb_batch_del(updates, key, len);
+}
+
+/* As P target we keep track of which files have their parity in a container
+ * or in the database */
+static
+void update_parity_location(PdbBatch *updates, const char *key, const ParityLocation *loc,
+        const uint8_t *inline_parity)
+{
+    if (loc->length != 0)
+        pdb_batch_set_parity(updates, key, strlen(key), loc, inline_parity);
+    else
+        pdb_batch_del_parity(updates, key, strlen(key));
+}
+
+/* The members of the stripe at entry i are the entries right before it */
+static
+void stripe_members_before(const ListParams *params, size_t i, StripeMembers *m)
+{
+    size_t first = i;
+    while (first > 0 && params->stripe_role[first - 1] == STRIPE_ROLE_MEMBER)
+        first--;
+    assert(i - first <= STRIPE_MAX_MEMBERS);
+    m->nmembers = 0;
+    for (size_t k = first; k < i; k++, m->nmembers++) {
+        m->st[m->nmembers] = __builtin_ctzll(params->worklist_info[k].locations & L_MASK);
+        m->names[m->nmembers] = params->worklist_keys[k];
+    }
+}
+
+/*
+ * The holders of a member's record keep which stripe it is in, and the
+ * holders of a stripe's record keep its members.
+ */
+static
+void update_stripe_db(PdbBatch *updates, const ListParams *params, size_t i, int st)
+{
+    const char *key = params->worklist_keys[i];
+    size_t len = strlen(key);
+    const FileInfo *fi = &params->worklist_info[i];
+    u64 holders = db_holders(key, len, fi->locations, nowners);
+    u64 dropped = params->worklist_dropped[i];
+    uint8_t role = params->stripe_role[i];
+    if (role == STRIPE_ROLE_MEMBER) {
+        size_t stripe = i + 1;
+        while (params->stripe_role[stripe] == STRIPE_ROLE_MEMBER)
+            stripe++;
+        const char *stripe_key = params->worklist_keys[stripe];
+        if (TEST_BIT(holders, st))
+            pdb_batch_set_stripe_of(updates, key, len, stripe_key, strlen(stripe_key));
+        else if (TEST_BIT(dropped, st))
+            pdb_batch_del_stripe_of(updates, key, len);
+    }
+    else if (role == STRIPE_ROLE_LEFT) {
+        if (TEST_BIT(holders | dropped, st))
+            pdb_batch_del_stripe_of(updates, key, len);
+    }
+    else if (is_stripe_name(key, len)) {
+        if ((fi->locations & L_MASK) && TEST_BIT(holders, st)) {
+            StripeMembers members;
+            uint8_t list[STRIPE_LIST_MAX];
+            stripe_members_before(params, i, &members);
+            size_t list_len = stripe_encode(&members, list);
+            pdb_batch_set_stripe(updates, key, len, list, list_len);
+        }
+        else if (TEST_BIT(holders | dropped, st))
+            pdb_batch_del_stripe(updates, key, len);
+    }
+}
+
+/*
+ * A lane works through the tasks it has been given, in worklist order, and
+ * then updates our shard of the database with its share of the entries we
+ * are not involved in. A file split in to ranges is put in the database by the
+ * lane that finishes its last range, and not at all if we have run in to an
+ * error - otherwise the next run would skip a file with half of its parity
+ * missing.
+ *
+ * Each lane collects its database updates in a batch of its own, so the lanes
+ * don't wait on each other to write single entries. The updates are
+ * committed in groups, and what is left is committed when the lane is done.
+ */
 static
 void *process_list(void *p)
 {
@@ -121,32 +272,44 @@ void *process_list(void *p)
     assert(hs);
     FileInfo *worklist_info = params->worklist_info;
     assert(worklist_info);
+    const u64 *dropped = params->worklist_dropped;
     PersistentDB *pdb = params->pdb;
     assert(pdb);
-    TaskInfo ti = { hs->read_chunk_dir, 0, -1, params->lane, params->sample };
-    const char *s = params->worklist_keys;
-    assert(s != NULL);
-    int lane = params->lane;
-    size_t nitems = params->nitems;
-    for (size_t i = 0; i < nitems; i++)
+    ParityLocation stored_at;
+    uint8_t inline_parity[INLINE_PARITY_MAX];
+    const char *chunk_paths[MAX_STORAGE_TARGETS];
+    TaskInfo ti = { hs->read_chunk_dir, 0, -1, params->lane, params->sample, 0, 0,
+        params->container, &stored_at, inline_parity, NULL, NULL };
+    const char **keys = params->worklist_keys;
+    assert(keys != NULL);
+    PdbBatch *updates = pdb_batch_create(pdb);
+    for (size_t k = 0; k < params->ntasks; k++)
     {
         struct timespec tv1;
         clock_gettime(CLOCK_MONOTONIC, &tv1);
 
-        const char *val = s;
-        size_t len = strlen(val);
-        s += len + 1;
-
-        if (params->worklist_lanes[i] != lane)
-            continue;
-        if (GET_P(worklist_info[i].locations) == NO_P)
-            continue;
-
-        int report = process_task(hs, val, worklist_info + i, ti);
-        if (worklist_info[i].locations & L_MASK)
-            pdb_set(pdb, val, len, worklist_info + i);
-        else
-            pdb_del(pdb, val, len);
+        const TaskRef *t = &params->tasks[k];
+        size_t i = t->item;
+        ti.range = t->range;
+        ti.nranges = t->nranges;
+        ti.range_max_cs = (t->nranges > 1)? &params->ranges[i].max_cs : NULL;
+        ti.chunk_paths = NULL;
+        if (is_stripe_name(keys[i], strlen(keys[i]))) {
+            StripeMembers members;
+            stripe_members_before(params, i, &members);
+            stripe_chunk_paths(&members, chunk_paths);
+            ti.chunk_paths = chunk_paths;
+        }
+        memset(&stored_at, 0, sizeof(stored_at));
+        int report = process_task(hs, keys[i], worklist_info + i, ti);
+        int last_range = (t->nranges <= 1)
+            || (__sync_sub_and_fetch(&params->ranges[i].ranges_left, 1) == 0 && hs->error == 0);
+        if (last_range) {
+            update_db(updates, keys[i], worklist_info + i, dropped[i], hs->storage_target);
+            if (GET_P(worklist_info[i].locations) == hs->storage_target)
+                update_parity_location(updates, keys[i], &stored_at, inline_parity);
+            update_stripe_db(updates, params, i, hs->storage_target);
+        }
 
         struct timespec tv2;
         clock_gettime(CLOCK_MONOTONIC, &tv2);
@@ -154,44 +317,179 @@ void *process_list(void *p)
             + (tv2.tv_nsec - tv1.tv_nsec) * 1e-9;
         if (report) {
             params->sample->dt += new_dt;
-            params->sample->nfiles += 1;
+            params->sample->nfiles += (t->range == 0);
         }
     }
+    for (size_t i = params->lane; i < params->nitems; i += params->nlanes)
+        if (!params->involved[i]) {
+            update_db(updates, keys[i], worklist_info + i, dropped[i], hs->storage_target);
+            update_stripe_db(updates, params, i, hs->storage_target);
+        }
+    pdb_batch_destroy(updates);
     pthread_mutex_lock(params->lock);
     *params->working_counter = *params->working_counter - 1;
     pthread_mutex_unlock(params->lock);
     return NULL;
 }
 
+/*
+ * The lane threads live for the whole run. For every batch phase 2 hands them
+ * new parameters and bumps `generation`, and each lane counts `working` down
+ * when it is done with its share.
+ */
+typedef struct LanePool LanePool;
+
 typedef struct {
-    int64_t timestamp;
-    uint64_t chunk_size;
-    uint64_t path_len;
-    uint64_t event_type;
-    char path[];
-} packed_file_info;
+    LanePool *pool;
+    int lane;
+} LaneThread;
+
+struct LanePool {
+    pthread_t threads[N_LANES];
+    LaneThread args[N_LANES];
+    ListParams params[N_LANES];
+    ParityContainer containers[N_LANES];
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    uint64_t generation;
+    int working;
+    int stop;
+};
+
+static
+void *lane_main(void *p)
+{
+    LaneThread *me = (LaneThread *)p;
+    LanePool *pool = me->pool;
+    uint64_t seen = 0;
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->stop)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        ListParams params = pool->params[me->lane];
+        pthread_mutex_unlock(&pool->lock);
+        process_list(&params);
+    }
+}
+
+static
+void lane_pool_init(LanePool *pool, ParityContainers *containers)
+{
+    memset(pool, 0, sizeof(LanePool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    for (int j = 0; j < N_LANES; j++) {
+        container_init(&pool->containers[j], containers);
+        pool->args[j].pool = pool;
+        pool->args[j].lane = j;
+        int rc = pthread_create(&pool->threads[j], NULL, lane_main, &pool->args[j]);
+        if (rc)
+            errx(1, "Thread create failed (rc = %d)", rc);
+    }
+}
+
+/* Hands every lane its parameters, the lanes run until `working` is 0 */
+static
+void lane_pool_start(LanePool *pool, const ListParams *params)
+{
+    pthread_mutex_lock(&pool->lock);
+    memcpy(pool->params, params, sizeof(pool->params));
+    for (int j = 0; j < N_LANES; j++) {
+        pool->params[j].working_counter = &pool->working;
+        pool->params[j].lock = &pool->lock;
+        pool->params[j].container = &pool->containers[j];
+    }
+    pool->working = N_LANES;
+    pool->generation += 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static
+void lane_pool_term(LanePool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int j = 0; j < N_LANES; j++) {
+        int rc = pthread_join(pool->threads[j], NULL);
+        if (rc)
+            errx(1, "Thread join error (rc = %d) on thread %d", rc, j);
+        container_close(&pool->containers[j]);
+    }
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+}
 
+/*
+ * Besides chunk events a feeder puts markers in its stream to every eater.
+ * A watermark promises that everything up to and including its path (in scan
+ * order) has been sent, and done means the feeder has nothing more to send.
+ */
+#define WATERMARK_EVENT 'w'
+#define FEEDER_DONE_EVENT 'x'
+
+/*
+ * The order bp-find-all-chunks lists chunks in: a depth first walk with the
+ * entries of each folder sorted bytewise. Comparing the paths component by
+ * component is the same as a bytewise compare where '/' sorts before anything.
+ */
+static
+int cmp_scan_order(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    size_t n = MIN(a_len, b_len);
+    for (size_t i = 0; i < n; i++) {
+        int ca = (a[i] == '/')? 0 : 1 + (unsigned char)a[i];
+        int cb = (b[i] == '/')? 0 : 1 + (unsigned char)b[i];
+        if (ca != cb)
+            return ca - cb;
+    }
+    if (a_len == b_len)
+        return 0;
+    return (a_len < b_len)? -1 : 1;
+}
+
+/* Everything an eater knows about a file, `name` points in to the store */
 typedef struct {
     uint64_t size;
-    uint64_t idx;
-} SizeIndex;
+    const char *name;
+    FatFileInfo info;
+} ReceivedFile;
 
 static
-int cmp_entries(const void *pa, const void *pb)
+int cmp_entry_names(const void *pa, const void *pb)
 {
-    uint64_t a = ((SizeIndex *)pa)->size;
-    uint64_t b = ((SizeIndex *)pb)->size;
-    if (a < b)
-        return -1;
-    if (a == b)
-        return 0;
-    return 1;
+    const char *a = ((ReceivedFile *)pa)->name;
+    const char *b = ((ReceivedFile *)pb)->name;
+    return cmp_scan_order(a, strlen(a), b, strlen(b));
 }
 
 static ssize_t  dst_written[MAX_TARGETS] = {0};
 static ssize_t  dst_in_transit[MAX_TARGETS] = {0};
 static MPI_Request async_send_req[MAX_TARGETS] = {0};
-static uint8_t dst_buffer[MAX_TARGETS][TARGET_BUFFER_SIZE];
+static uint8_t *dst_buffer[MAX_TARGETS];
+static WireState *dst_wire[MAX_TARGETS];
+
+/* Only the feeders send in phase 1, and only to the targets that exist */
+static
+void alloc_send_buffers(int ntargets)
+{
+    for (int st = 0; st < ntargets; st++) {
+        if (dst_buffer[st] != NULL)
+            continue;
+        dst_buffer[st] = malloc(TARGET_BUFFER_SIZE);
+        dst_wire[st] = calloc(1, sizeof(WireState));
+        if (dst_buffer[st] == NULL || dst_wire[st] == NULL)
+            err(1, "Can't allocate send buffers");
+    }
+}
 
 static
 int is_done_with_prev_async_send(int target)
@@ -225,13 +523,15 @@ void begin_async_send(int target)
     assert(dst_in_transit[target] == 0);
     assert(dst_written[target] > 0);
     dst_in_transit[target] = dst_written[target];
+    /* What is pushed from now on goes in the next message */
+    wire_reset(dst_wire[target]);
     MPI_Isend(
             dst_buffer[target],
             dst_in_transit[target],
             MPI_BYTE,
             eater_rank_from_st(target),
             0,
-            MPI_COMM_WORLD,
+            p1_comm,
             &async_send_req[target]);
 }
 
@@ -240,32 +540,44 @@ void push_to_target(int target, const char *path, int path_len, int64_t timestam
 {
     assert(0 <= target && target < MAX_TARGETS);
     assert(path != NULL);
-    assert(path_len > 0);
+    assert(path_len > 0 || event_type == FEEDER_DONE_EVENT);
 
     ssize_t in_transit = dst_in_transit[target];
     ssize_t written = dst_written[target];
     assert(in_transit <= written);
     assert(written <= TARGET_BUFFER_SIZE);
-    ssize_t new_size = written + sizeof(packed_file_info) + path_len;
-    if (new_size >= TARGET_BUFFER_SIZE
+    ssize_t max_size = written + WIRE_MAX_RECORD(path_len);
+    if (max_size >= TARGET_BUFFER_SIZE
             || is_done_with_prev_async_send(target)) {
-        new_size -= in_transit;
         written -= in_transit;
         in_transit = 0;
         finish_prev_async_send(target);
     }
 
-    packed_file_info finfo = {timestamp, chunk_size, path_len, event_type};
+    WireState *w = dst_wire[target];
     uint8_t *dst = dst_buffer[target] + written;
-    memcpy(dst, &finfo, sizeof(packed_file_info));
-    memcpy(dst + sizeof(packed_file_info), path, path_len);
-    dst_written[target] = written = new_size;
+    *dst++ = event_type;
+    dst = wire_put_path(w, dst, path, path_len);
+    dst = wire_put_timestamp(w, dst, timestamp);
+    dst = wire_put_varint(dst, chunk_size);
+    dst_written[target] = written = dst - dst_buffer[target];
 
     if (in_transit == 0 && written >= TARGET_SEND_THRESHOLD) {
         begin_async_send(target);
     }
 }
 
+/* Queues a marker after everything already pushed to each eater */
+static
+void push_marker_to_all(unsigned ntargets, const char *path, int path_len, uint8_t event_type)
+{
+    for (unsigned st = 0; st < ntargets; st++) {
+        push_to_target(st, path, path_len, 0, 0, event_type);
+        if (dst_in_transit[st] == 0)
+            begin_async_send(st);
+    }
+}
+
 static
 void send_remaining_data_to_targets(void)
 {
@@ -284,13 +596,16 @@ void send_remaining_data_to_targets(void)
 }
 
 static
-void feed_targets_with(FILE *input_file, unsigned ntargets)
+void feed_targets_with(FILE *input_file, unsigned ntargets, int in_scan_order)
 {
     char buf[64*1024];
     ssize_t buf_size = sizeof(buf);
     ssize_t buf_offset = 0;
     int read;
     int64_t counter = 0;
+    char last_path[4096];
+    size_t last_path_len = 0;
+    int since_watermark = 0;
     while ((read = fread(buf + buf_offset, 1, buf_size - buf_offset, input_file)) > 0)
     {
         size_t buf_alive = buf_offset + read;
@@ -307,7 +622,7 @@ void feed_targets_with(FILE *input_file, unsigned ntargets)
             }
             const char *path = bufp + 4*sizeof(uint64_t);
             assert(path[0] != '/' && "paths must be relative to chunk-dir");
-            unsigned st = (simple_hash(path, len_of_path)) % ntargets;
+            unsigned st = OWNER_ST(path, len_of_path, nowners);
             push_to_target(
                     st,
                     path,
@@ -315,6 +630,20 @@ void feed_targets_with(FILE *input_file, unsigned ntargets)
                     timestamp_secs,
                     chunk_size,
                     event_type);
+            if (in_scan_order) {
+                if (len_of_path >= sizeof(last_path))
+                    errx(1, "Path too long: '%.*s'", (int)len_of_path, path);
+                if (last_path_len > 0
+                        && cmp_scan_order(last_path, last_path_len, path, len_of_path) > 0)
+                    errx(1, "Chunks are not listed in scan order ('%.*s' after '%.*s')",
+                            (int)len_of_path, path, (int)last_path_len, last_path);
+                memcpy(last_path, path, len_of_path);
+                last_path_len = len_of_path;
+                if (++since_watermark == WATERMARK_INTERVAL) {
+                    push_marker_to_all(ntargets, path, len_of_path, WATERMARK_EVENT);
+                    since_watermark = 0;
+                }
+            }
             counter += 1;
             if (counter >= 10000) {
                 send_sync_message_to(global_coordinator, sizeof(counter), &counter);
@@ -328,6 +657,7 @@ void feed_targets_with(FILE *input_file, unsigned ntargets)
             memmove(buf, bufp, buf_alive);
         }
     }
+    push_marker_to_all(ntargets, "", 0, FEEDER_DONE_EVENT);
     send_remaining_data_to_targets();
     /* tell global-coordinator that we are done */
     send_sync_message_to(global_coordinator, sizeof(counter), &counter);
@@ -370,33 +700,113 @@ uint32_t pcg32_boundedrand_r(pcg32_random_t* rng, uint32_t bound)
 }
 /* -- end of PCG32 code -- */
 
+/*
+ * Parity work placed on each target: the number of parity files and the
+ * projected bytes written to them. `old_` is the same for where the free
+ * space weighted draw alone would have put P, for comparing the policies.
+ */
+typedef struct {
+    u64 files[MAX_TARGETS];
+    u64 bytes[MAX_TARGETS];
+    u64 old_files[MAX_TARGETS];
+    u64 old_bytes[MAX_TARGETS];
+    /* Chunk bytes sent to P through another switch */
+    u64 cross_rack_bytes;
+    u64 old_cross_rack_bytes;
+    /* Files with P on a host that has one of their chunks */
+    u64 shared_host_files;
+    u64 old_shared_host_files;
+} ParityLoad;
+
+/* Number of chunks of a file that have to cross a switch to get to P */
 static
-void shuffle(SizeIndex *array, size_t n)
+int cross_rack_sources(uint64_t locations, uint64_t P)
 {
-    if (n <= 1)
-        return;
-    pcg32_random_t rng = {0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL};
-    for (size_t i = n - 1; i > 0; i--) /* i = (n-1),(n-2),...,1 */
-    {
-        size_t j = pcg32_random_r(&rng) % (i + 1);
-        SizeIndex t = array[j];
-        array[j] = array[i];
-        array[i] = t;
-    }
+    return __builtin_popcountll(locations & L_MASK & ~same_rack[P]);
 }
 
 static
-void select_P(const char *path, FileInfo *fi, unsigned ntargets)
+int shares_host(uint64_t locations, uint64_t P)
+{
+    return (locations & L_MASK & same_host[P]) != 0;
+}
+
+static
+void add_parity_load(ParityLoad *load, uint64_t locations, uint64_t old_P, u64 bytes)
+{
+    uint64_t P = GET_P(locations);
+    load->shared_host_files += shares_host(locations, P);
+    load->old_shared_host_files += shares_host(locations, old_P);
+    load->files[P] += 1;
+    load->bytes[P] += bytes;
+    load->cross_rack_bytes += bytes*cross_rack_sources(locations, P);
+    load->old_files[old_P] += 1;
+    load->old_bytes[old_P] += bytes;
+    load->old_cross_rack_bytes += bytes*cross_rack_sources(locations, old_P);
+}
+
+static
+uint64_t draw_P(pcg32_random_t *rng, uint64_t blocked, unsigned ntargets)
 {
-    if (sts_in_use(fi->locations) == (int)ntargets)
-        return;
-    pcg32_random_t rng;
-    pcg32_srandom_r(&rng, simple_hash(path, strlen(path)), 0);
     uint64_t P;
     do {
-        int r = pcg32_boundedrand_r(&rng, st_weight[ntargets-1]);
+        int r = pcg32_boundedrand_r(rng, st_weight[ntargets-1]);
         for (P = 0; r >= st_weight[P]; P++) { }
-    } while (TEST_BIT(fi->locations, P));
+    } while (TEST_BIT(blocked, P));
+    return P;
+}
+
+/* Parity work on target `st` relative to its free space weight */
+static
+double relative_load(const ParityLoad *run, const ParityLoad *batch, uint64_t st)
+{
+    int weight = st_weight[st] - (st > 0? st_weight[st - 1] : 0);
+    u64 files = run->files[st] + batch->files[st];
+    u64 bytes = run->bytes[st] + batch->bytes[st];
+    return (double)(bytes + files*TASK_FIXED_COST) / MAX(weight, 1);
+}
+
+/*
+ * P is drawn at random with the targets weighted by their free space, seeded
+ * by the path so the candidates are the same every time. P can't be on a
+ * host that has a chunk of the file, unless every host has one.
+ *
+ * We draw two candidates - four with a topology file - and take the one that
+ * needs the fewest chunks sent through another switch, and then the one with
+ * the least parity work for its weight placed on it so far this run. `run`
+ * is everyone's work from earlier batches and `batch` is our own in this one.
+ * `*old_P` is where the first draw, only avoiding the chunks themselves,
+ * would put it.
+ */
+static
+void select_P(const char *path, FileInfo *fi, unsigned ntargets,
+        const ParityLoad *run, const ParityLoad *batch, uint64_t *old_P)
+{
+    if (sts_in_use(fi->locations) == (int)ntargets)
+        return;
+    uint64_t data = fi->locations & L_MASK;
+    uint64_t blocked = 0;
+    for (uint64_t t = data; t != 0; t &= t - 1)
+        blocked |= same_host[__builtin_ctzll(t)];
+    if ((~blocked & ((1ULL << ntargets) - 1)) == 0)
+        blocked = data;
+
+    uint32_t seed = simple_hash(path, strlen(path));
+    pcg32_random_t rng;
+    pcg32_srandom_r(&rng, seed, 0);
+    *old_P = draw_P(&rng, data, ntargets);
+    pcg32_srandom_r(&rng, seed, 0);
+    uint64_t P = draw_P(&rng, blocked, ntargets);
+    int ncandidates = have_topology? 4 : 2;
+    for (int i = 1; i < ncandidates; i++) {
+        uint64_t other = draw_P(&rng, blocked, ntargets);
+        int cross = cross_rack_sources(data, P);
+        int other_cross = cross_rack_sources(data, other);
+        if (other_cross < cross
+                || (other_cross == cross
+                    && relative_load(run, batch, other) < relative_load(run, batch, P)))
+            P = other;
+    }
     fi->locations = WITH_P(fi->locations, P);
 }
 
@@ -426,80 +836,1985 @@ int get_store_weight(int dirfd)
     return (int)(1000*log2(pct_free + 1.1));
 }
 
-int main(int argc, char **argv)
+static
+void *ensure_capacity(void *array, size_t *capacity, size_t needed, size_t element_size)
 {
-    if (argc != 6) {
-        fputs("We need 5 arguments\n", stdout);
-        return 1;
-    }
+    if (needed <= *capacity)
+        return array;
+    size_t new_capacity = MAX(MAX(2 * *capacity, needed), 1024);
+    void *res = realloc(array, new_capacity * element_size);
+    if (res == NULL)
+        err(1, "Out of memory (wanted %zu bytes)", new_capacity * element_size);
+    *capacity = new_capacity;
+    return res;
+}
 
-    const char *operation = argv[1];
-    const char *store_dir = argv[2];
-    const char *deletable = argv[3];
-    const char *data_file = argv[4];
-    const char *db_folder = argv[5];
+/*
+ * Everything an eater receives in phase 1 is kept here until it is turned in
+ * to worklists in phase 2. Every path is stored once, in the index, and the
+ * tables grow with the number of files actually seen. The store is reused
+ * between waves in daemon mode.
+ *
+ * With a memory budget the store spills sorted runs to `spill_dir` when the
+ * index uses more than half of the budget, and phase 2 takes batches of at
+ * most a quarter of it. The rest is left for the worklists.
+ *
+ * The phase 1 receiver thread adds to the store while phase 2 takes batches
+ * of resolved entries out of it, `lock` protects everything below it.
+ */
+typedef struct {
+    uint8_t *recv_buffer;
+    int ntargets;
+    size_t memory_budget;
+    const char *spill_dir;
+
+    pthread_mutex_t lock;
+    FileInfoHash *index;
+    ReceivedFile *files;
+    size_t nfiles;
+    size_t files_capacity;
+    size_t *pending;
+    size_t npending;
+    size_t pending_capacity;
+    ReceivedFile *batch;
+    size_t batch_capacity;
+    /* Only used with a memory budget, see take_resolved_entries */
+    ReceivedFile *resolved;
+    size_t nresolved;
+    size_t resolved_pos;
+    size_t resolved_capacity;
+    char *batch_names;
+    size_t batch_names_capacity;
+    SpillRun *runs;
+    size_t nruns;
+    size_t runs_capacity;
+    uint64_t spilled_runs;
+    uint64_t spilled_entries;
+    char *watermarks[MAX_TARGETS];
+    size_t watermark_len[MAX_TARGETS];
+    int feeder_done[MAX_TARGETS];
+} EventStore;
 
-    PROF_START(total);
+static
+void event_store_init(EventStore *store, int ntargets, size_t memory_budget, const char *spill_dir)
+{
+    memset(store, 0, sizeof(EventStore));
+    store->recv_buffer = calloc(1, TARGET_BUFFER_SIZE);
+    store->ntargets = ntargets;
+    store->memory_budget = memory_budget;
+    store->spill_dir = spill_dir;
+    store->index = fih_init();
+    pthread_mutex_init(&store->lock, NULL);
+}
 
-    int provided;
-    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
-    if (provided < MPI_THREAD_MULTIPLE) {
-        fputs("Your MPI does not support multithreading!\n", stderr);
-        MPI_Abort(MPI_COMM_WORLD, 1);
+static
+void event_store_clear(EventStore *store)
+{
+    fih_clear(store->index);
+    store->nfiles = 0;
+    store->npending = 0;
+    store->nresolved = 0;
+    store->resolved_pos = 0;
+    for (size_t i = 0; i < store->nruns; i++)
+        spill_run_close(&store->runs[i]);
+    store->nruns = 0;
+    store->spilled_runs = 0;
+    store->spilled_entries = 0;
+    for (int st = 0; st < MAX_TARGETS; st++) {
+        free(store->watermarks[st]);
+        store->watermarks[st] = NULL;
+        store->watermark_len[st] = 0;
+        store->feeder_done[st] = 0;
     }
-    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &mpi_world_size);
+}
 
-    int ntargets = (mpi_world_size - 1)/2;
+static
+void event_store_term(EventStore *store)
+{
+    event_store_clear(store);
+    fih_term(store->index);
+    pthread_mutex_destroy(&store->lock);
+    free(store->files);
+    free(store->pending);
+    free(store->batch);
+    free(store->resolved);
+    free(store->batch_names);
+    free(store->runs);
+    free(store->recv_buffer);
+    memset(store, 0, sizeof(EventStore));
+}
 
-    if (ntargets > MAX_TARGETS) {
-        return 1;
+/* What the phase 1 side of the store uses, this is what spilling frees up */
+static
+size_t event_store_index_memory_use(const EventStore *store)
+{
+    return fih_memory_use(store->index)
+        + store->files_capacity * sizeof(ReceivedFile)
+        + store->pending_capacity * sizeof(size_t)
+        + store->resolved_capacity * sizeof(ReceivedFile);
+}
+
+static
+size_t event_store_memory_use(const EventStore *store)
+{
+    return TARGET_BUFFER_SIZE
+        + event_store_index_memory_use(store)
+        + store->batch_capacity * sizeof(ReceivedFile)
+        + store->batch_names_capacity
+        + store->nruns * sizeof(SpillRun);
+}
+
+/*
+ * Merges all the spilled runs in to one, so we don't keep too many files
+ * open. Called with the lock held.
+ */
+static
+void event_store_merge_runs(EventStore *store)
+{
+    SpillRun merged;
+    spill_run_create(&merged, store->spill_dir);
+    char *name = NULL;
+    size_t name_capacity = 0;
+    for (;;) {
+        const SpillRun *first = NULL;
+        for (size_t r = 0; r < store->nruns; r++) {
+            const SpillRun *run = &store->runs[r];
+            if (run->has_head
+                    && (first == NULL || cmp_scan_order(run->name, run->name_len, first->name, first->name_len) < 0))
+                first = run;
+        }
+        if (first == NULL)
+            break;
+        size_t name_len = first->name_len;
+        name = ensure_capacity(name, &name_capacity, name_len, 1);
+        memcpy(name, first->name, name_len);
+        uint64_t size = 0;
+        FatFileInfo info;
+        memset(&info, 0, sizeof(info));
+        for (size_t r = 0; r < store->nruns; r++) {
+            SpillRun *run = &store->runs[r];
+            if (run->has_head
+                    && run->name_len == name_len
+                    && memcmp(run->name, name, name_len) == 0) {
+                size += run->size;
+                fih_merge_info(&info, &run->info);
+                spill_run_next(run);
+            }
+        }
+        spill_run_append(&merged, name, name_len, size, &info);
     }
+    free(name);
+    for (size_t r = 0; r < store->nruns; r++)
+        spill_run_close(&store->runs[r]);
+    spill_run_rewind(&merged);
+    store->runs[0] = merged;
+    store->nruns = 1;
+}
 
-    /* TODO: Should be skipped on rank 0 - it doesn't have a /store0x */
-    int store_fd = open(store_dir, O_DIRECTORY | O_RDONLY);
+/*
+ * Writes every entry that hasn't been taken by phase 2 yet to a new sorted
+ * run, and starts over with an empty index. Called with the lock held.
+ */
+static
+void event_store_spill(EventStore *store)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < store->npending; i++)
+        store->files[n++] = store->files[store->pending[i]];
+    size_t nresolved = store->nresolved - store->resolved_pos;
+    store->files = ensure_capacity(store->files, &store->files_capacity,
+            n + nresolved, sizeof(ReceivedFile));
+    memcpy(store->files + n, store->resolved + store->resolved_pos, nresolved*sizeof(ReceivedFile));
+    n += nresolved;
+    if (n != 0) {
+        qsort(store->files, n, sizeof(ReceivedFile), cmp_entry_names);
+        store->runs = ensure_capacity(store->runs, &store->runs_capacity,
+                store->nruns + 1, sizeof(SpillRun));
+        SpillRun *run = &store->runs[store->nruns++];
+        spill_run_create(run, store->spill_dir);
+        for (size_t i = 0; i < n; i++) {
+            const ReceivedFile *e = &store->files[i];
+            spill_run_append(run, e->name, strlen(e->name), e->size, &e->info);
+        }
+        spill_run_rewind(run);
+        store->spilled_runs += 1;
+        store->spilled_entries += n;
+        if (store->nruns >= MAX_SPILL_RUNS)
+            event_store_merge_runs(store);
+    }
 
-    PROF_START(init);
+    /*
+     * Entries phase 2 already took are dropped as well - with a budget the
+     * batches have their own copy of the names. The tables are freed too,
+     * they grow back quickly.
+     */
+    fih_term(store->index);
+    store->index = fih_init();
+    free(store->files);
+    free(store->pending);
+    free(store->resolved);
+    store->files = NULL;
+    store->pending = NULL;
+    store->resolved = NULL;
+    store->nfiles = store->files_capacity = 0;
+    store->npending = store->pending_capacity = 0;
+    store->nresolved = store->resolved_pos = store->resolved_capacity = 0;
+}
 
-    int last_run_fd = -1;
-    RunData last_run;
-    memset(&last_run, 0, sizeof(RunData));
-    if (mpi_rank == 0) {
-        last_run_fd = open(data_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-        read(last_run_fd, &last_run, sizeof(RunData));
+/* A file that goes in to a stripe if there is room, `old_holders` is 0 if
+ * it had no record */
+typedef struct {
+    const char *name;
+    FileInfo info;
+    u64 old_holders;
+    u64 chunk_bytes;
+    int was_member;
+} StripeCandidate;
+
+/* A member of a stripe that has changed, which breaks up the stripe */
+typedef struct {
+    const char *stripe;
+    const char *member;
+} StripeChange;
+
+/*
+ * The worklist is rebuilt for every batch in phase 2, the arrays only grow
+ * to the largest list seen.
+ */
+typedef struct {
+    FileInfo *info;
+    size_t info_capacity;
+    /* The targets that should delete their old record of each entry */
+    u64 *dropped;
+    size_t dropped_capacity;
+    const char **keys;
+    size_t keys_capacity;
+    char *key_bytes;
+    size_t key_bytes_capacity;
+    size_t *key_offsets;
+    size_t key_offsets_capacity;
+    uint8_t *wire;
+    size_t wire_capacity;
+    uint8_t *received;
+    size_t received_capacity;
+    /* Where each entry we got is in the whole list, in the same order */
+    uint32_t *items;
+    size_t items_capacity;
+    /* The targets that get each entry of our own part */
+    u64 *recipients;
+    size_t recipients_capacity;
+    /* Our own tasks, and the same grouped by lane */
+    TaskRef *tasks;
+    size_t tasks_capacity;
+    TaskRef *lane_tasks;
+    size_t lane_tasks_capacity;
+    size_t lane_start[N_LANES + 1];
+    uint8_t *involved;
+    size_t involved_capacity;
+    RangeState *ranges;
+    size_t ranges_capacity;
+    /* For scheduling and routing the tasks in our own part of the list */
+    u64 *chunk_bytes;
+    size_t chunk_bytes_capacity;
+    TaskRef *jobs;
+    size_t jobs_capacity;
+    u64 *job_targets;
+    size_t job_targets_capacity;
+    u64 *job_costs;
+    size_t job_costs_capacity;
+    int *lanes;
+    size_t lanes_capacity;
+    TaskRef *routes;
+    size_t routes_capacity;
+    /* The database entries of the batch, looked up all at once */
+    const char **names;
+    size_t names_capacity;
+    size_t *name_lens;
+    size_t name_lens_capacity;
+    FileInfo *prev_info;
+    size_t prev_info_capacity;
+    int *prev_found;
+    size_t prev_found_capacity;
+    /* The STRIPE_ROLE of each entry */
+    uint8_t *stripe_role;
+    size_t stripe_role_capacity;
+    /* For putting together the stripes of our own part of the list */
+    StripeCandidate *candidates;
+    size_t ncandidates;
+    size_t candidates_capacity;
+    StripeChange *changes;
+    size_t nchanges;
+    size_t changes_capacity;
+    size_t *candidate_order;
+    size_t candidate_order_capacity;
+    /* Names of the entries that weren't in the batch, the blocks are reused
+     * from the first one in every batch */
+    char **name_blocks;
+    size_t nname_blocks;
+    size_t name_blocks_capacity;
+    size_t name_block;
+    size_t name_block_used;
+} Worklist;
+
+static
+void worklist_term(Worklist *wl)
+{
+    free(wl->info);
+    free(wl->dropped);
+    free(wl->keys);
+    free(wl->key_bytes);
+    free(wl->key_offsets);
+    free(wl->wire);
+    free(wl->received);
+    free(wl->items);
+    free(wl->recipients);
+    free(wl->tasks);
+    free(wl->lane_tasks);
+    free(wl->involved);
+    free(wl->ranges);
+    free(wl->chunk_bytes);
+    free(wl->jobs);
+    free(wl->job_targets);
+    free(wl->job_costs);
+    free(wl->lanes);
+    free(wl->routes);
+    free(wl->names);
+    free(wl->name_lens);
+    free(wl->prev_info);
+    free(wl->prev_found);
+    free(wl->stripe_role);
+    free(wl->candidates);
+    free(wl->changes);
+    free(wl->candidate_order);
+    for (size_t i = 0; i < wl->nname_blocks; i++)
+        free(wl->name_blocks[i]);
+    free(wl->name_blocks);
+    memset(wl, 0, sizeof(Worklist));
+}
+
+typedef struct {
+    int ntargets;
+    double seconds;
+    pthread_mutex_t lock;
+    int done;
+} ScanProgress;
+
+/*
+ * In phase 1 we have 3 kinds of processes:
+ *  - global coordinator
+ *  - feeders
+ *  - eaters
+ *
+ * An eater simply receives data from anyone (storing it for later) - only
+ * stopping when every feeder has sent it a done marker.
+ *
+ * The feeders run through their files/chunks, selects a "random" eater and
+ * sends filename, size, etc to it. Once they are done with their files
+ * they message the global coordinator.
+ *
+ * Finally the global coordinator waits until every feeder has told it that
+ * they are done processing - then it lets phase 2 take the last batch.
+ *
+ * The global coordinator and the eaters run phase 1 in a thread, so phase 2
+ * can start on the files that are fully resolved while the scan continues.
+ */
+static
+void *phase1_global_coordinator(void *p)
+{
+    ScanProgress *scan = (ScanProgress *)p;
+    PROF_START(phase1);
+    int64_t files_seen_total = 0;
+    int outputs_on_line = 0;
+    int still_in_stage_1 = scan->ntargets;
+    printf("events: ");
+    while (still_in_stage_1 > 0) {
+        MPI_Status stat;
+        int64_t files_seen;
+        MPI_Recv(&files_seen, sizeof(files_seen), MPI_BYTE, MPI_ANY_SOURCE, 0, p1_comm, &stat);
+        if (files_seen < 0)
+            still_in_stage_1 -= 1;
+        else {
+            files_seen_total += files_seen;
+            printf("  %ld", files_seen_total);
+            if (++outputs_on_line == 12)
+            {
+                printf("\n");
+                outputs_on_line = 0;
+            }
+        }
     }
+    printf("\nTotal number of events found: %8ld\n", files_seen_total);
+    PROF_END(phase1);
+    pthread_mutex_lock(&scan->lock);
+    scan->seconds = PROF_VAL(phase1);
+    scan->done = 1;
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
 
-    /* Create mapping from storage targets to ranks, and vice versa */
-    Target targetIDs[2*MAX_TARGETS] = {{0,0,0}};
-    Target targetID = {0,0,GIT_VERSION};
-    int target_weight = 0;
-    int target_weights[2*MAX_TARGETS] = {0};
-    if (mpi_rank != 0)
-    {
-        int target_ID_fd = openat(store_fd, "targetNumID", O_RDONLY);
-        char targetID_s[20] = {0};
-        read(target_ID_fd, targetID_s, sizeof(targetID_s));
-        close(target_ID_fd);
-        targetID.id = atoi(targetID_s);
-        targetID.rank = mpi_rank;
-        target_weight = get_store_weight(store_fd);
+static
+void phase1_feeder(const char *operation, const char *store_dir, const char *deletable, int ntargets)
+{
+    FILE *slave;
+    char cmd_buf[512];
+    int in_scan_order = 0;
+    if (strcmp(operation, "complete") == 0) {
+        snprintf(cmd_buf, sizeof(cmd_buf), "bp-find-all-chunks %s/chunks", store_dir);
+        in_scan_order = 1;
     }
-    MPI_Gather(
-            &targetID, sizeof(Target), MPI_BYTE,
-            targetIDs, sizeof(Target), MPI_BYTE,
-            0,
-            MPI_COMM_WORLD);
-    MPI_Gather(
-            &target_weight, sizeof(int), MPI_BYTE,
-            target_weights, sizeof(int), MPI_BYTE,
-            0,
-            MPI_COMM_WORLD);
-    if (mpi_rank == 0) {
-        if (ntargets < last_run.ntargets)
-            errx(1, "Fewer targets than last run, something is wrong!");
-        for (int i = 1; i < 2*ntargets+1; i++)
-            if (targetIDs[i].version != GIT_VERSION)
-                errx(1, "Version mismatch");
+    else if (strcmp(operation, "partial") == 0 || strcmp(operation, "daemon") == 0)
+        snprintf(cmd_buf, sizeof(cmd_buf), "bp-find-chunks-changed-between --deletable %s --store %s/chunks/ --spill-dir %s/changelog", deletable, store_dir, store_dir);
+    else
+        strcpy(cmd_buf, "cat /dev/null");
+    alloc_send_buffers(ntargets);
+    slave = popen(cmd_buf, "r");
+    feed_targets_with(slave, ntargets, in_scan_order);
+    pclose(slave);
+}
+
+static
+void add_marker(EventStore *store, int st, uint8_t event_type, const char *path, size_t path_len)
+{
+    if (event_type == FEEDER_DONE_EVENT) {
+        store->feeder_done[st] = 1;
+        return;
+    }
+    char *wm = realloc(store->watermarks[st], path_len);
+    if (wm == NULL)
+        err(1, "Out of memory for watermarks");
+    memcpy(wm, path, path_len);
+    store->watermarks[st] = wm;
+    store->watermark_len[st] = path_len;
+}
+
+typedef struct {
+    int64_t timestamp;
+    uint64_t chunk_size;
+    size_t path_offset;
+    size_t path_len;
+    uint8_t event_type;
+} DecodedEvent;
+
+static
+int is_marker(uint8_t event_type)
+{
+    return event_type == WATERMARK_EVENT || event_type == FEEDER_DONE_EVENT;
+}
+
+/*
+ * A received buffer is decoded in one go, and the lookups for its data are
+ * done together, see fih_get_or_create_many.
+ */
+typedef struct {
+    WireState wire;
+    DecodedEvent *events;
+    size_t events_capacity;
+    char *paths;
+    size_t paths_capacity;
+    size_t capacity;
+    const char **keys;
+    size_t *key_lens;
+    size_t *idxs;
+    int *status;
+} Lookups;
+
+static
+void lookups_reserve(Lookups *l, size_t n)
+{
+    if (n <= l->capacity)
+        return;
+    size_t c = l->capacity;
+    l->keys = ensure_capacity(l->keys, &c, n, sizeof(char *));
+    l->key_lens = realloc(l->key_lens, c*sizeof(size_t));
+    l->idxs = realloc(l->idxs, c*sizeof(size_t));
+    l->status = realloc(l->status, c*sizeof(int));
+    if (!l->key_lens || !l->idxs || !l->status)
+        err(1, "Out of memory for lookups");
+    l->capacity = c;
+}
+
+/* Returns the number of events in the message */
+static
+size_t decode_events(Lookups *l, const uint8_t *msg, size_t msg_len)
+{
+    const uint8_t *pos = msg;
+    const uint8_t *end = msg + msg_len;
+    size_t n = 0;
+    size_t path_bytes = 0;
+    wire_reset(&l->wire);
+    while (pos < end) {
+        l->events = ensure_capacity(l->events, &l->events_capacity, n + 1, sizeof(DecodedEvent));
+        DecodedEvent *e = &l->events[n++];
+        e->event_type = *pos++;
+        pos = wire_get_path(&l->wire, pos, end);
+        pos = wire_get_timestamp(&l->wire, pos, end, &e->timestamp);
+        pos = wire_get_varint(pos, end, &e->chunk_size);
+        e->path_offset = path_bytes;
+        e->path_len = l->wire.path_len;
+        l->paths = ensure_capacity(l->paths, &l->paths_capacity, path_bytes + e->path_len, 1);
+        memcpy(l->paths + path_bytes, l->wire.path, e->path_len);
+        path_bytes += e->path_len;
+    }
+    return n;
+}
+
+static
+void *phase1_eater(void *p)
+{
+    EventStore *store = (EventStore *)p;
+    uint8_t *recv_buffer = store->recv_buffer;
+    int feeders_left = store->ntargets;
+    Lookups l;
+    memset(&l, 0, sizeof(l));
+    while (feeders_left > 0) {
+        MPI_Status stat;
+        MPI_Recv(recv_buffer, TARGET_BUFFER_SIZE, MPI_BYTE, MPI_ANY_SOURCE, 0, p1_comm, &stat);
+        /* parse and add data */
+        int actually_received = 0;
+        MPI_Get_count(&stat, MPI_BYTE, &actually_received);
+        int src = stat.MPI_SOURCE;
+        int st = st_from_feeder_rank(src);
+        size_t nevents = decode_events(&l, recv_buffer, actually_received);
+        size_t n = 0;
+        for (size_t i = 0; i < nevents; i++) {
+            const DecodedEvent *e = &l.events[i];
+            if (is_marker(e->event_type))
+                continue;
+            lookups_reserve(&l, n + 1);
+            l.keys[n] = l.paths + e->path_offset;
+            l.key_lens[n] = e->path_len;
+            n++;
+        }
+
+        pthread_mutex_lock(&store->lock);
+        fih_get_or_create_many(store->index, n, l.keys, l.key_lens, l.idxs, l.status);
+        size_t j = 0;
+        for (size_t i = 0; i < nevents; i++) {
+            const DecodedEvent *e = &l.events[i];
+            if (is_marker(e->event_type))
+                continue;
+            size_t idx = l.idxs[j];
+            if (l.status[j] == FIH_NEW) {
+                store->files = ensure_capacity(store->files, &store->files_capacity,
+                        idx + 1, sizeof(ReceivedFile));
+                store->pending = ensure_capacity(store->pending, &store->pending_capacity,
+                        store->npending + 1, sizeof(size_t));
+                assert(idx == store->nfiles);
+                memset(&store->files[idx], 0, sizeof(ReceivedFile));
+                store->files[idx].name = fih_key(store->index, idx);
+                store->pending[store->npending++] = idx;
+                store->nfiles += 1;
+            }
+            store->files[idx].size += e->chunk_size;
+            fih_add_info(
+                    &store->files[idx].info,
+                    st,
+                    e->timestamp,
+                    (e->event_type == UNLINK_EVENT));
+            j++;
+        }
+        /*
+         * A marker covers the data in front of it, and all of this buffer is
+         * in the store before anyone sees the marker.
+         */
+        for (size_t i = 0; i < nevents; i++) {
+            const DecodedEvent *e = &l.events[i];
+            if (is_marker(e->event_type)) {
+                add_marker(store, st, e->event_type, l.paths + e->path_offset, e->path_len);
+                if (e->event_type == FEEDER_DONE_EVENT)
+                    feeders_left -= 1;
+            }
+        }
+        if (store->memory_budget != 0
+                && event_store_index_memory_use(store) > store->memory_budget/2)
+            event_store_spill(store);
+        pthread_mutex_unlock(&store->lock);
+    }
+    free(l.events);
+    free(l.paths);
+    free(l.keys);
+    free(l.key_lens);
+    free(l.idxs);
+    free(l.status);
+    return NULL;
+}
+
+/* Everything up to `wm` in scan order is resolved, or all of it once every feeder is done */
+typedef struct {
+    const char *wm;
+    size_t wm_len;
+    int all_done;
+    int have_watermark;
+} ResolvedCut;
+
+static
+ResolvedCut resolved_cut(const EventStore *store)
+{
+    ResolvedCut cut = {NULL, 0, 1, 1};
+    for (int st = 0; st < store->ntargets; st++) {
+        if (store->feeder_done[st])
+            continue;
+        cut.all_done = 0;
+        if (store->watermarks[st] == NULL) {
+            cut.have_watermark = 0;
+            break;
+        }
+        if (cut.wm == NULL || cmp_scan_order(store->watermarks[st], store->watermark_len[st], cut.wm, cut.wm_len) < 0) {
+            cut.wm = store->watermarks[st];
+            cut.wm_len = store->watermark_len[st];
+        }
+    }
+    return cut;
+}
+
+static
+int is_resolved(const ResolvedCut *cut, const char *s, size_t s_len)
+{
+    return cut->all_done
+        || (cut->have_watermark && cmp_scan_order(s, s_len, cut->wm, cut->wm_len) <= 0);
+}
+
+/*
+ * With a memory budget the resolved entries are merged with the spilled runs
+ * in scan order, combining the events for a file that ended up in more than
+ * one of them. Every rank holds the worklists of all eaters in phase 2, so
+ * the batch stops at each eater's share of a quarter of the budget, and
+ * whatever is left is merged in to the next one. The names are copied in to the batch so
+ * a spill can reset the index while phase 2 works on it.
+ */
+static
+size_t take_merged_entries(EventStore *store, const ResolvedCut *cut, int *more)
+{
+    /* Newly resolved entries join the ones left over from the last batch */
+    size_t nleft = store->nresolved - store->resolved_pos;
+    if (nleft != 0)
+        memmove(store->resolved, store->resolved + store->resolved_pos, nleft*sizeof(ReceivedFile));
+    store->nresolved = nleft;
+    store->resolved_pos = 0;
+    size_t nkept = 0;
+    for (size_t i = 0; i < store->npending; i++) {
+        size_t idx = store->pending[i];
+        const char *s = store->files[idx].name;
+        if (is_resolved(cut, s, strlen(s))) {
+            store->resolved = ensure_capacity(store->resolved, &store->resolved_capacity,
+                    store->nresolved + 1, sizeof(ReceivedFile));
+            store->resolved[store->nresolved++] = store->files[idx];
+        }
+        else
+            store->pending[nkept++] = idx;
+    }
+    store->npending = nkept;
+    qsort(store->resolved, store->nresolved, sizeof(ReceivedFile), cmp_entry_names);
+
+    size_t limit = store->memory_budget/4/store->ntargets;
+    size_t batch_bytes = 0;
+    size_t name_bytes = 0;
+    size_t nbatch = 0;
+    size_t *name_offsets = NULL;
+    size_t name_offsets_capacity = 0;
+    for (;;) {
+        /* The next path is the smallest of the leftovers and the resolved run heads */
+        const char *next = NULL;
+        size_t next_len = 0;
+        if (store->resolved_pos < store->nresolved) {
+            next = store->resolved[store->resolved_pos].name;
+            next_len = strlen(next);
+        }
+        for (size_t r = 0; r < store->nruns; r++) {
+            const SpillRun *run = &store->runs[r];
+            if (run->has_head
+                    && is_resolved(cut, run->name, run->name_len)
+                    && (next == NULL || cmp_scan_order(run->name, run->name_len, next, next_len) < 0)) {
+                next = run->name;
+                next_len = run->name_len;
+            }
+        }
+        if (next == NULL)
+            break;
+        if (batch_bytes >= limit) {
+            *more = 1;
+            break;
+        }
+
+        store->batch = ensure_capacity(store->batch, &store->batch_capacity,
+                nbatch + 1, sizeof(ReceivedFile));
+        name_offsets = ensure_capacity(name_offsets, &name_offsets_capacity,
+                nbatch + 1, sizeof(size_t));
+        store->batch_names = ensure_capacity(store->batch_names, &store->batch_names_capacity,
+                name_bytes + next_len + 1, 1);
+        char *name = store->batch_names + name_bytes;
+        memcpy(name, next, next_len);
+        name[next_len] = '\0';
+        name_offsets[nbatch] = name_bytes;
+        name_bytes += next_len + 1;
+
+        ReceivedFile *e = &store->batch[nbatch++];
+        memset(e, 0, sizeof(ReceivedFile));
+        if (store->resolved_pos < store->nresolved
+                && strcmp(store->resolved[store->resolved_pos].name, name) == 0) {
+            const ReceivedFile *m = &store->resolved[store->resolved_pos++];
+            e->size += m->size;
+            fih_merge_info(&e->info, &m->info);
+        }
+        for (size_t r = 0; r < store->nruns; r++) {
+            SpillRun *run = &store->runs[r];
+            if (run->has_head
+                    && run->name_len == next_len
+                    && memcmp(run->name, name, next_len) == 0) {
+                e->size += run->size;
+                fih_merge_info(&e->info, &run->info);
+                spill_run_next(run);
+            }
+        }
+        batch_bytes += sizeof(ReceivedFile) + next_len + 1;
+    }
+    for (size_t j = 0; j < nbatch; j++)
+        store->batch[j].name = store->batch_names + name_offsets[j];
+    free(name_offsets);
+
+    /* Runs we have read to the end are done */
+    size_t nruns = 0;
+    for (size_t r = 0; r < store->nruns; r++) {
+        if (store->runs[r].has_head)
+            store->runs[nruns++] = store->runs[r];
+        else
+            spill_run_close(&store->runs[r]);
+    }
+    store->nruns = nruns;
+    return nbatch;
+}
+
+/*
+ * Copies the entries every feeder has scanned past in to `store->batch`.
+ * Files that may still have chunks coming from some target are kept pending
+ * for a later batch. Returns the size of the batch, and sets `*more` if there
+ * are resolved entries that didn't fit in to it.
+ */
+static
+size_t take_resolved_entries(EventStore *store, int *more)
+{
+    pthread_mutex_lock(&store->lock);
+    ResolvedCut cut = resolved_cut(store);
+    *more = 0;
+    if (store->memory_budget != 0) {
+        size_t nbatch = take_merged_entries(store, &cut, more);
+        pthread_mutex_unlock(&store->lock);
+        return nbatch;
+    }
+    size_t nresolved = 0;
+    size_t nkept = 0;
+    store->batch = ensure_capacity(store->batch, &store->batch_capacity,
+            store->npending, sizeof(ReceivedFile));
+    for (size_t i = 0; i < store->npending; i++) {
+        size_t idx = store->pending[i];
+        const char *s = store->files[idx].name;
+        if (is_resolved(&cut, s, strlen(s)))
+            store->batch[nresolved++] = store->files[idx];
+        else
+            store->pending[nkept++] = idx;
+    }
+    store->npending = nkept;
+    pthread_mutex_unlock(&store->lock);
+    return nresolved;
+}
+
+/*
+ * Sorts the entries by size with a radix sort on the lanes' worth of threads,
+ * and finds where each size class starts. Files of the same size are ordered
+ * by a hash of their path, so the order is the same on every run.
+ */
+static
+void sort_by_size(MPI_Comm comm, ReceivedFile *entries, size_t nentries, size_t class_start[N_SIZE_CLASSES + 1])
+{
+    MPI_Barrier(comm);
+    if (mpi_rank == 0) {
+        printf("Starting sort..");
+        fflush(stdout);
+    }
+    if (nentries > UINT32_MAX)
+        errx(1, "Too many entries to sort (%zu)", nentries);
+    SizeKey *keys = malloc(nentries*sizeof(SizeKey));
+    if (keys == NULL && nentries != 0)
+        err(1, "Out of memory for sorting");
+    for (size_t i = 0; i < nentries; i++) {
+        const char *s = entries[i].name;
+        keys[i].size = entries[i].size;
+        keys[i].tie = simple_hash(s, strlen(s));
+        keys[i].index = (uint32_t)i;
+    }
+    sort_size_keys(keys, nentries, N_LANES);
+    find_size_classes(keys, nentries, class_start);
+    /* Move the entries in to place one cycle of the permutation at a time */
+    for (size_t i = 0; i < nentries; i++) {
+        if (keys[i].index == i)
+            continue;
+        ReceivedFile first = entries[i];
+        size_t j = i;
+        for (;;) {
+            size_t src = keys[j].index;
+            keys[j].index = (uint32_t)j;
+            if (src == i) {
+                entries[j] = first;
+                break;
+            }
+            entries[j] = entries[src];
+            j = src;
+        }
+    }
+    free(keys);
+    MPI_Barrier(comm);
+    if (mpi_rank == 0)
+        printf("  done.\n");
+}
+
+static
+void worklist_reserve(Worklist *wl, size_t n)
+{
+    wl->info = ensure_capacity(wl->info, &wl->info_capacity, n, sizeof(FileInfo));
+    wl->dropped = ensure_capacity(wl->dropped, &wl->dropped_capacity, n, sizeof(u64));
+    wl->keys = ensure_capacity(wl->keys, &wl->keys_capacity, n, sizeof(char *));
+    wl->chunk_bytes = ensure_capacity(wl->chunk_bytes, &wl->chunk_bytes_capacity, n, sizeof(u64));
+    wl->stripe_role = ensure_capacity(wl->stripe_role, &wl->stripe_role_capacity, n, 1);
+}
+
+static
+const char *worklist_copy_name(Worklist *wl, const char *name, size_t len)
+{
+    assert(len < NAME_BLOCK_SIZE);
+    if (wl->name_block < wl->nname_blocks && wl->name_block_used + len + 1 > NAME_BLOCK_SIZE) {
+        wl->name_block += 1;
+        wl->name_block_used = 0;
+    }
+    if (wl->name_block == wl->nname_blocks) {
+        wl->name_blocks = ensure_capacity(wl->name_blocks, &wl->name_blocks_capacity,
+                wl->nname_blocks + 1, sizeof(char *));
+        wl->name_blocks[wl->nname_blocks] = malloc(NAME_BLOCK_SIZE);
+        if (wl->name_blocks[wl->nname_blocks] == NULL)
+            err(1, "Out of memory for worklist names");
+        wl->nname_blocks += 1;
+        wl->name_block_used = 0;
+    }
+    char *dst = wl->name_blocks[wl->name_block] + wl->name_block_used;
+    memcpy(dst, name, len);
+    dst[len] = '\0';
+    wl->name_block_used += len + 1;
+    return dst;
+}
+
+static
+void append_entry(Worklist *wl, size_t i, const char *key, const FileInfo *fi,
+        u64 dropped, u64 chunk_bytes, uint8_t role)
+{
+    wl->keys[i] = key;
+    wl->info[i] = *fi;
+    wl->dropped[i] = dropped;
+    wl->chunk_bytes[i] = chunk_bytes;
+    wl->stripe_role[i] = role;
+}
+
+/*
+ * New files with a single small chunk get no P of their own, and neither do
+ * members of a stripe that still are such a file. Files that already have
+ * their own parity keep it.
+ */
+static
+int is_stripe_candidate(const FileInfo *fi, const FatFileInfo *new_fi, uint64_t size, int ntargets)
+{
+    uint64_t data = fi->locations & L_MASK;
+    return ntargets >= 3
+        && P_IS_INVALID(fi->locations)
+        && __builtin_popcountll(data) == 1
+        && new_fi->modified == data
+        && size <= STRIPE_MAX_CHUNK;
+}
+
+/*
+ * The stripes we make are named so we own them, like their members - then
+ * we have the records of both when a member changes. The run start and a
+ * counter keep the names apart.
+ */
+static
+const char *new_stripe_name(Worklist *wl, int my_st)
+{
+    static time_t epoch;
+    static uint32_t counter;
+    if (epoch == 0)
+        epoch = time(NULL);
+    char name[64];
+    int len;
+    do {
+        len = snprintf(name, sizeof(name), STRIPE_PREFIX "%d/%lx-%x",
+                my_st, (unsigned long)epoch, counter++);
+    } while (OWNER_ST(name, len, nowners) != (unsigned)my_st);
+    return worklist_copy_name(wl, name, len);
+}
+
+static
+void add_candidate(Worklist *wl, const char *name, const FileInfo *fi,
+        u64 old_holders, u64 chunk_bytes, int was_member)
+{
+    wl->candidates = ensure_capacity(wl->candidates, &wl->candidates_capacity,
+            wl->ncandidates + 1, sizeof(StripeCandidate));
+    StripeCandidate c = { name, *fi, old_holders, chunk_bytes, was_member };
+    wl->candidates[wl->ncandidates++] = c;
+}
+
+static
+int cmp_stripe_changes(const void *pa, const void *pb)
+{
+    const StripeChange *a = pa;
+    const StripeChange *b = pb;
+    return strcmp(a->stripe, b->stripe);
+}
+
+/*
+ * A stripe with a changed member is taken apart: its record is deleted, and
+ * the members that haven't changed go back to being candidates. We don't
+ * know their size anymore, so they count as STRIPE_MAX_CHUNK.
+ */
+static
+size_t dissolve_stripes(PersistentDB *pdb, Worklist *wl, size_t nitems)
+{
+    qsort(wl->changes, wl->nchanges, sizeof(StripeChange), cmp_stripe_changes);
+    uint8_t *list = malloc(STRIPE_LIST_MAX);
+    char *stripe_of = malloc(PDB_MAX_KEY_LEN + 1);
+    if (list == NULL || stripe_of == NULL)
+        err(1, "Out of memory for stripes");
+    for (size_t a = 0, b; a < wl->nchanges; a = b)
+    {
+        const char *name = wl->changes[a].stripe;
+        size_t len = strlen(name);
+        for (b = a + 1; b < wl->nchanges && strcmp(wl->changes[b].stripe, name) == 0; b++) { }
+        FileInfo old;
+        if (!pdb_get(pdb, name, len, &old))
+            continue;
+        FileInfo fi = { old.timestamp, WITH_P(0, (uint64_t)GET_P(old.locations)) };
+        worklist_reserve(wl, nitems + 1);
+        u64 dropped = db_holders(name, len, old.locations, nowners)
+            & ~db_holders(name, len, fi.locations, nowners);
+        append_entry(wl, nitems++, name, &fi, dropped, 0, STRIPE_ROLE_NONE);
+
+        StripeMembers members;
+        size_t list_len = pdb_get_stripe(pdb, name, len, list, STRIPE_LIST_MAX);
+        if (!stripe_decode(list, list_len, &members))
+            continue;
+        for (int k = 0; k < members.nmembers; k++) {
+            const char *member = members.names[k];
+            size_t member_len = strlen(member);
+            int changed = 0;
+            for (size_t c = a; c < b; c++)
+                changed |= (strcmp(wl->changes[c].member, member) == 0);
+            FileInfo member_fi;
+            if (changed
+                    || !pdb_get(pdb, member, member_len, &member_fi)
+                    || !IS_STRIPE_MEMBER(member_fi.locations)
+                    || pdb_get_stripe_of(pdb, member, member_len, stripe_of) != len
+                    || memcmp(stripe_of, name, len) != 0)
+                continue;
+            add_candidate(wl, worklist_copy_name(wl, member, member_len), &member_fi,
+                    db_holders(member, member_len, member_fi.locations, nowners),
+                    STRIPE_MAX_CHUNK, 1);
+        }
+    }
+    free(stripe_of);
+    free(list);
+    return nitems;
+}
+
+/*
+ * The candidates are put in stripes of files on different hosts, always
+ * taking from the targets with the most candidates left so the last ones
+ * aren't all on one target. A stripe always leaves a host without members
+ * for its P, as losing that host would lose a member and the parity with it.
+ * The members go in to the worklist right before their stripe. A candidate
+ * that is left without company gets a P of its own like any other file.
+ */
+static
+size_t build_stripes(PersistentDB *pdb, Worklist *wl, size_t nitems,
+        const ParityLoad *run_load, ParityLoad *batch_load, int ntargets, int my_st)
+{
+    nitems = dissolve_stripes(pdb, wl, nitems);
+    size_t n = wl->ncandidates;
+    worklist_reserve(wl, nitems + 2*n);
+    wl->candidate_order = ensure_capacity(wl->candidate_order, &wl->candidate_order_capacity,
+            n, sizeof(size_t));
+    size_t next[MAX_TARGETS + 1] = {0};
+    size_t end[MAX_TARGETS];
+    for (size_t c = 0; c < n; c++)
+        next[__builtin_ctzll(wl->candidates[c].info.locations & L_MASK) + 1] += 1;
+    for (int t = 0; t < ntargets; t++)
+        next[t + 1] += next[t];
+    for (size_t c = 0; c < n; c++)
+        wl->candidate_order[next[__builtin_ctzll(wl->candidates[c].info.locations & L_MASK)]++] = c;
+    for (int t = 0; t < ntargets; t++) {
+        end[t] = next[t];
+        next[t] = (t > 0)? end[t - 1] : 0;
+    }
+
+    const u64 all_targets = (1ULL << ntargets) - 1;
+    for (;;)
+    {
+        const StripeCandidate *group[STRIPE_MAX_MEMBERS];
+        int ngroup = 0;
+        u64 used_hosts = 0;
+        while (ngroup < STRIPE_MAX_MEMBERS) {
+            int best = -1;
+            for (int t = 0; t < ntargets; t++)
+                if (next[t] != end[t] && !TEST_BIT(used_hosts, t)
+                        && (ngroup == 0 || (used_hosts | same_host[t]) != all_targets)
+                        && (best < 0 || end[t] - next[t] > end[best] - next[best]))
+                    best = t;
+            if (best < 0)
+                break;
+            group[ngroup++] = &wl->candidates[wl->candidate_order[next[best]++]];
+            used_hosts |= same_host[best];
+        }
+        if (ngroup == 0)
+            break;
+
+        const char *name;
+        FileInfo fi;
+        u64 old_holders = 0;
+        u64 bytes = 0;
+        uint8_t role = STRIPE_ROLE_NONE;
+        if (ngroup == 1) {
+            name = group[0]->name;
+            fi = group[0]->info;
+            old_holders = group[0]->old_holders;
+            bytes = group[0]->chunk_bytes;
+            role = group[0]->was_member? STRIPE_ROLE_LEFT : STRIPE_ROLE_NONE;
+        }
+        else {
+            fi.timestamp = 0;
+            fi.locations = 0;
+            for (int k = 0; k < ngroup; k++) {
+                const StripeCandidate *c = group[k];
+                size_t len = strlen(c->name);
+                append_entry(wl, nitems++, c->name, &c->info,
+                        c->old_holders & ~db_holders(c->name, len, c->info.locations, nowners),
+                        0, STRIPE_ROLE_MEMBER);
+                fi.timestamp = MAX(fi.timestamp, c->info.timestamp);
+                fi.locations |= c->info.locations & L_MASK;
+                bytes = MAX(bytes, c->chunk_bytes);
+            }
+            name = new_stripe_name(wl, my_st);
+            fi.locations = WITH_P(fi.locations, NO_P);
+        }
+        uint64_t old_P = NO_P;
+        select_P(name, &fi, (unsigned)ntargets, run_load, batch_load, &old_P);
+        old_holders &= ~db_holders(name, strlen(name), fi.locations, nowners);
+        append_entry(wl, nitems++, name, &fi, old_holders, bytes, role);
+        if (GET_P(fi.locations) != NO_P && old_P != NO_P)
+            add_parity_load(batch_load, fi.locations, old_P, bytes);
+    }
+    return nitems;
+}
+
+/*
+ * Every eater builds the worklist for its own batch, all at the same time.
+ * The entries go in to the start of `wl->info` and `wl->keys`, and files that
+ * haven't changed since their database entry was written are left out -
+ * nobody has anything to do for them. The average size of the changed
+ * chunks of each file goes in to `wl->chunk_bytes`. Returns the length of the
+ * list.
+ *
+ * The batch is sorted by size. Huge files go first so they are under way
+ * before the rest of the list, then the medium and tiny ones fill in the
+ * gaps. The parity work of the list is added to `batch_load`. Small files
+ * with one chunk are put in stripes at the end, see build_stripes.
+ *
+ * The old entries are looked up for the whole batch before that, in key
+ * order, so the database is read in one sequential pass rather than one
+ * random read per file. We own every file in the batch, so our shard has
+ * all of their records.
+ */
+static
+size_t build_worklist(PersistentDB *pdb,
+        const ReceivedFile *batch,
+        size_t batch_size,
+        const size_t *class_start,
+        Worklist *wl,
+        const ParityLoad *run_load,
+        ParityLoad *batch_load,
+        int ntargets,
+        int my_st)
+{
+    worklist_reserve(wl, batch_size);
+    wl->names = ensure_capacity(wl->names, &wl->names_capacity, batch_size, sizeof(char *));
+    wl->name_lens = ensure_capacity(wl->name_lens, &wl->name_lens_capacity, batch_size, sizeof(size_t));
+    wl->prev_info = ensure_capacity(wl->prev_info, &wl->prev_info_capacity, batch_size, sizeof(FileInfo));
+    wl->prev_found = ensure_capacity(wl->prev_found, &wl->prev_found_capacity, batch_size, sizeof(int));
+    for (size_t j = 0; j < batch_size; j++) {
+        wl->names[j] = batch[j].name;
+        wl->name_lens[j] = strlen(batch[j].name);
+    }
+    pdb_get_many(pdb, wl->names, wl->name_lens, batch_size, wl->prev_info, wl->prev_found);
+    wl->ncandidates = 0;
+    wl->nchanges = 0;
+    wl->name_block = 0;
+    wl->name_block_used = 0;
+    char stripe[PDB_MAX_KEY_LEN + 1];
+
+    size_t nitems = 0;
+    for (int c = N_SIZE_CLASSES - 1; c >= 0; c--)
+    for (size_t j = class_start[c]; j < class_start[c+1]; j++)
+    {
+        const char *s = batch[j].name;
+        size_t s_len = wl->name_lens[j];
+        const FileInfo *prev_fi = &wl->prev_info[j];
+        FatFileInfo new_fi = batch[j].info;
+        FileInfo *fi = wl->info + nitems;
+        fi->timestamp = new_fi.timestamp;
+        fi->locations = WITH_P(new_fi.modified, NO_P);
+        int has_an_old_version = wl->prev_found[j];
+        if (has_an_old_version)
+            fill_in_missing_fields(fi, prev_fi);
+        fi->locations &= ~new_fi.deleted;
+        int was_member = has_an_old_version
+            && IS_STRIPE_MEMBER(prev_fi->locations)
+            && pdb_get_stripe_of(pdb, s, s_len, stripe) != 0;
+        if (was_member) {
+            if (prev_fi->timestamp == fi->timestamp
+                    && prev_fi->locations == fi->locations)
+                continue;
+            wl->changes = ensure_capacity(wl->changes, &wl->changes_capacity,
+                    wl->nchanges + 1, sizeof(StripeChange));
+            StripeChange change = { worklist_copy_name(wl, stripe, strlen(stripe)), s };
+            wl->changes[wl->nchanges++] = change;
+        }
+        u64 old_holders = has_an_old_version?
+            db_holders(s, s_len, prev_fi->locations, nowners) : 0;
+        if (is_stripe_candidate(fi, &new_fi, batch[j].size, ntargets)) {
+            add_candidate(wl, s, fi, old_holders, batch[j].size, was_member);
+            continue;
+        }
+        uint64_t old_P = GET_P(fi->locations);
+        if (P_IS_INVALID(fi->locations))
+            select_P(s, fi, (unsigned)ntargets, run_load, batch_load, &old_P);
+        if (has_an_old_version
+                && prev_fi->timestamp == fi->timestamp
+                && prev_fi->locations == fi->locations)
+            continue;
+        wl->dropped[nitems] = old_holders & ~db_holders(s, s_len, fi->locations, nowners);
+        wl->stripe_role[nitems] = was_member? STRIPE_ROLE_LEFT : STRIPE_ROLE_NONE;
+        int nchunks = __builtin_popcountll(new_fi.modified);
+        wl->chunk_bytes[nitems] = batch[j].size/MAX(nchunks, 1);
+        if (GET_P(fi->locations) != NO_P && old_P != NO_P)
+            add_parity_load(batch_load, fi->locations, old_P, wl->chunk_bytes[nitems]);
+        wl->keys[nitems++] = s;
+    }
+    return build_stripes(pdb, wl, nitems, run_load, batch_load, ntargets, my_st);
+}
+
+static
+void decode_slice(WireState *w, Worklist *wl, const uint8_t *pos, const uint8_t *end,
+        size_t item, size_t *at, size_t last, size_t *path_bytes)
+{
+    wire_reset(w);
+    while (pos != end) {
+        if (*at == last)
+            errx(1, "Malformed worklist");
+        size_t j = (*at)++;
+        FileInfo *fi = &wl->info[j];
+        uint64_t skipped, locations, dropped;
+        pos = wire_get_varint(pos, end, &skipped);
+        item += skipped;
+        wl->items[j] = item++;
+        pos = wire_get_path(w, pos, end);
+        pos = wire_get_timestamp(w, pos, end, &fi->timestamp);
+        pos = wire_get_varint(pos, end, &locations);
+        if (pos == end)
+            errx(1, "Truncated worklist");
+        fi->locations = WITH_P(locations, (uint64_t)*pos++);
+        pos = wire_get_varint(pos, end, &dropped);
+        wl->dropped[j] = dropped;
+        if (pos == end)
+            errx(1, "Truncated worklist");
+        wl->stripe_role[j] = *pos++;
+        wl->key_bytes = ensure_capacity(wl->key_bytes, &wl->key_bytes_capacity,
+                *path_bytes + w->path_len + 1, 1);
+        memcpy(wl->key_bytes + *path_bytes, w->path, w->path_len + 1);
+        wl->key_offsets[j] = *path_bytes;
+        *path_bytes += w->path_len + 1;
+    }
+}
+
+/*
+ * An entry of our part goes to the targets that keep its record and the ones
+ * that drop it, which includes everyone with a task on it. The members of a
+ * stripe go together with the stripe, as the database entries of each need
+ * the other.
+ */
+static
+void find_recipients(Worklist *wl, size_t nown)
+{
+    wl->recipients = ensure_capacity(wl->recipients, &wl->recipients_capacity, nown, sizeof(u64));
+    for (size_t j = 0; j < nown; j++)
+        wl->recipients[j] = db_holders(wl->keys[j], strlen(wl->keys[j]),
+                wl->info[j].locations, nowners) | wl->dropped[j];
+    for (size_t j = 0, last; j < nown; j = last + 1) {
+        last = j;
+        while (wl->stripe_role[last] == STRIPE_ROLE_MEMBER)
+            last++;
+        assert(last < nown);
+        u64 all = 0;
+        for (size_t k = j; k <= last; k++)
+            all |= wl->recipients[k];
+        for (size_t k = j; k <= last; k++)
+            wl->recipients[k] = all;
+    }
+}
+
+/*
+ * After sharding a rank only needs the entries it keeps or drops the record
+ * of, so the eaters send each entry of their part to just those ranks: a
+ * slice of every part in each round. The entries we get are put in worklist
+ * order, with their place in the whole list in `wl->items`, and our own part
+ * is moved in between. Returns the number of entries we have.
+ */
+static
+size_t exchange_worklists(MPI_Comm comm, Worklist *wl, const size_t *first,
+        const int *st2comm, int ntargets)
+{
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    size_t nown = first[rank+1] - first[rank];
+    find_recipients(wl, nown);
+
+    uint64_t *nsend = calloc(size, sizeof(uint64_t));
+    uint64_t *nrecv = calloc(size, sizeof(uint64_t));
+    size_t *start = calloc(size, sizeof(size_t));
+    size_t *at = calloc(size, sizeof(size_t));
+    int *comm2st = calloc(size, sizeof(int));
+    int *counts = calloc(size, sizeof(int));
+    int *displs = calloc(size, sizeof(int));
+    int *rcounts = calloc(size, sizeof(int));
+    int *rdispls = calloc(size, sizeof(int));
+    if (nsend == NULL || nrecv == NULL || start == NULL || at == NULL || comm2st == NULL
+            || counts == NULL || displs == NULL || rcounts == NULL || rdispls == NULL)
+        err(1, "Out of memory for worklist exchange");
+    for (int r = 0; r < size; r++)
+        comm2st[r] = -1;
+    for (int st = 0; st < ntargets; st++)
+        comm2st[st2comm[st]] = st;
+    for (size_t j = 0; j < nown; j++) {
+        for (u64 sts = wl->recipients[j]; sts != 0; sts &= sts - 1)
+            nsend[st2comm[__builtin_ctzll(sts)]] += 1;
+    }
+    nsend[rank] = nown;
+    MPI_Alltoall(nsend, 1, MPI_UINT64_T, nrecv, 1, MPI_UINT64_T, comm);
+    size_t nlocal = 0;
+    /* The entries from each rank go in rank order, as in the whole list */
+    for (int r = 0; r < size; r++) {
+        start[r] = at[r] = nlocal;
+        nlocal += nrecv[r];
+    }
+
+    wl->info = ensure_capacity(wl->info, &wl->info_capacity, nlocal, sizeof(FileInfo));
+    wl->dropped = ensure_capacity(wl->dropped, &wl->dropped_capacity, nlocal, sizeof(u64));
+    wl->keys = ensure_capacity(wl->keys, &wl->keys_capacity, nlocal, sizeof(char *));
+    wl->stripe_role = ensure_capacity(wl->stripe_role, &wl->stripe_role_capacity, nlocal, 1);
+    wl->items = ensure_capacity(wl->items, &wl->items_capacity, nlocal, sizeof(uint32_t));
+    wl->key_offsets = ensure_capacity(wl->key_offsets, &wl->key_offsets_capacity, nlocal, sizeof(size_t));
+    size_t mine = at[rank];
+    if (mine != 0 && nown != 0) {
+        memmove(wl->info + mine, wl->info, nown*sizeof(FileInfo));
+        memmove(wl->dropped + mine, wl->dropped, nown*sizeof(u64));
+        memmove(wl->keys + mine, wl->keys, nown*sizeof(char *));
+        memmove(wl->stripe_role + mine, wl->stripe_role, nown);
+    }
+    for (size_t j = 0; j < nown; j++)
+        wl->items[mine + j] = first[rank] + j;
+
+    /* Each round moves about KEYS_PER_BCAST entries in total */
+    size_t per_rank = MAX((size_t)1, KEYS_PER_BCAST/(size_t)size);
+    size_t nrounds = 0;
+    for (int r = 0; r < size; r++)
+        nrounds = MAX(nrounds, (first[r+1] - first[r] + per_rank - 1)/per_rank);
+
+    WireState w;
+    size_t path_bytes = 0;
+    for (size_t k = 0; k < nrounds; k++)
+    {
+        size_t lo = MIN(k*per_rank, nown);
+        size_t hi = MIN(lo + per_rank, nown);
+        uint64_t send_bytes = 0;
+        for (int r = 0; r < size; r++) {
+            displs[r] = (int)send_bytes;
+            if (r == rank || comm2st[r] < 0)
+                continue;
+            /* Each entry starts with how many entries were skipped before it */
+            size_t next = lo;
+            wire_reset(&w);
+            for (size_t j = lo; j < hi; j++) {
+                if (!TEST_BIT(wl->recipients[j], comm2st[r]))
+                    continue;
+                const char *key = wl->keys[mine + j];
+                size_t key_len = strlen(key);
+                const FileInfo *fi = &wl->info[mine + j];
+                wl->wire = ensure_capacity(wl->wire, &wl->wire_capacity,
+                        send_bytes + WIRE_MAX_RECORD(key_len) + 10, 1);
+                uint8_t *dst = wl->wire + send_bytes;
+                dst = wire_put_varint(dst, j - next);
+                dst = wire_put_path(&w, dst, key, key_len);
+                dst = wire_put_timestamp(&w, dst, fi->timestamp);
+                dst = wire_put_varint(dst, fi->locations & L_MASK);
+                *dst++ = (uint8_t)GET_P(fi->locations);
+                dst = wire_put_varint(dst, wl->dropped[mine + j]);
+                *dst++ = wl->stripe_role[mine + j];
+                send_bytes = dst - wl->wire;
+                next = j + 1;
+            }
+            if (send_bytes > INT_MAX)
+                errx(1, "Too many bytes in one worklist exchange (%lu)", send_bytes);
+            counts[r] = (int)(send_bytes - displs[r]);
+        }
+        counts[rank] = 0;
+        MPI_Alltoall(counts, 1, MPI_INT, rcounts, 1, MPI_INT, comm);
+        uint64_t recv_bytes = 0;
+        for (int r = 0; r < size; r++) {
+            rdispls[r] = (int)recv_bytes;
+            recv_bytes += rcounts[r];
+            if (recv_bytes > INT_MAX)
+                errx(1, "Too many bytes in one worklist exchange (%lu)", recv_bytes);
+        }
+        wl->received = ensure_capacity(wl->received, &wl->received_capacity, recv_bytes, 1);
+        MPI_Alltoallv(wl->wire, counts, displs, MPI_BYTE,
+                wl->received, rcounts, rdispls, MPI_BYTE,
+                comm);
+        for (int r = 0; r < size; r++) {
+            if (r == rank)
+                continue;
+            size_t r_lo = MIN(first[r] + k*per_rank, first[r+1]);
+            size_t last = (r + 1 < size)? start[r+1] : nlocal;
+            decode_slice(&w, wl, wl->received + rdispls[r], wl->received + rdispls[r] + rcounts[r],
+                    r_lo, &at[r], last, &path_bytes);
+        }
+    }
+    for (int r = 0; r < size; r++)
+        if (r != rank && at[r] != start[r] + nrecv[r])
+            errx(1, "Missing worklist entries from %d", r);
+    for (size_t j = 0; j < nlocal; j++)
+        if (j < mine || j >= mine + nown)
+            wl->keys[j] = wl->key_bytes + wl->key_offsets[j];
+    free(nsend);
+    free(nrecv);
+    free(start);
+    free(at);
+    free(comm2st);
+    free(counts);
+    free(displs);
+    free(rcounts);
+    free(rdispls);
+    return nlocal;
+}
+
+/*
+ * Every eater splits the files with large chunks in its own part of the
+ * worklist in to ranges, schedules the tasks on lanes, and sends each rank
+ * the tasks it is involved in. The parts arrive in rank
+ * order, so everyone gets their tasks in worklist order - ranks that share
+ * tasks see them in the same order on the same lanes, which is what pairs up
+ * their messages without a barrier between the parts.
+ *
+ * The tasks refer to the entries by their place in the whole list, and are
+ * in `wl->tasks`. Returns how many we got.
+ */
+static
+size_t route_tasks(MPI_Comm comm, Worklist *wl, const size_t *first, const int *st2comm)
+{
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    size_t nown = first[rank+1] - first[rank];
+    const FileInfo *own = wl->info;
+
+    MPI_Datatype task_type;
+    MPI_Type_contiguous(sizeof(TaskRef), MPI_BYTE, &task_type);
+    MPI_Type_commit(&task_type);
+
+    int *counts = calloc(size, sizeof(int));
+    int *displs = calloc(size, sizeof(int));
+    int *rcounts = calloc(size, sizeof(int));
+    int *rdispls = calloc(size, sizeof(int));
+    int *pos = calloc(size, sizeof(int));
+    if (counts == NULL || displs == NULL || rcounts == NULL || rdispls == NULL || pos == NULL)
+        err(1, "Out of memory for task routing");
+    size_t njobs = 0;
+    for (size_t j = 0; j < nown; j++)
+    {
+        /* Members of a stripe only go in the database */
+        if (GET_P(own[j].locations) == NO_P)
+            continue;
+        u64 bytes = wl->chunk_bytes[j];
+        uint32_t nranges = MAX(bytes/TASK_RANGE_SIZE, 1);
+        wl->jobs = ensure_capacity(wl->jobs, &wl->jobs_capacity, njobs + nranges, sizeof(TaskRef));
+        wl->job_targets = ensure_capacity(wl->job_targets, &wl->job_targets_capacity, njobs + nranges, sizeof(u64));
+        wl->job_costs = ensure_capacity(wl->job_costs, &wl->job_costs_capacity, njobs + nranges, sizeof(u64));
+        for (uint32_t r = 0; r < nranges; r++, njobs++) {
+            u64 range_bytes = (r + 1 == nranges)? bytes - r*TASK_RANGE_SIZE : TASK_RANGE_SIZE;
+            TaskRef t = {(uint32_t)(first[rank] + j), 0, r, nranges};
+            wl->jobs[njobs] = t;
+            wl->job_targets[njobs] = (own[j].locations & L_MASK) | (1ULL << GET_P(own[j].locations));
+            wl->job_costs[njobs] = TASK_COST(range_bytes);
+        }
+    }
+    wl->lanes = ensure_capacity(wl->lanes, &wl->lanes_capacity, njobs, sizeof(int));
+    schedule_tasks(N_LANES, njobs, wl->job_targets, wl->job_costs, wl->lanes);
+    for (size_t j = 0; j < njobs; j++) {
+        wl->jobs[j].lane = wl->lanes[j];
+        for (u64 sts = wl->job_targets[j]; sts != 0; sts &= sts - 1)
+            counts[st2comm[__builtin_ctzll(sts)]] += 1;
+    }
+    for (int r = 1; r < size; r++)
+        pos[r] = displs[r] = displs[r-1] + counts[r-1];
+    size_t nroutes = displs[size-1] + counts[size-1];
+    wl->routes = ensure_capacity(wl->routes, &wl->routes_capacity, nroutes, sizeof(TaskRef));
+    for (size_t j = 0; j < njobs; j++)
+        for (u64 sts = wl->job_targets[j]; sts != 0; sts &= sts - 1)
+            wl->routes[pos[st2comm[__builtin_ctzll(sts)]]++] = wl->jobs[j];
+    MPI_Alltoall(counts, 1, MPI_INT, rcounts, 1, MPI_INT, comm);
+    for (int r = 1; r < size; r++)
+        rdispls[r] = rdispls[r-1] + rcounts[r-1];
+    size_t ntasks = rdispls[size-1] + rcounts[size-1];
+    wl->tasks = ensure_capacity(wl->tasks, &wl->tasks_capacity, ntasks, sizeof(TaskRef));
+    MPI_Alltoallv(wl->routes, counts, displs, task_type,
+            wl->tasks, rcounts, rdispls, task_type,
+            comm);
+    MPI_Type_free(&task_type);
+    free(counts);
+    free(displs);
+    free(rcounts);
+    free(rdispls);
+    free(pos);
+    return ntasks;
+}
+
+/* Where the entry `item` of the whole list is in ours */
+static
+size_t local_item(const Worklist *wl, size_t nlocal, uint32_t item)
+{
+    size_t lo = 0, hi = nlocal;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (wl->items[mid] < item)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == nlocal || wl->items[lo] != item)
+        errx(1, "Got a task for entry %u that wasn't sent to us", item);
+    return lo;
+}
+
+/*
+ * Groups the tasks we got by lane in `wl->lane_tasks`, with the items as
+ * places in our list, and marks the entries we only have to put in the
+ * database by leaving them out of `wl->involved`.
+ */
+static
+void place_tasks(Worklist *wl, size_t ntasks, size_t nitems)
+{
+    for (size_t k = 0; k < ntasks; k++)
+        wl->tasks[k].item = local_item(wl, nitems, wl->tasks[k].item);
+    wl->involved = ensure_capacity(wl->involved, &wl->involved_capacity, nitems, 1);
+    memset(wl->involved, 0, nitems);
+    wl->ranges = ensure_capacity(wl->ranges, &wl->ranges_capacity, nitems, sizeof(RangeState));
+    wl->lane_tasks = ensure_capacity(wl->lane_tasks, &wl->lane_tasks_capacity, ntasks, sizeof(TaskRef));
+    size_t fill[N_LANES + 1] = {0};
+    for (size_t k = 0; k < ntasks; k++) {
+        wl->involved[wl->tasks[k].item] = 1;
+        wl->ranges[wl->tasks[k].item].ranges_left = wl->tasks[k].nranges;
+        wl->ranges[wl->tasks[k].item].max_cs = RANGE_MAX_CS_UNSET;
+        fill[wl->tasks[k].lane + 1] += 1;
+    }
+    for (int l = 0; l < N_LANES; l++)
+        fill[l + 1] += fill[l];
+    memcpy(wl->lane_start, fill, sizeof(fill));
+    for (size_t k = 0; k < ntasks; k++)
+        wl->lane_tasks[fill[wl->tasks[k].lane]++] = wl->tasks[k];
+}
+
+/*
+ * Phase 2: The eaters build worklists from their batches of resolved events
+ * at the same time, and the lists are joined in rank order in to one
+ * schedule for the batch. Everyone gets the tasks they are involved in and
+ * the entries for their copy of the database, then processes their tasks in
+ * parallel - there is no synchronisation between the parts of the schedule,
+ * a lane moves on to the next part as soon as it is done with its tasks in
+ * the current one.
+ */
+static
+void phase2(MPI_Comm comm,
+        PersistentDB *pdb,
+        HostState *hs,
+        const ReceivedFile *batch,
+        size_t batch_size,
+        const size_t *class_start,
+        Worklist *wl,
+        LanePool *pool,
+        ParityLoad *run_load,
+        int ntargets)
+{
+    int mpi_bcast_rank;
+    MPI_Comm_rank(comm, &mpi_bcast_rank);
+    int mpi_bcast_size;
+    MPI_Comm_size(comm, &mpi_bcast_size);
+
+    ProgressSender pr_sender;
+    memset(&pr_sender, 0, sizeof(pr_sender));
+    ProgressSample pr_sample = PROGRESS_SAMPLE_INIT;
+
+    /* Where the storage targets are in `comm` */
+    int st2comm[MAX_TARGETS];
+    MPI_Group world_group, comm_group;
+    MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    MPI_Comm_group(comm, &comm_group);
+    MPI_Group_translate_ranks(world_group, ntargets, st2rank, comm_group, st2comm);
+    MPI_Group_free(&world_group);
+    MPI_Group_free(&comm_group);
+
+    uint64_t nown = 0;
+    ParityLoad batch_load;
+    memset(&batch_load, 0, sizeof(batch_load));
+    if (mpi_bcast_rank != 0)
+        nown = build_worklist(pdb, batch, batch_size, class_start, wl, run_load, &batch_load,
+                ntargets, hs->storage_target);
+    MPI_Allreduce(MPI_IN_PLACE, &batch_load, sizeof(batch_load)/sizeof(u64), MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    for (size_t k = 0; k < sizeof(batch_load)/sizeof(u64); k++)
+        ((u64 *)run_load)[k] += ((u64 *)&batch_load)[k];
+
+    /* Our part of the schedule starts at first[rank] */
+    uint64_t *nparts = calloc(mpi_bcast_size, sizeof(uint64_t));
+    size_t *first = calloc(mpi_bcast_size + 1, sizeof(size_t));
+    if (nparts == NULL || first == NULL)
+        err(1, "Out of memory for worklist sizes");
+    MPI_Allgather(&nown, 1, MPI_UINT64_T, nparts, 1, MPI_UINT64_T, comm);
+    for (int r = 0; r < mpi_bcast_size; r++)
+        first[r+1] = first[r] + nparts[r];
+    free(nparts);
+    uint64_t nitems = first[mpi_bcast_size];
+    if (nitems > INT_MAX)
+        errx(1, "Too many files in one worklist (%lu)", nitems);
+    if (nitems == 0) {
+        free(first);
+        return;
+    }
+    size_t ntasks = route_tasks(comm, wl, first, st2comm);
+    size_t nlocal = exchange_worklists(comm, wl, first, st2comm, ntargets);
+    free(first);
+    place_tasks(wl, ntasks, nlocal);
+    FileInfo *worklist_info = wl->info;
+
+    uint64_t events_per_st[MAX_TARGETS] = {0};
+    uint64_t events_processed = 0;
+
+    if (mpi_rank == 0) {
+        printf("\n==== begin iteration ====\n");
+        printf("st - total files   | data read     | data written  | disk I/O\n");
+        pr_receive_loop(mpi_bcast_size-1);
+        MPI_Gather(
+                &events_processed, sizeof(events_processed), MPI_BYTE,
+                events_per_st, sizeof(events_processed), MPI_BYTE,
+                0,
+                comm);
+        for (int j = 0; j < ntargets; j++)
+            events_processed += events_per_st[j];
+        printf("==== end iteration (calculated parity for %zu files) ====\n", events_processed);
+        MPI_Barrier(comm);
+        return;
+    }
+
+    ProgressSample old_samples[N_LANES];
+    ProgressSample cur_samples[N_LANES];
+    memset(old_samples, 0, sizeof(old_samples));
+    memset(cur_samples, 0, sizeof(cur_samples));
+    ListParams param0 = {hs,pdb,wl->keys,worklist_info,wl->dropped,wl->involved,wl->stripe_role,nlocal,wl->ranges,NULL,0,NULL,NULL,NULL,0,N_LANES,NULL};
+    ListParams params[N_LANES];
+    for (int j = 0; j < N_LANES; j++) {
+        params[j] = param0;
+        params[j].tasks = wl->lane_tasks + wl->lane_start[j];
+        params[j].ntasks = wl->lane_start[j + 1] - wl->lane_start[j];
+        params[j].sample = &cur_samples[j];
+        params[j].lane = j;
+    }
+    lane_pool_start(pool, params);
+    for (;;)
+    {
+        for (int r = 0; r < 100; r++)
+        {
+            pthread_mutex_lock(&pool->lock);
+            if (pool->working == 0)
+                goto after_reporting_loop;
+            pthread_mutex_unlock(&pool->lock);
+            usleep(10*1000);
+        }
+        for (int j = 0; j < N_LANES; j++) {
+            size_t nf = cur_samples[j].nfiles;
+            double ndt = cur_samples[j].dt;
+            size_t nbw = cur_samples[j].bytes_written;
+            size_t nbr = cur_samples[j].bytes_read;
+            pr_sample.nfiles += nf - old_samples[j].nfiles;
+            pr_sample.dt = 1.0;//ndt - old_samples[j].dt;
+            pr_sample.bytes_written += nbw - old_samples[j].bytes_written;
+            pr_sample.bytes_read += nbr - old_samples[j].bytes_read;
+            old_samples[j].nfiles = nf;
+            old_samples[j].dt = ndt;
+            old_samples[j].bytes_written = nbw;
+            old_samples[j].bytes_read = nbr;
+        }
+        pr_add_tmp_to_total(&pr_sample);
+        pr_report_progress(&pr_sender, pr_sample);
+        pr_clear_tmp(&pr_sample);
+    }
+after_reporting_loop:
+    pthread_mutex_unlock(&pool->lock);
+    for (int j = 0; j < N_LANES; j++) {
+        pr_sample.nfiles += cur_samples[j].nfiles - old_samples[j].nfiles;
+        pr_sample.dt += cur_samples[j].dt - old_samples[j].dt;
+        pr_sample.bytes_written += cur_samples[j].bytes_written - old_samples[j].bytes_written;
+        pr_sample.bytes_read += cur_samples[j].bytes_read - old_samples[j].bytes_read;
+    }
+    pr_add_tmp_to_total(&pr_sample);
+    pr_report_progress(&pr_sender, pr_sample);
+    pr_clear_tmp(&pr_sample);
+    pr_report_done(&pr_sender);
+
+    events_processed = pr_sample.total_nfiles;
+    MPI_Gather(
+            &events_processed, sizeof(events_processed), MPI_BYTE,
+            events_per_st, sizeof(events_processed), MPI_BYTE,
+            0,
+            comm);
+
+    MPI_Barrier(comm);
+}
+
+/* Where the parity work went, next to where the old placement would have put it */
+static
+void report_parity_load(const ParityLoad *load, int ntargets)
+{
+    printf("Parity placement (projected):\n");
+    printf("st - files      | MiB          | old files  | old MiB\n");
+    for (int st = 0; st < ntargets; st++)
+        printf("%2d - %10llu | %12.1f | %10llu | %12.1f\n",
+                st,
+                load->files[st], load->bytes[st]/(1024.0*1024.0),
+                load->old_files[st], load->old_bytes[st]/(1024.0*1024.0));
+    if (have_topology) {
+        printf("cross-switch | %12.1f MiB, %.1f MiB with the old placement\n",
+                load->cross_rack_bytes/(1024.0*1024.0),
+                load->old_cross_rack_bytes/(1024.0*1024.0));
+        printf("shared host  | %12llu files, %llu with the old placement\n",
+                load->shared_host_files, load->old_shared_host_files);
+    }
+}
+
+/*
+ * Waits for a non-blocking collective without spinning - in daemon mode the
+ * ranks spend most of their time waiting for the next wave and shouldn't eat
+ * CPU on the storage servers while doing so.
+ */
+static
+void lazy_wait(MPI_Request *req)
+{
+    int done = 0;
+    while (!done) {
+        MPI_Test(req, &done, MPI_STATUS_IGNORE);
+        if (!done)
+            usleep(50*1000);
+    }
+}
+
+/* Returns non-zero if any rank had an error during the wave */
+static
+int end_of_wave(int had_error)
+{
+    int any_error = 0;
+    MPI_Request req;
+    MPI_Iallreduce(&had_error, &any_error, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD, &req);
+    lazy_wait(&req);
+    return any_error;
+}
+
+/* Global coordinator decides if there should be another wave */
+static
+int wait_for_next_wave(time_t wave_start, int wave_interval, const char *stop_file)
+{
+    int keep_going = 1;
+    if (mpi_rank == global_coordinator) {
+        while (time(NULL) < wave_start + wave_interval
+                && (stop_file == NULL || access(stop_file, F_OK) != 0))
+            sleep(1);
+        if (stop_file != NULL && access(stop_file, F_OK) == 0) {
+            unlink(stop_file);
+            keep_going = 0;
+        }
+    }
+    MPI_Request req;
+    MPI_Ibcast(&keep_going, 1, MPI_INT, global_coordinator, MPI_COMM_WORLD, &req);
+    lazy_wait(&req);
+    return keep_going;
+}
+
+/* Sums up what the eaters hold at the end of phase 1 */
+static
+void report_memory_use(MPI_Comm comm, const EventStore *store)
+{
+    uint64_t mine[4] = {0, 0, 0, 0};
+    if (mpi_rank != global_coordinator) {
+        mine[0] = store->nfiles;
+        mine[1] = event_store_memory_use(store);
+        mine[2] = store->spilled_entries;
+        mine[3] = store->spilled_runs;
+    }
+    uint64_t total[4];
+    uint64_t largest = 0;
+    MPI_Reduce(mine, total, 4, MPI_UINT64_T, MPI_SUM, global_coordinator, comm);
+    MPI_Reduce(&mine[1], &largest, 1, MPI_UINT64_T, MPI_MAX, global_coordinator, comm);
+    if (mpi_rank == global_coordinator) {
+        printf("Phase 1 memory: %lu files in %.1f MiB across eaters, at most %.1f MiB on one\n",
+                total[0], total[1]/(1024.0*1024.0), largest/(1024.0*1024.0));
+        if (total[3] != 0)
+            printf("Phase 1 spilled %lu entries to disk in %lu runs\n", total[2], total[3]);
+    }
+}
+
+/*
+ * Global coordinator decides when phase 2 takes the next batch: when phase 1
+ * is done, or in a pipelined run when PIPELINE_BATCH_INTERVAL seconds have
+ * passed since the last batch started. Returns non-zero for the last batch.
+ */
+static
+int wait_for_next_batch(MPI_Comm comm, ScanProgress *scan, int pipelined, time_t batch_start)
+{
+    int last_batch = 0;
+    if (mpi_rank == global_coordinator) {
+        for (;;) {
+            pthread_mutex_lock(&scan->lock);
+            last_batch = scan->done;
+            pthread_mutex_unlock(&scan->lock);
+            if (last_batch
+                    || (pipelined && time(NULL) >= batch_start + PIPELINE_BATCH_INTERVAL))
+                break;
+            usleep(100*1000);
+        }
+    }
+    MPI_Request req;
+    MPI_Ibcast(&last_batch, 1, MPI_INT, global_coordinator, comm, &req);
+    lazy_wait(&req);
+    return last_batch;
+}
+
+static
+void save_timestamp(const char *timestamp_file, time_t timestamp)
+{
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", timestamp_file);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+        err(1, "Couldn't write timestamp to '%s'", tmp);
+    fprintf(f, "%ld\n", (long)timestamp);
+    fclose(f);
+    if (rename(tmp, timestamp_file) == -1)
+        err(1, "Couldn't update '%s'", timestamp_file);
+}
+
+/* The changelogs consumed by the last wave are no longer needed */
+static
+void cleanup_changelogs(const char *deletable)
+{
+    char cmd_buf[512];
+    snprintf(cmd_buf, sizeof(cmd_buf), "bp-find-chunks-changed-between --cleanup --deletable=%s", deletable);
+    if (system(cmd_buf) != 0)
+        warnx("Changelog cleanup failed, the events will be seen again");
+    unlink(deletable);
+}
+
+/*
+ * The optional topology file has a line per storage target with its
+ * targetNumID, host and rack (the switch it is behind), separated by white
+ * space. Lines starting with '#' are comments, and targets that aren't part
+ * of this store are skipped - so one file can cover all the stores.
+ */
+static
+void load_topology(const char *path, const RunData *run)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        err(1, "Couldn't open topology file '%s'", path);
+    char hosts[MAX_TARGETS][64];
+    char racks[MAX_TARGETS][64];
+    int found[MAX_TARGETS] = {0};
+    char line[512];
+    for (int lineno = 1; fgets(line, sizeof(line), f) != NULL; lineno++)
+    {
+        char host[64], rack[64];
+        int id;
+        char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if (sscanf(p, "%d %63s %63s", &id, host, rack) != 3)
+            errx(1, "%s:%d: expected '<targetNumID> <host> <rack>'", path, lineno);
+        for (int st = 0; st < run->ntargets; st++) {
+            if (run->targetIDs[st].id != id)
+                continue;
+            strcpy(hosts[st], host);
+            strcpy(racks[st], rack);
+            found[st] = 1;
+        }
+    }
+    fclose(f);
+    for (int a = 0; a < run->ntargets; a++) {
+        if (!found[a])
+            errx(1, "targetNumID %d is missing from '%s'", run->targetIDs[a].id, path);
+        same_host[a] = same_rack[a] = 0;
+        for (int b = 0; b < run->ntargets; b++) {
+            if (found[b] && strcmp(hosts[a], hosts[b]) == 0)
+                same_host[a] |= 1ULL << b;
+            if (found[b] && strcmp(racks[a], racks[b]) == 0)
+                same_rack[a] |= 1ULL << b;
+        }
+    }
+}
+
+static void usage(void)
+{
+    fputs("usage: bp-parity-gen [options] <complete|partial|daemon> <store> <deletable> <data file> <db folder>\n"
+          "  --interval <s>          seconds between the start of waves in daemon mode\n"
+          "  --stop-file <path>      daemon mode stops after the wave where this file shows up\n"
+          "  --timestamp-file <path> daemon mode stores the start time of each finished wave here\n"
+          "  --memory-budget <MiB>   memory for the events on each eater, spills to disk beyond it\n"
+          "  --spill-dir <path>      where the spilled events go, required with --memory-budget\n"
+          "  --topology <path>       host and rack of every storage target, for placing parity\n"
+          "  --parity-dir <path>     where the parity goes, inside the store (default: parity)\n"
+          "  --parity-writers <n>    threads that write the parity, instead of the lanes\n"
+          "  --parity-queue-depth <n> blocks of parity queued for the writers (default: 2 per writer)\n",
+          stdout);
+}
+
+int main(int argc, char **argv)
+{
+    int wave_interval = 60;
+    const char *stop_file = NULL;
+    const char *timestamp_file = NULL;
+    size_t memory_budget = 0;
+    const char *spill_dir = NULL;
+    const char *topology_file = NULL;
+    const char *parity_dir = "parity";
+    int parity_writers = 0;
+    int parity_queue_depth = 0;
+    static const struct option long_options[] = {
+        {"interval",       required_argument, NULL, 'i'},
+        {"stop-file",      required_argument, NULL, 's'},
+        {"timestamp-file", required_argument, NULL, 't'},
+        {"memory-budget",  required_argument, NULL, 'm'},
+        {"spill-dir",      required_argument, NULL, 'd'},
+        {"topology",       required_argument, NULL, 'o'},
+        {"parity-dir",     required_argument, NULL, 'p'},
+        {"parity-writers", required_argument, NULL, 'w'},
+        {"parity-queue-depth", required_argument, NULL, 'q'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i': wave_interval = atoi(optarg); break;
+            case 's': stop_file = optarg; break;
+            case 't': timestamp_file = optarg; break;
+            case 'm': memory_budget = strtoull(optarg, NULL, 10) * 1024 * 1024; break;
+            case 'd': spill_dir = optarg; break;
+            case 'o': topology_file = optarg; break;
+            case 'p': parity_dir = optarg; break;
+            case 'w': parity_writers = atoi(optarg); break;
+            case 'q': parity_queue_depth = atoi(optarg); break;
+            default: usage(); return 1;
+        }
+    }
+    if (parity_queue_depth == 0)
+        parity_queue_depth = 2*parity_writers;
+    if (argc - optind != 5 || (memory_budget != 0 && spill_dir == NULL)
+            || parity_writers < 0 || parity_queue_depth < 0
+            || !is_inside_store(parity_dir)) {
+        usage();
+        return 1;
+    }
+
+    const char *operation = argv[optind + 0];
+    const char *store_dir = argv[optind + 1];
+    const char *deletable = argv[optind + 2];
+    const char *data_file = argv[optind + 3];
+    const char *db_folder = argv[optind + 4];
+    const int daemon_mode = (strcmp(operation, "daemon") == 0);
+
+    PROF_START(total);
+
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    if (provided < MPI_THREAD_MULTIPLE) {
+        fputs("Your MPI does not support multithreading!\n", stderr);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &mpi_world_size);
+
+    int ntargets = (mpi_world_size - 1)/2;
+
+    if (ntargets > MAX_TARGETS) {
+        return 1;
+    }
+
+    /* TODO: Should be skipped on rank 0 - it doesn't have a /store0x */
+    int store_fd = open(store_dir, O_DIRECTORY | O_RDONLY);
+
+    PROF_START(init);
+
+    int last_run_fd = -1;
+    RunData last_run;
+    memset(&last_run, 0, sizeof(RunData));
+    if (mpi_rank == 0) {
+        last_run_fd = open(data_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+        read(last_run_fd, &last_run, sizeof(RunData));
+        if (lseek(last_run_fd, 0, SEEK_END) != sizeof(RunData))
+            last_run.nowners = 0;
+    }
+
+    /* Create mapping from storage targets to ranks, and vice versa */
+    Target targetIDs[2*MAX_TARGETS] = {{0,0,0}};
+    Target targetID = {0,0,GIT_VERSION};
+    int target_weight = 0;
+    int target_weights[2*MAX_TARGETS] = {0};
+    if (mpi_rank != 0)
+    {
+        int target_ID_fd = openat(store_fd, "targetNumID", O_RDONLY);
+        char targetID_s[20] = {0};
+        read(target_ID_fd, targetID_s, sizeof(targetID_s));
+        close(target_ID_fd);
+        targetID.id = atoi(targetID_s);
+        targetID.rank = mpi_rank;
+        /* Parity can be on a device of its own, it's the one that fills up */
+        int parity_fd = openat(store_fd, parity_dir, O_DIRECTORY | O_RDONLY);
+        target_weight = get_store_weight(parity_fd != -1? parity_fd : store_fd);
+        if (parity_fd != -1)
+            close(parity_fd);
+    }
+    MPI_Gather(
+            &targetID, sizeof(Target), MPI_BYTE,
+            targetIDs, sizeof(Target), MPI_BYTE,
+            0,
+            MPI_COMM_WORLD);
+    MPI_Gather(
+            &target_weight, sizeof(int), MPI_BYTE,
+            target_weights, sizeof(int), MPI_BYTE,
+            0,
+            MPI_COMM_WORLD);
+    if (mpi_rank == 0) {
+        if (ntargets < last_run.ntargets)
+            errx(1, "Fewer targets than last run, something is wrong!");
+        for (int i = 1; i < 2*ntargets+1; i++)
+            if (targetIDs[i].version != GIT_VERSION)
+                errx(1, "Version mismatch");
         for (int i = 1; i < 2*ntargets+1; i+=2)
             if (targetIDs[i].id != targetIDs[i+1].id)
                 errx(1, "All hosts must have two consecutive ranks");
@@ -526,6 +2841,10 @@ int main(int argc, char **argv)
                 last_run.targetIDs[k++] = target;
         }
         last_run.ntargets = ntargets;
+        /* The databases are sharded by the first run that gets here */
+        if (last_run.nowners == 0)
+            last_run.nowners = ntargets;
+        nowners = last_run.nowners;
         rank2st[0] = -1;
         int total_weight = 0;
         for (int i = 0; i < ntargets; i++)
@@ -538,14 +2857,23 @@ int main(int argc, char **argv)
             rank2st[st2rank[i]+1] = i;
             total_weight += target_weights[rank];
             st_weight[i] = total_weight;
+            same_host[i] = 1ULL << i;
+            same_rack[i] = L_MASK;
         }
+        if (topology_file != NULL)
+            load_topology(topology_file, &last_run);
     }
     MPI_Bcast(st2rank, sizeof(st2rank), MPI_BYTE, 0, MPI_COMM_WORLD);
     MPI_Bcast(rank2st, sizeof(rank2st), MPI_BYTE, 0, MPI_COMM_WORLD);
     MPI_Bcast(st_weight, sizeof(st_weight), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(same_host, sizeof(same_host), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(same_rack, sizeof(same_rack), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&nowners, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    have_topology = (topology_file != NULL);
 
     if (mpi_rank == 0) {
-        if (write(last_run_fd, &last_run, sizeof(RunData)) == -1)
+        if (pwrite(last_run_fd, &last_run, sizeof(RunData), 0) != sizeof(RunData)
+                || ftruncate(last_run_fd, sizeof(RunData)) == -1)
             err(1, "Couldn't save storage-target to id mapping");
         close(last_run_fd);
     }
@@ -572,361 +2900,227 @@ int main(int argc, char **argv)
     MPI_Group_excl(everyone, ntargets, feeder_ranks, &not_everyone);
     MPI_Comm comm;
     MPI_Comm_create(MPI_COMM_WORLD, not_everyone, &comm);
+    MPI_Comm_dup(MPI_COMM_WORLD, &p1_comm);
 
-    PROF_START(phase1);
-
-    FileInfoHash *file_info_hash = NULL;
-    size_t name_bytes_written = 0;
-    const size_t name_bytes_limit = MAX_WORKITEMS*100;
-    char *flat_file_names = malloc(name_bytes_limit);
-    char **names = malloc(MAX_WORKITEMS*sizeof(char*));
-    FatFileInfo *file_info = malloc(MAX_WORKITEMS*sizeof(FatFileInfo));
-    SizeIndex *received_entries = malloc(MAX_WORKITEMS*sizeof(SizeIndex));
-    size_t items_received = 0;
-
-    /*
-     * In phase 1 we have 3 kinds of processes:
-     *  - global coordinator
-     *  - feeders
-     *  - eaters
-     *
-     * An eater simply receives data from anyone (storing it for later) - only
-     * stopping when the global coordinator sends them a message.
-     *
-     * The feeders run through their files/chunks, selects a "random" eater and
-     * sends filename, size, etc to it. Once they are done with their files
-     * they message the global coordinator.
-     *
-     * Finally the global coordinator waits until every feeder has told it that
-     * they are done processing - then it tells the eaters.
-     */
     int p1_eater = (mpi_rank % 2 == 1);
     int p1_feeder = (mpi_rank > 0 && mpi_rank % 2 == 0);
-    int64_t files_seen_total = 0;
-    int outputs_on_line = 0;
-    if (mpi_rank == global_coordinator)
-    {
-        int still_in_stage_1 = ntargets;
-        printf("events: ");
-        while (still_in_stage_1 > 0) {
-            MPI_Status stat;
-            int64_t files_seen;
-            MPI_Recv(&files_seen, sizeof(files_seen), MPI_BYTE, MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &stat);
-            if (files_seen < 0)
-                still_in_stage_1 -= 1;
-            else {
-                files_seen_total += files_seen;
-                printf("  %ld", files_seen_total);
-                if (++outputs_on_line == 12)
-                {
-                    printf("\n");
-                    outputs_on_line = 0;
-                }
-            }
-        }
-        /* Inform all eaters that there is no more food */
-        uint8_t dummy = 1;
-        for (int i = 1; i < 1 + 2*ntargets; i+=2)
-            send_sync_message_to(i, 1, &dummy);
-        printf("\nTotal number of events found: %8ld\n", files_seen_total);
-    }
-    else if (p1_feeder)
-    {
-        FILE *slave;
-        char cmd_buf[512];
-        if (strcmp(operation, "complete") == 0)
-            snprintf(cmd_buf, sizeof(cmd_buf), "bp-find-all-chunks %s/chunks", store_dir);
-        else if (strcmp(operation, "partial") == 0)
-            snprintf(cmd_buf, sizeof(cmd_buf), "bp-find-chunks-changed-between --deletable %s --store %s/chunks/", deletable, store_dir);
-        else
-            strcpy(cmd_buf, "cat /dev/null");
-        slave = popen(cmd_buf, "r");
-        feed_targets_with(slave, ntargets);
-        pclose(slave);
-    }
-    else if (p1_eater)
-    {
-        file_info_hash = fih_init();
-        uint8_t *recv_buffer = calloc(1,TARGET_BUFFER_SIZE);
-        for (;;) {
-            MPI_Status stat;
-            MPI_Recv(recv_buffer, TARGET_BUFFER_SIZE, MPI_BYTE, MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &stat);
-            if (stat.MPI_SOURCE == global_coordinator)
-                break;
-            /* parse and add data */
-            int actually_received = 0;
-            MPI_Get_count(&stat, MPI_BYTE, &actually_received);
-            int src = stat.MPI_SOURCE;
-            int i = 0;
-            while (i < actually_received) {
-                packed_file_info *pfi = (packed_file_info *)(recv_buffer+i);
-                i += sizeof(packed_file_info) + pfi->path_len;
-                if (name_bytes_written + pfi->path_len + 1 >= name_bytes_limit)
-                    errx(1, "Only room for %zu bytes of paths. Asked for %lu.",
-                            name_bytes_limit, name_bytes_written + pfi->path_len + 1);
-                char *n = flat_file_names + name_bytes_written;
-                memmove(n, pfi->path, pfi->path_len);
-                n[pfi->path_len] = '\0';
-                name_bytes_written += pfi->path_len + 1;
-                size_t idx;
-                if (fih_get_or_create(file_info_hash, n, &idx) == FIH_NEW) {
-                    memset(&file_info[idx], 0, sizeof(FatFileInfo));
-                    received_entries[idx].size = 0;
-                    received_entries[idx].idx = idx;
-                    names[idx] = n;
-                    items_received += 1;
-                    if (items_received >= MAX_WORKITEMS)
-                        errx(1, "Too many events (max = %llu)", MAX_WORKITEMS);
-                }
-                else
-                    name_bytes_written -= pfi->path_len + 1;
-                received_entries[idx].size += pfi->chunk_size;
-                fih_add_info(
-                        &file_info[idx],
-                        st_from_feeder_rank(src),
-                        pfi->timestamp,
-                        (pfi->event_type == UNLINK_EVENT));
-            }
-        }
-        free(recv_buffer);
-        fih_term(file_info_hash);
-        file_info_hash = NULL;
-    }
 
-    if (p1_feeder) {
-        MPI_Finalize();
-        return 0;
-    }
-
-    PROF_END(phase1);
-
-    PROF_START(sort_by_size);
-    MPI_Barrier(comm);
-    if (mpi_rank == 0) {
-        printf("Starting sort..");
-        fflush(stdout);
-    }
-    assert(items_received < MAX_WORKITEMS);
-    shuffle(received_entries, items_received);
-    qsort(received_entries, items_received, sizeof(SizeIndex), cmp_entries);
-    MPI_Barrier(comm);
-    if (mpi_rank == 0)
-        printf("  done.\n");
-    PROF_END(sort_by_size);
+    EventStore store;
+    memset(&store, 0, sizeof(store));
+    PersistentDB *pdb = NULL;
+    HostState hs;
+    memset(&hs, 0, sizeof(hs));
+    Worklist wl;
+    memset(&wl, 0, sizeof(wl));
+    LanePool pool;
+    ParityContainers containers;
+    if (p1_eater)
+        lane_pool_init(&pool, &containers);
 
+    /*
+     * Only the eaters have a shard of the database. The snapshot of it goes
+     * away before we change anything, and a new one is written when we are
+     * done - so there is never a snapshot that is older than the database.
+     */
+    char snapshot_path[PATH_MAX];
+    pdb_snapshot_path(db_folder, snapshot_path, sizeof(snapshot_path));
     PROF_START(load_db);
-    PersistentDB *pdb = pdb_init(db_folder, DB_VERSION);
+    if (!p1_feeder)
+        event_store_init(&store, ntargets, memory_budget, spill_dir);
+    if (p1_eater) {
+        pdb = pdb_init(db_folder, DB_VERSION, DB_VERSION_REPLICATED);
+        if (unlink(snapshot_path) != 0 && errno != ENOENT)
+            err(1, "Can't remove the old snapshot '%s'", snapshot_path);
+        if (pdb_version(pdb) == DB_VERSION_REPLICATED)
+            pdb_keep_shard(pdb, rank2st[mpi_rank], nowners, DB_VERSION_TEXT_KEYS);
+        if (pdb_version(pdb) == DB_VERSION_TEXT_KEYS)
+            pdb_convert_keys(pdb, DB_VERSION);
+        if (pdb_version(pdb) >= DB_VERSION_NO_CONTAINERS
+                && pdb_version(pdb) < DB_VERSION)
+            pdb_set_version(pdb, DB_VERSION);
+    }
     PROF_END(load_db);
 
-    PROF_START(phase2);
-
-    FileInfo *worklist_info = malloc(MAX_WORKITEMS*sizeof(FileInfo));
-    char *worklist_keys = malloc(name_bytes_limit);
-
-    int mpi_bcast_rank;
-    MPI_Comm_rank(comm, &mpi_bcast_rank);
-    int mpi_bcast_size;
-    MPI_Comm_size(comm, &mpi_bcast_size);
-    int my_st = rank2st[mpi_rank];
-
-    ProgressSender pr_sender;
-    memset(&pr_sender, 0, sizeof(pr_sender));
-    ProgressSample pr_sample = PROGRESS_SAMPLE_INIT;
-
-    if (mpi_rank != 0) {
-        int par_mkdir_rc = mkdirat(store_fd, "parity", 0700);
+    if (mpi_rank != 0 && !p1_feeder) {
+        int par_mkdir_rc = mkdirat(store_fd, parity_dir, 0700);
         if (par_mkdir_rc == -1 && errno != EEXIST) {
             err(1, "No parity folder, and we can't create one");
         }
     }
 
-    HostState hs;
-    memset(&hs, 0, sizeof(hs));
-    hs.storage_target = my_st;
-    hs.fd_null = open("/dev/null", O_WRONLY);
-    hs.fd_zero = open("/dev/zero", O_RDONLY);
-    char *log_file_name = calloc(1, 201);
-    snprintf(log_file_name, 200, "%s/../errors.log", db_folder);
-    hs.log = fopen(log_file_name, "w");
-    hs.write_dir = openat(store_fd, "parity", O_DIRECTORY | O_RDONLY);
-    hs.read_chunk_dir = openat(store_fd, "chunks", O_DIRECTORY | O_RDONLY);
-    hs.read_parity_dir = -1; /* We only write to parity, no reading */
+    if (!p1_feeder) {
+        hs.storage_target = rank2st[mpi_rank];
+        hs.fd_null = open("/dev/null", O_WRONLY);
+        hs.fd_zero = open("/dev/zero", O_RDONLY);
+        char *log_file_name = calloc(1, 201);
+        snprintf(log_file_name, 200, "%s/../errors.log", db_folder);
+        hs.log = fopen(log_file_name, "w");
+        hs.write_dir = openat(store_fd, parity_dir, O_DIRECTORY | O_RDONLY);
+        if (p1_eater && hs.write_dir == -1)
+            err(1, "Can't open the parity folder '%s'", parity_dir);
+        hs.read_chunk_dir = openat(store_fd, "chunks", O_DIRECTORY | O_RDONLY);
+        hs.read_parity_dir = -1; /* We only write to parity, no reading */
+        fprintf(hs.log, "=== start new run ===\n");
+    }
+    if (p1_eater)
+        containers_open(&containers, hs.write_dir);
+    if (p1_eater && parity_writers > 0)
+        hs.parity_writer = parity_writer_start(parity_writers, parity_queue_depth,
+                FILE_TRANSFER_BUFFER_SIZE);
     close(store_fd);
 
-    fprintf(hs.log, "=== start new run ===\n");
-
-    for (int i = 1; i < mpi_bcast_size; i++)
+    /*
+     * A normal run is a single wave. In daemon mode we keep all ranks, the
+     * database and the buffers alive, and start a new partial wave every
+     * `wave_interval` seconds until someone creates the stop file.
+     */
+    int exit_code = 0;
+    for (int wave = 1;; wave++)
     {
-        size_t nitems = items_received;
-        size_t path_bytes = 0;
-        if (mpi_bcast_rank == i)
+        time_t wave_start = time(NULL);
+
+        ScanProgress scan = {ntargets, 0.0, PTHREAD_MUTEX_INITIALIZER, 0};
+        pthread_t scan_thread;
+        int rc = 0;
+        if (mpi_rank == global_coordinator)
+            rc = pthread_create(&scan_thread, NULL, phase1_global_coordinator, &scan);
+        else if (p1_feeder)
+            phase1_feeder(operation, store_dir, deletable, ntargets);
+        else if (p1_eater)
+            rc = pthread_create(&scan_thread, NULL, phase1_eater, &store);
+        if (rc)
+            errx(1, "Thread create failed (rc = %d)", rc);
+
+        if (p1_feeder && !daemon_mode) {
+            MPI_Finalize();
+            return 0;
+        }
+
+        /*
+         * Only a complete scan lists the chunks in scan order, so that is the
+         * only time phase 2 can take batches of files before phase 1 is done.
+         */
+        int pipelined = (strcmp(operation, "complete") == 0);
+        ParityLoad parity_load;
+        memset(&parity_load, 0, sizeof(parity_load));
+        double sort_secs = 0.0;
+        double phase2_secs = 0.0;
+        int last_batch = p1_feeder;
+        time_t batch_start = wave_start;
+        for (int batch = 1; !last_batch; batch++)
         {
-            /*
-             * Collect all file info entries in to a packed array that is ready for
-             * broadcasting.
-             * */
-            for (size_t j = 0; j < nitems; j++)
-            {
-                const char *s = names[received_entries[j].idx];
-                size_t s_len = strlen(s);
-                FileInfo prev_fi;
-                FatFileInfo new_fi = file_info[received_entries[j].idx];
-                FileInfo *fi = worklist_info + j;
-                fi->timestamp = new_fi.timestamp;
-                fi->locations = WITH_P(new_fi.modified, NO_P);
-                int has_an_old_version = pdb_get(pdb, s, s_len, &prev_fi);
-                if (has_an_old_version)
-                    fill_in_missing_fields(fi, &prev_fi);
-                fi->locations &= ~new_fi.deleted;
-                if (P_IS_INVALID(fi->locations))
-                    select_P(s, fi, (unsigned)ntargets);
-                if (has_an_old_version
-                        && prev_fi.timestamp == fi->timestamp
-                        && prev_fi.locations == fi->locations)
-                {
-                    fi->locations = WITH_P(fi->locations, NO_P);
-                }
-                memcpy(worklist_keys + path_bytes, s, s_len + 1);
-                path_bytes += s_len + 1;
+            last_batch = wait_for_next_batch(comm, &scan, pipelined, batch_start);
+            batch_start = time(NULL);
+            if (last_batch) {
+                pthread_join(scan_thread, NULL);
+                report_memory_use(comm, &store);
             }
-            assert(path_bytes == name_bytes_written);
-        }
-        MPI_Bcast(&nitems,       sizeof(nitems),          MPI_BYTE, i, comm);
-        MPI_Bcast(worklist_info, sizeof(FileInfo)*nitems, MPI_BYTE, i, comm);
-        MPI_Bcast(&path_bytes,   sizeof(path_bytes),      MPI_BYTE, i, comm);
-        MPI_Bcast(worklist_keys, path_bytes,              MPI_BYTE, i, comm);
+            if (mpi_rank == 0 && pipelined)
+                printf("\n==== batch %d%s ====\n", batch, last_batch? " (last)" : "");
+            /* With a memory budget a batch can take more than one round */
+            for (int more = 1; more;)
+            {
+                int have_more = 0;
+                size_t nitems = p1_eater? take_resolved_entries(&store, &have_more) : 0;
 
-        if (nitems == 0)
-            continue;
+                size_t class_start[N_SIZE_CLASSES + 1];
+                PROF_START(sort_by_size);
+                sort_by_size(comm, store.batch, nitems, class_start);
+                PROF_END(sort_by_size);
 
-        uint64_t events_per_st[MAX_TARGETS] = {0};
-        uint64_t events_processed = 0;
+                PROF_START(phase2);
+                phase2(comm, pdb, &hs, store.batch, nitems, class_start, &wl, &pool, &parity_load, ntargets);
+                PROF_END(phase2);
 
-        if (mpi_rank == 0) {
-            printf("\n==== begin iteration ====\n");
-            printf("st - total files   | data read     | data written  | disk I/O\n");
-            pr_receive_loop(mpi_bcast_size-1);
-            MPI_Gather(
-                    &events_processed, sizeof(events_processed), MPI_BYTE,
-                    events_per_st, sizeof(events_processed), MPI_BYTE,
-                    0,
-                    comm);
-            for (int j = 0; j < ntargets; j++)
-                events_processed += events_per_st[j];
-            printf("==== end iteration (calculated parity for %zu files) ====\n", events_processed);
-            MPI_Barrier(comm);
-            continue;
+                sort_secs += PROF_VAL(sort_by_size);
+                phase2_secs += PROF_VAL(phase2);
+                MPI_Allreduce(&have_more, &more, 1, MPI_INT, MPI_MAX, comm);
+            }
         }
 
-#define N_LANES 12
-        int *lanes = malloc(nitems*sizeof(int));
-        assign_lanes(N_LANES, nitems, worklist_info, lanes);
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-        pthread_t threads[N_LANES];
-        ProgressSample old_samples[N_LANES];
-        ProgressSample cur_samples[N_LANES];
-        memset(old_samples, 0, sizeof(old_samples));
-        memset(cur_samples, 0, sizeof(cur_samples));
-        int *threads_working = calloc(1,sizeof(int));
-        *threads_working = N_LANES;
-        pthread_mutex_t finish_lock = PTHREAD_MUTEX_INITIALIZER;
-        ListParams param0 = {&hs,pdb,worklist_keys,worklist_info,lanes,nitems,NULL,threads_working,&finish_lock,0,N_LANES};
-        ListParams params[N_LANES];
-        for (int j = 0; j < N_LANES; j++) {
-            params[j] = param0;
-            params[j].sample = &cur_samples[j];
-            params[j].lane = j;
-            int rc = pthread_create(&threads[j], &attr, process_list, &params[j]);
-            if (rc)
-                errx(1, "Thread create failed (rc = %d)", rc);
-        }
-        pthread_attr_destroy(&attr);
-        for (;;)
+        /* Every eater compacts the containers from before this run that
+         * are mostly garbage now */
+        PROF_START(compaction);
+        if (p1_eater && hs.error == 0)
+            containers_compact(&containers, pdb, rank2st[mpi_rank], COMPACTION_BUDGET);
+        if (!p1_feeder)
+            MPI_Barrier(comm);
+        PROF_END(compaction);
+
+        if (!p1_feeder && hs.error != 0)
         {
-            for (int r = 0; r < 100; r++)
-            {
-                pthread_mutex_lock(&finish_lock);
-                if (*threads_working == 0)
-                    goto after_reporting_loop;
-                pthread_mutex_unlock(&finish_lock);
-                usleep(10*1000);
-            }
-            for (int j = 0; j < N_LANES; j++) {
-                size_t nf = cur_samples[j].nfiles;
-                double ndt = cur_samples[j].dt;
-                size_t nbw = cur_samples[j].bytes_written;
-                size_t nbr = cur_samples[j].bytes_read;
-                pr_sample.nfiles += nf - old_samples[j].nfiles;
-                pr_sample.dt = 1.0;//ndt - old_samples[j].dt;
-                pr_sample.bytes_written += nbw - old_samples[j].bytes_written;
-                pr_sample.bytes_read += nbr - old_samples[j].bytes_read;
-                old_samples[j].nfiles = nf;
-                old_samples[j].dt = ndt;
-                old_samples[j].bytes_written = nbw;
-                old_samples[j].bytes_read = nbr;
-            }
-            pr_add_tmp_to_total(&pr_sample);
-            pr_report_progress(&pr_sender, pr_sample);
-            pr_clear_tmp(&pr_sample);
+            fprintf(hs.log, "started using zero/null after '%s' gave error %d (%s) on st %d\n",
+                    hs.error_path,
+                    hs.error,
+                    strerror(hs.error),
+                    rank2st[mpi_rank]);
+            fflush(hs.log);
         }
-after_reporting_loop:
-        pthread_mutex_unlock(&finish_lock);
-        for (int j = 0; j < N_LANES; j++) {
-            void *status;
-            int rc = pthread_join(threads[j], &status);
-            if (rc)
-                errx(1, "Thread join error (rc = %d) on thread %d", rc, j);
-            pr_sample.nfiles += cur_samples[j].nfiles - old_samples[j].nfiles;
-            pr_sample.dt += cur_samples[j].dt - old_samples[j].dt;
-            pr_sample.bytes_written += cur_samples[j].bytes_written - old_samples[j].bytes_written;
-            pr_sample.bytes_read += cur_samples[j].bytes_read - old_samples[j].bytes_read;
+
+        if (mpi_rank == 0) {
+            if (daemon_mode)
+                printf("Wave %d timings: \n", wave);
+            else
+                printf("Overall timings: \n");
+            printf("init         | %9.2f ms\n", 1e3*PROF_VAL(init));
+            printf("phase1       | %9.2f ms\n", 1e3*scan.seconds);
+            printf("sort_by_size | %9.2f ms\n", 1e3*sort_secs);
+            printf("load_db      | %9.2f ms\n", 1e3*PROF_VAL(load_db));
+            printf("phase2       | %9.2f ms\n", 1e3*phase2_secs);
+            printf("compaction   | %9.2f ms\n", 1e3*PROF_VAL(compaction));
+            report_parity_load(&parity_load, ntargets);
+            fflush(stdout);
         }
-        pr_add_tmp_to_total(&pr_sample);
-        pr_report_progress(&pr_sender, pr_sample);
-        pr_clear_tmp(&pr_sample);
-        pr_report_done(&pr_sender);
 
-        events_processed = pr_sample.total_nfiles;
-        MPI_Gather(
-                &events_processed, sizeof(events_processed), MPI_BYTE,
-                events_per_st, sizeof(events_processed), MPI_BYTE,
-                0,
-                comm);
+        if (!daemon_mode)
+            break;
+
+        if (!p1_feeder)
+            event_store_clear(&store);
+        if (end_of_wave(!p1_feeder && hs.error != 0)) {
+            /* Keep the changelogs and timestamp, the next run will redo it */
+            if (mpi_rank == 0)
+                warnx("Stopping after errors in wave %d, see errors.log on the storage targets", wave);
+            exit_code = 1;
+            break;
+        }
+        if (p1_feeder)
+            cleanup_changelogs(deletable);
+        if (mpi_rank == 0 && timestamp_file != NULL)
+            save_timestamp(timestamp_file, wave_start);
+        if (!wait_for_next_wave(wave_start, wave_interval, stop_file))
+            break;
+    }
 
+    PROF_START(snapshot);
+    if (pdb != NULL)
+        pdb_write_snapshot(pdb, snapshot_path);
+    if (!p1_feeder)
         MPI_Barrier(comm);
+    PROF_END(snapshot);
+
+    if (!p1_feeder) {
+        fclose(hs.log);
+        if (pdb != NULL)
+            pdb_term(pdb);
+        pdb = NULL;
+        event_store_term(&store);
+        worklist_term(&wl);
     }
-
-    if (hs.error != 0)
-    {
-        fprintf(hs.log, "started using zero/null after '%s' gave error %d (%s) on st %d\n",
-                hs.error_path,
-                hs.error,
-                strerror(hs.error),
-                rank2st[mpi_rank]);
+    if (p1_eater) {
+        lane_pool_term(&pool);
+        if (hs.parity_writer != NULL)
+            parity_writer_stop(hs.parity_writer);
+        containers_close(&containers);
     }
 
-    fclose(hs.log);
-    pdb_term(pdb);
-    pdb = NULL;
-    free(flat_file_names);
-    free(worklist_info);
-    free(worklist_keys);
-
-    PROF_END(phase2);
     PROF_END(total);
 
     if (mpi_rank == 0) {
-        printf("Overall timings: \n");
-        printf("init         | %9.2f ms\n", 1e3*PROF_VAL(init));
-        printf("phase1       | %9.2f ms\n", 1e3*PROF_VAL(phase1));
-        printf("sort_by_size | %9.2f ms\n", 1e3*PROF_VAL(sort_by_size));
-        printf("load_db      | %9.2f ms\n", 1e3*PROF_VAL(load_db));
-        printf("phase2       | %9.2f ms\n", 1e3*PROF_VAL(phase2));
+        printf("snapshot     | %9.2f ms\n", 1e3*PROF_VAL(snapshot));
         printf("total        | %9.2f ms\n", 1e3*PROF_VAL(total));
     }
 
     MPI_Finalize();
-    return 0;
+    return exit_code;
 }
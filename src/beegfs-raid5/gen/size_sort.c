@@ -0,0 +1,153 @@
+#include "size_sort.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#define RADIX 256
+/* 4 bytes of the tie breaker and 8 of the size, least significant first */
+#define NPASSES 12
+#define MIN_KEYS_PER_THREAD (64*1024)
+
+/*
+ * Every thread takes a fixed slice of the keys. In each pass the threads count
+ * the digits in their slice, thread 0 turns the counts in to offsets ordered
+ * by (digit, thread), and then everyone moves their keys. Slices are in
+ * order, so the sort is stable. A pass where every key has the same digit
+ * doesn't move anything and is skipped - with sizes that is most of them.
+ */
+typedef struct {
+    SizeKey *a;
+    SizeKey *b;
+    size_t n;
+    int nthreads;
+    size_t (*hist)[RADIX];
+    pthread_barrier_t barrier;
+    int skip;
+    SizeKey *result;
+} RadixJob;
+
+typedef struct {
+    RadixJob *job;
+    int id;
+} RadixThread;
+
+static inline
+unsigned digit(const SizeKey *k, int pass)
+{
+    if (pass < 4)
+        return (k->tie >> (8*pass)) & 0xFF;
+    return (k->size >> (8*(pass - 4))) & 0xFF;
+}
+
+static
+void *radix_worker(void *p)
+{
+    RadixThread *me = (RadixThread *)p;
+    RadixJob *job = me->job;
+    size_t lo = job->n*me->id/job->nthreads;
+    size_t hi = job->n*(me->id + 1)/job->nthreads;
+    size_t *h = job->hist[me->id];
+    SizeKey *src = job->a;
+    SizeKey *dst = job->b;
+    for (int pass = 0; pass < NPASSES; pass++)
+    {
+        memset(h, 0, RADIX*sizeof(size_t));
+        for (size_t i = lo; i < hi; i++)
+            h[digit(&src[i], pass)] += 1;
+        pthread_barrier_wait(&job->barrier);
+        if (me->id == 0) {
+            job->skip = 0;
+            for (int d = 0; d < RADIX && !job->skip; d++) {
+                size_t total = 0;
+                for (int t = 0; t < job->nthreads; t++)
+                    total += job->hist[t][d];
+                job->skip = (total == job->n);
+            }
+            size_t offset = 0;
+            for (int d = 0; d < RADIX && !job->skip; d++) {
+                for (int t = 0; t < job->nthreads; t++) {
+                    size_t count = job->hist[t][d];
+                    job->hist[t][d] = offset;
+                    offset += count;
+                }
+            }
+        }
+        pthread_barrier_wait(&job->barrier);
+        if (job->skip)
+            continue;
+        for (size_t i = lo; i < hi; i++)
+            dst[h[digit(&src[i], pass)]++] = src[i];
+        pthread_barrier_wait(&job->barrier);
+        SizeKey *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (me->id == 0)
+        job->result = src;
+    return NULL;
+}
+
+void sort_size_keys(SizeKey *keys, size_t n, int max_threads)
+{
+    if (n < 2)
+        return;
+    RadixJob job;
+    job.a = keys;
+    job.b = malloc(n*sizeof(SizeKey));
+    job.n = n;
+    job.nthreads = (int)((size_t)max_threads < n/MIN_KEYS_PER_THREAD? (size_t)max_threads : n/MIN_KEYS_PER_THREAD);
+    if (job.nthreads < 1)
+        job.nthreads = 1;
+    job.hist = malloc(job.nthreads*sizeof(*job.hist));
+    RadixThread *args = malloc(job.nthreads*sizeof(RadixThread));
+    pthread_t *threads = malloc(job.nthreads*sizeof(pthread_t));
+    if (job.b == NULL || job.hist == NULL || args == NULL || threads == NULL)
+        err(1, "Out of memory for sorting");
+    pthread_barrier_init(&job.barrier, NULL, job.nthreads);
+
+    for (int t = 0; t < job.nthreads; t++) {
+        args[t].job = &job;
+        args[t].id = t;
+    }
+    for (int t = 1; t < job.nthreads; t++) {
+        int rc = pthread_create(&threads[t], NULL, radix_worker, &args[t]);
+        if (rc)
+            errx(1, "Thread create failed (rc = %d)", rc);
+    }
+    radix_worker(&args[0]);
+    for (int t = 1; t < job.nthreads; t++)
+        pthread_join(threads[t], NULL);
+
+    if (job.result != keys)
+        memcpy(keys, job.result, n*sizeof(SizeKey));
+    pthread_barrier_destroy(&job.barrier);
+    free(threads);
+    free(args);
+    free(job.hist);
+    free(job.b);
+}
+
+/* The first sorted key with a size of at least `size` */
+static
+size_t lower_bound(const SizeKey *keys, size_t n, uint64_t size)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (keys[mid].size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void find_size_classes(const SizeKey *keys, size_t n, size_t start[N_SIZE_CLASSES + 1])
+{
+    start[SIZE_TINY] = 0;
+    start[SIZE_MEDIUM] = lower_bound(keys, n, SIZE_CLASS_MEDIUM_MIN);
+    start[SIZE_HUGE] = lower_bound(keys, n, SIZE_CLASS_HUGE_MIN);
+    start[N_SIZE_CLASSES] = n;
+}
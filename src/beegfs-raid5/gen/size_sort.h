@@ -0,0 +1,33 @@
+#ifndef __SIZE_SORT__
+#define __SIZE_SORT__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sort key for the phase 1 entries: ordered by size, ties broken by `tie`
+ * (a hash of the path) so files of the same size are spread out the same way
+ * on every run. `index` is where the entry was before sorting.
+ */
+typedef struct {
+    uint64_t size;
+    uint32_t tie;
+    uint32_t index;
+} SizeKey;
+
+/*
+ * Size classes of files by the bytes phase 1 saw for them: tiny files are
+ * mostly the fixed cost of a task, huge files take long enough that the
+ * scheduler should get them going first.
+ */
+enum { SIZE_TINY, SIZE_MEDIUM, SIZE_HUGE, N_SIZE_CLASSES };
+#define SIZE_CLASS_MEDIUM_MIN (64*1024ULL)
+#define SIZE_CLASS_HUGE_MIN (1024*1024*1024ULL)
+
+/* LSD radix sort on (size, tie) with up to `max_threads` threads */
+void sort_size_keys(SizeKey *keys, size_t n, int max_threads);
+
+/* Class `c` is entries [start[c], start[c+1]) of the sorted keys */
+void find_size_classes(const SizeKey *keys, size_t n, size_t start[N_SIZE_CLASSES + 1]);
+
+#endif
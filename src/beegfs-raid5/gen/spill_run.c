@@ -0,0 +1,83 @@
+#include "spill_run.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define RUN_IO_BUFFER_SIZE (256*1024)
+
+/* On disk every entry is a record followed by the name, without a '\0' */
+typedef struct {
+    uint64_t size;
+    FatFileInfo info;
+    uint64_t name_len;
+} RunRecord;
+
+void spill_run_create(SpillRun *run, const char *dir)
+{
+    memset(run, 0, sizeof(SpillRun));
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/phase1-run.XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd == -1)
+        err(1, "Couldn't create spill file in '%s'", dir);
+    unlink(path);
+    run->f = fdopen(fd, "w+");
+    if (run->f == NULL)
+        err(1, "fdopen on spill file");
+    run->buffer = malloc(RUN_IO_BUFFER_SIZE);
+    if (run->buffer == NULL)
+        err(1, "Out of memory for spill buffer");
+    setvbuf(run->f, run->buffer, _IOFBF, RUN_IO_BUFFER_SIZE);
+}
+
+void spill_run_append(SpillRun *run, const char *name, size_t name_len, uint64_t size, const FatFileInfo *info)
+{
+    RunRecord r = {size, *info, name_len};
+    if (fwrite(&r, sizeof(r), 1, run->f) != 1
+            || fwrite(name, 1, name_len, run->f) != name_len)
+        err(1, "Couldn't write to spill file");
+    run->nentries += 1;
+    run->bytes += sizeof(r) + name_len;
+}
+
+/* Done appending, the first entry becomes the head */
+void spill_run_rewind(SpillRun *run)
+{
+    if (fflush(run->f) != 0 || fseek(run->f, 0, SEEK_SET) != 0)
+        err(1, "Couldn't flush spill file");
+    spill_run_next(run);
+}
+
+void spill_run_next(SpillRun *run)
+{
+    RunRecord r;
+    run->has_head = (fread(&r, sizeof(r), 1, run->f) == 1);
+    if (!run->has_head) {
+        if (ferror(run->f))
+            err(1, "Couldn't read spill file");
+        return;
+    }
+    if (r.name_len + 1 > run->name_capacity) {
+        run->name_capacity = MAX(2*run->name_capacity, r.name_len + 1);
+        run->name = realloc(run->name, run->name_capacity);
+        if (run->name == NULL)
+            err(1, "Out of memory for spill file names");
+    }
+    if (fread(run->name, 1, r.name_len, run->f) != r.name_len)
+        errx(1, "Truncated spill file");
+    run->name[r.name_len] = '\0';
+    run->name_len = r.name_len;
+    run->size = r.size;
+    run->info = r.info;
+}
+
+void spill_run_close(SpillRun *run)
+{
+    fclose(run->f);
+    free(run->buffer);
+    free(run->name);
+    memset(run, 0, sizeof(SpillRun));
+}
@@ -0,0 +1,38 @@
+#ifndef __SPILL_RUN__
+#define __SPILL_RUN__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_info_hash.h"
+
+/*
+ * A run of phase 1 entries spilled to local disk. The entries are appended in
+ * sorted order, then read back one at a time with the current one ("head")
+ * kept in the struct.
+ *
+ * The file is unlinked as soon as it is created, so the space is given back
+ * when the run is closed - or when the process dies.
+ */
+typedef struct {
+    FILE *f;
+    char *buffer;
+    uint64_t nentries;
+    uint64_t bytes;
+
+    int has_head;
+    uint64_t size;
+    FatFileInfo info;
+    char *name;
+    size_t name_len;
+    size_t name_capacity;
+} SpillRun;
+
+void spill_run_create(SpillRun *run, const char *dir);
+void spill_run_append(SpillRun *run, const char *name, size_t name_len, uint64_t size, const FatFileInfo *info);
+void spill_run_rewind(SpillRun *run);
+void spill_run_next(SpillRun *run);
+void spill_run_close(SpillRun *run);
+
+#endif
@@ -0,0 +1,49 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <err.h>
+
+#include "task_scheduler.h"
+
+/*
+ * A lane is a thread on every rank, and a task on lane `l` can't start before
+ * lane `l` is done with the earlier tasks on every target the task involves.
+ * We keep an estimate of when that is for every lane and target, and put
+ * each task on the lane where it can start the earliest - tasks on disjoint
+ * sets of targets end up running side by side, and a big file only holds up
+ * the lane on the targets it is actually on.
+ *
+ * The jobs keep their order; ties go to the first lane counting from
+ * `i % nlanes`, so the result only depends on the input.
+ */
+void schedule_tasks(int nlanes, u64 njobs, const u64 *targets, const u64 *cost, int *lane)
+{
+    u64 *free_at = calloc((size_t)nlanes*MAX_STORAGE_TARGETS, sizeof(u64));
+    if (free_at == NULL)
+        err(1, "Out of memory for task scheduling");
+
+    for (u64 i = 0; i < njobs; i++)
+    {
+        int best_idx = i % nlanes;
+        u64 best_start = UINT64_MAX;
+        for (int j0 = 0; j0 < nlanes; j0++)
+        {
+            int j = (i + j0) % nlanes;
+            const u64 *lane_free_at = free_at + j*MAX_STORAGE_TARGETS;
+            u64 start = 0;
+            for (u64 t = targets[i]; t != 0; t &= t - 1) {
+                u64 at = lane_free_at[__builtin_ctzll(t)];
+                if (at > start)
+                    start = at;
+            }
+            if (start < best_start) {
+                best_start = start;
+                best_idx = j;
+            }
+        }
+        lane[i] = best_idx;
+        u64 *lane_free_at = free_at + best_idx*MAX_STORAGE_TARGETS;
+        for (u64 t = targets[i]; t != 0; t &= t - 1)
+            lane_free_at[__builtin_ctzll(t)] = best_start + cost[i];
+    }
+    free(free_at);
+}
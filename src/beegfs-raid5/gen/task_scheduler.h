@@ -0,0 +1,19 @@
+#ifndef __TASK_SCHEDULER__
+#define __TASK_SCHEDULER__
+
+#include "../common/common.h"
+
+typedef unsigned long long u64;
+
+/*
+ * Estimated cost of a task, in bytes of chunk data: the targets move their
+ * chunks at the same time, so it is about the bytes of one chunk plus a
+ * fixed cost for opening, seeking and syncing files.
+ */
+#define TASK_FIXED_COST (64*1024)
+#define TASK_COST(chunk_bytes) (TASK_FIXED_COST + (chunk_bytes))
+
+/* `targets` has a bit set for every storage target a job involves */
+void schedule_tasks(int nlanes, u64 njobs, const u64 *targets, const u64 *cost, int *lane);
+
+#endif
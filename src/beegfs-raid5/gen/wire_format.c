@@ -0,0 +1,86 @@
+#include "wire_format.h"
+
+#include <string.h>
+#include <err.h>
+
+void wire_reset(WireState *s)
+{
+    s->path_len = 0;
+    s->timestamp = 0;
+}
+
+/* LEB128: 7 bits at a time, lowest first, the high bit set on all but the last */
+uint8_t *wire_put_varint(uint8_t *dst, uint64_t v)
+{
+    while (v >= 0x80) {
+        *dst++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *dst++ = (uint8_t)v;
+    return dst;
+}
+
+const uint8_t *wire_get_varint(const uint8_t *src, const uint8_t *end, uint64_t *v)
+{
+    uint64_t res = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (src == end)
+            errx(1, "Truncated varint in message");
+        uint8_t b = *src++;
+        res |= (uint64_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            *v = res;
+            return src;
+        }
+    }
+    errx(1, "Malformed varint in message");
+}
+
+uint8_t *wire_put_path(WireState *s, uint8_t *dst, const char *path, size_t path_len)
+{
+    if (path_len >= WIRE_MAX_PATH)
+        errx(1, "Path too long: '%.*s'", (int)path_len, path);
+    size_t shared = 0;
+    size_t max_shared = (path_len < s->path_len)? path_len : s->path_len;
+    while (shared < max_shared && s->path[shared] == path[shared])
+        shared++;
+    dst = wire_put_varint(dst, shared);
+    dst = wire_put_varint(dst, path_len - shared);
+    memcpy(dst, path + shared, path_len - shared);
+    memcpy(s->path + shared, path + shared, path_len - shared);
+    s->path_len = path_len;
+    return dst + (path_len - shared);
+}
+
+const uint8_t *wire_get_path(WireState *s, const uint8_t *src, const uint8_t *end)
+{
+    uint64_t shared, rest;
+    src = wire_get_varint(src, end, &shared);
+    src = wire_get_varint(src, end, &rest);
+    if (shared > s->path_len
+            || rest > (uint64_t)(end - src)
+            || shared + rest >= WIRE_MAX_PATH)
+        errx(1, "Malformed path in message");
+    memcpy(s->path + shared, src, rest);
+    s->path_len = shared + rest;
+    s->path[s->path_len] = '\0';
+    return src + rest;
+}
+
+/* Zigzag, so small negative differences are small too */
+uint8_t *wire_put_timestamp(WireState *s, uint8_t *dst, int64_t timestamp)
+{
+    uint64_t d = (uint64_t)timestamp - (uint64_t)s->timestamp;
+    s->timestamp = timestamp;
+    return wire_put_varint(dst, (d << 1) ^ (uint64_t)((int64_t)d >> 63));
+}
+
+const uint8_t *wire_get_timestamp(WireState *s, const uint8_t *src, const uint8_t *end, int64_t *timestamp)
+{
+    uint64_t z;
+    src = wire_get_varint(src, end, &z);
+    uint64_t d = (z >> 1) ^ -(z & 1);
+    s->timestamp = (int64_t)((uint64_t)s->timestamp + d);
+    *timestamp = s->timestamp;
+    return src;
+}
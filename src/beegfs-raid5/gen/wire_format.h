@@ -0,0 +1,38 @@
+#ifndef __WIRE_FORMAT__
+#define __WIRE_FORMAT__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The phase 1 events and phase 2 worklists are sent as streams of records
+ * with variable length integers, where each path is front coded against the
+ * path before it in the same stream: the number of bytes it shares with it,
+ * then the rest of the path. Timestamps are sent as the difference to the
+ * previous one.
+ *
+ * Both sides keep a WireState per stream, and reset it at the start of every
+ * message so each message can be decoded on its own.
+ */
+#define WIRE_MAX_PATH 4096
+/* Upper bound on the encoding of a path and four integers */
+#define WIRE_MAX_RECORD(path_len) ((path_len) + 6*10)
+
+typedef struct {
+    char path[WIRE_MAX_PATH];
+    size_t path_len;
+    int64_t timestamp;
+} WireState;
+
+void wire_reset(WireState *s);
+
+uint8_t *wire_put_varint(uint8_t *dst, uint64_t v);
+uint8_t *wire_put_path(WireState *s, uint8_t *dst, const char *path, size_t path_len);
+uint8_t *wire_put_timestamp(WireState *s, uint8_t *dst, int64_t timestamp);
+
+/* The getters abort on a malformed stream, the path ends up in s->path */
+const uint8_t *wire_get_varint(const uint8_t *src, const uint8_t *end, uint64_t *v);
+const uint8_t *wire_get_path(WireState *s, const uint8_t *src, const uint8_t *end);
+const uint8_t *wire_get_timestamp(WireState *s, const uint8_t *src, const uint8_t *end, int64_t *timestamp);
+
+#endif
@@ -0,0 +1,65 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../common/common.h"
+#include "../common/persistent_db.h"
+
+/*
+ * Brings a database up to DB_VERSION in place, so it doesn't have to happen
+ * at the start of the next parity run. Only databases with the plain text keys
+ * of DB_VERSION_TEXT_KEYS or later can be converted here - a replicated
+ * database has to be trimmed to its shard by bp-parity-gen, which knows the
+ * targets.
+ */
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fputs("usage: bp-db-migrate <db folder>\n", stdout);
+        return 1;
+    }
+    const char *db_folder = argv[1];
+
+    /* Don't let leveldb create a new database if the path is wrong */
+    struct stat st;
+    if (stat(db_folder, &st) != 0 || !S_ISDIR(st.st_mode))
+        errx(1, "No database in '%s'", db_folder);
+
+    PersistentDB *pdb = pdb_init(db_folder, DB_VERSION, DB_VERSION_REPLICATED);
+    if (pdb == NULL)
+        errx(1, "Can't open the database in '%s'", db_folder);
+    uint64_t version = pdb_version(pdb);
+    if (version == DB_VERSION_REPLICATED)
+        errx(1, "The database has every target's records, run bp-parity-gen to trim it first");
+    if (version == DB_VERSION) {
+        printf("Already at version %d\n", DB_VERSION);
+        pdb_term(pdb);
+        return 0;
+    }
+
+    /* Packed keys are all it takes, the parity containers, inline parity and
+     * stripes start out empty */
+    if (version >= DB_VERSION_NO_CONTAINERS) {
+        pdb_set_version(pdb, DB_VERSION);
+        pdb_term(pdb);
+        printf("Converted from version %lu to %d\n", version, DB_VERSION);
+        return 0;
+    }
+
+    pdb_convert_keys(pdb, DB_VERSION);
+    pdb_term(pdb);
+
+    /* The snapshot has the old keys, the next parity run writes a new one */
+    char snapshot_path[1024];
+    pdb_snapshot_path(db_folder, snapshot_path, sizeof(snapshot_path));
+    if (unlink(snapshot_path) != 0 && errno != ENOENT)
+        err(1, "Can't remove the old snapshot '%s'", snapshot_path);
+
+    printf("Converted from version %lu to %d\n", version, DB_VERSION);
+    return 0;
+}
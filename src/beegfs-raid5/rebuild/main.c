@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <mpi.h>
 
@@ -16,6 +17,11 @@
 #include "../common/progress_reporting.h"
 #include "../common/task_processing.h"
 #include "../common/persistent_db.h"
+#include "../common/parity_container.h"
+#include "../common/stripe.h"
+
+/* Number of threads scanning the database, each takes a range of the keys */
+#define N_LANES 12
 
 #define PROF_START(name) \
     struct timespec t_##name##_0; \
@@ -33,16 +39,61 @@ static int mpi_world_size;
 int st2rank[MAX_STORAGE_TARGETS];
 int rank2st[MAX_STORAGE_TARGETS+1];
 
+/* The lanes add their progress to pr_sample, and whoever is first after a
+ * second has passed sends it */
+static pthread_mutex_t pr_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec pr_last_report;
 static ProgressSender pr_sender;
 static ProgressSample pr_sample = PROGRESS_SAMPLE_INIT;
 static HostState hs;
 
-int do_file(const char *key, size_t keylen, const FileInfo *fi)
+typedef struct {
+    int lane;
+    ProgressSample sample;
+    const PersistentDB *pdb;
+    ParityContainer container;
+    uint8_t inline_parity[INLINE_PARITY_MAX];
+    uint8_t stripe_list[STRIPE_LIST_MAX];
+} Lane;
+
+static
+double seconds_since(const struct timespec *t)
 {
-    (void) keylen;
-    struct timespec tv1;
-    clock_gettime(CLOCK_MONOTONIC, &tv1);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1.0
+        + (now.tv_nsec - t->tv_nsec) * 1e-9;
+}
+
+static
+void report_progress(ProgressSample *lane_sample, int force)
+{
+    pthread_mutex_lock(&pr_lock);
+    pr_sample.nfiles += lane_sample->nfiles;
+    pr_sample.bytes_read += lane_sample->bytes_read;
+    pr_sample.bytes_written += lane_sample->bytes_written;
+    pr_clear_tmp(lane_sample);
+    double dt = seconds_since(&pr_last_report);
+    if (force || dt >= 1.0) {
+        pr_sample.dt = dt;
+        pr_add_tmp_to_total(&pr_sample);
+        pr_report_progress(&pr_sender, pr_sample);
+        pr_clear_tmp(&pr_sample);
+        clock_gettime(CLOCK_MONOTONIC, &pr_last_report);
+    }
+    pthread_mutex_unlock(&pr_lock);
+}
 
+/*
+ * Every rank splits its scan at the same keys, so a file is on the same lane
+ * everywhere and the lanes see their files in the same order. The lane is
+ * the tag of the file's messages.
+ */
+static
+int do_file(void *arg, const char *key, size_t keylen, const FileInfo *fi)
+{
+    (void) keylen;
+    Lane *lane = arg;
     int my_st = rank2st[mpi_rank];
     int P = GET_P(fi->locations);
     if (P == NO_P
@@ -50,6 +101,7 @@ int do_file(const char *key, size_t keylen, const FileInfo *fi)
             || TEST_BIT(fi->locations, rebuild_target) == 0)
         return 0;
 
+    /* Every lane sets the same value */
     hs.storage_target = my_st;
 
     FileInfo mod_fi = *fi;
@@ -58,9 +110,25 @@ int do_file(const char *key, size_t keylen, const FileInfo *fi)
         mod_fi.locations &= ~(1 << rebuild_target);
         mod_fi.locations = WITH_P(mod_fi.locations, (uint64_t)rebuild_target);
     }
-    /* The rank that holds the P block reads from parity and not chunks */
+    /* The rank that holds the P block reads from parity and not chunks, and
+     * the parity of a small file can be in a container or the database */
     int rdir = (P == my_st)? hs.read_parity_dir : hs.read_chunk_dir;
-    TaskInfo ti = { rdir, 1, P, 0, &pr_sample };
+    ParityLocation stored_at;
+    int in_container = (P == my_st)
+        && pdb_get_parity(lane->pdb, key, keylen, &stored_at, lane->inline_parity);
+    /* The chunks of a stripe are its members */
+    const char *chunk_paths[MAX_STORAGE_TARGETS];
+    int is_stripe = is_stripe_name(key, keylen);
+    if (is_stripe) {
+        StripeMembers members;
+        size_t list_len = pdb_get_stripe(lane->pdb, key, keylen, lane->stripe_list, STRIPE_LIST_MAX);
+        if (list_len == 0 || !stripe_decode(lane->stripe_list, list_len, &members))
+            errx(1, "No members for stripe '%s'", key);
+        stripe_chunk_paths(&members, chunk_paths);
+    }
+    TaskInfo ti = { rdir, 1, P, lane->lane, &lane->sample, 0, 0,
+        &lane->container, in_container? &stored_at : NULL, lane->inline_parity,
+        is_stripe? chunk_paths : NULL, NULL };
     int report = process_task(&hs, key, &mod_fi, ti);
 #if 0
 #define FIRST_8_BITS(x)     ((x) & 0x80 ? 1 : 0), ((x) & 0x40 ? 1 : 0), \
@@ -72,31 +140,147 @@ int do_file(const char *key, size_t keylen, const FileInfo *fi)
     printf("process_task(%d, '%s', %d%d%d%d%d%d%d%d, op=%d, np=%d, '%s', '%s')\n", my_st, key, FIRST_8_BITS(locs), P, cP, load_pat, save_pat);
 #endif
 
-    struct timespec tv2;
-    clock_gettime(CLOCK_MONOTONIC, &tv2);
-    double dt = (tv2.tv_sec - tv1.tv_sec) * 1.0
-        + (tv2.tv_nsec - tv1.tv_nsec) * 1e-9;
-    if (report) {
-        pr_sample.dt += dt;
-        pr_sample.nfiles += 1;
-    }
-    if (pr_sample.dt >= 1.0) {
-        pr_add_tmp_to_total(&pr_sample);
-        pr_report_progress(&pr_sender, pr_sample);
-        pr_clear_tmp(&pr_sample);
-    }
+    if (report)
+        lane->sample.nfiles += 1;
+    report_progress(&lane->sample, 0);
     return 0;
 }
 
+/*
+ * The database is sharded, so the rebuilt target starts out with an empty
+ * one. The survivors send it the records of its shard, each record from the
+ * lowest numbered survivor that holds it, in messages of up to
+ * SHARD_MESSAGE_SIZE bytes. An empty message means the sender is done.
+ *
+ * A record is its FileInfo, the length of the name as a uint32_t and then
+ * the name. After that comes the length of the stripe extra as a uint32_t
+ * and the extra, which is the member list of a stripe or the stripe of a
+ * member, see stripe.h - for other records it is empty.
+ */
+#define SHARD_MESSAGE_SIZE (4*1024*1024)
+/* After the tags of the lanes */
+#define SHARD_TAG N_LANES
+
+static int shard_nowners;
+static const PersistentDB *shard_pdb;
+static uint8_t *shard_buffer;
+static size_t shard_fill;
+static uint8_t *shard_extra;
+
+static
+void send_shard_buffer(void)
+{
+    MPI_Send(shard_buffer, shard_fill, MPI_BYTE,
+            st2rank[rebuild_target], SHARD_TAG, MPI_COMM_WORLD);
+    shard_fill = 0;
+}
+
+static
+int send_shard_record(const char *key, size_t keylen, const FileInfo *fi)
+{
+    uint64_t holders = db_holders(key, keylen, fi->locations, shard_nowners);
+    if (!TEST_BIT(holders, rebuild_target))
+        return 0;
+    holders &= ~(1ULL << rebuild_target);
+    if (holders == 0 || __builtin_ctzll(holders) != rank2st[mpi_rank])
+        return 0;
+    uint32_t len = keylen;
+    uint32_t extra_len = 0;
+    if (is_stripe_name(key, keylen))
+        extra_len = pdb_get_stripe(shard_pdb, key, keylen, shard_extra, STRIPE_LIST_MAX);
+    else if (IS_STRIPE_MEMBER(fi->locations))
+        extra_len = pdb_get_stripe_of(shard_pdb, key, keylen, (char *)shard_extra);
+    size_t record_len = sizeof(FileInfo) + sizeof(len) + len + sizeof(extra_len) + extra_len;
+    if (shard_fill + record_len > SHARD_MESSAGE_SIZE)
+        send_shard_buffer();
+    uint8_t *dst = shard_buffer + shard_fill;
+    memcpy(dst, fi, sizeof(FileInfo));
+    memcpy(dst + sizeof(FileInfo), &len, sizeof(len));
+    memcpy(dst + sizeof(FileInfo) + sizeof(len), key, len);
+    memcpy(dst + sizeof(FileInfo) + sizeof(len) + len, &extra_len, sizeof(extra_len));
+    memcpy(dst + sizeof(FileInfo) + sizeof(len) + len + sizeof(extra_len), shard_extra, extra_len);
+    shard_fill += record_len;
+    return 0;
+}
+
+static
+void send_shard(const PersistentDB *pdb, int nowners)
+{
+    shard_nowners = nowners;
+    shard_pdb = pdb;
+    shard_buffer = malloc(SHARD_MESSAGE_SIZE);
+    shard_extra = malloc(STRIPE_LIST_MAX);
+    if (shard_buffer == NULL || shard_extra == NULL)
+        err(1, "Out of memory for shard buffer");
+    pdb_iterate(pdb, send_shard_record);
+    if (shard_fill != 0)
+        send_shard_buffer();
+    send_shard_buffer();
+    free(shard_extra);
+    free(shard_buffer);
+}
+
+static
+void receive_shard(PersistentDB *pdb, int ntargets)
+{
+    uint8_t *buffer = malloc(SHARD_MESSAGE_SIZE);
+    if (buffer == NULL)
+        err(1, "Out of memory for shard buffer");
+    PdbBatch *batch = pdb_batch_create(pdb);
+    size_t nreceived = 0;
+    for (int senders = ntargets - 1; senders > 0; ) {
+        MPI_Status stat;
+        MPI_Recv(buffer, SHARD_MESSAGE_SIZE, MPI_BYTE,
+                MPI_ANY_SOURCE, SHARD_TAG, MPI_COMM_WORLD, &stat);
+        int size;
+        MPI_Get_count(&stat, MPI_BYTE, &size);
+        if (size == 0) {
+            senders -= 1;
+            continue;
+        }
+        for (size_t pos = 0; pos < (size_t)size; ) {
+            FileInfo fi;
+            uint32_t len, extra_len;
+            if ((size_t)size - pos < sizeof(FileInfo) + sizeof(len))
+                errx(1, "Truncated shard record from rank %d", stat.MPI_SOURCE);
+            memcpy(&fi, buffer + pos, sizeof(FileInfo));
+            memcpy(&len, buffer + pos + sizeof(FileInfo), sizeof(len));
+            pos += sizeof(FileInfo) + sizeof(len);
+            if ((size_t)size - pos < len + sizeof(extra_len))
+                errx(1, "Truncated shard record from rank %d", stat.MPI_SOURCE);
+            const char *key = (const char *)buffer + pos;
+            memcpy(&extra_len, buffer + pos + len, sizeof(extra_len));
+            pos += len + sizeof(extra_len);
+            if ((size_t)size - pos < extra_len)
+                errx(1, "Truncated shard record from rank %d", stat.MPI_SOURCE);
+            pdb_batch_set(batch, key, len, &fi);
+            if (extra_len != 0 && is_stripe_name(key, len))
+                pdb_batch_set_stripe(batch, key, len, buffer + pos, extra_len);
+            else if (extra_len != 0)
+                pdb_batch_set_stripe_of(batch, key, len, (const char *)buffer + pos, extra_len);
+            pos += extra_len;
+            nreceived += 1;
+        }
+    }
+    pdb_batch_destroy(batch);
+    free(buffer);
+    printf("received %zu records for the rebuilt target\n", nreceived);
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 6)
+    if (argc != 6 && argc != 7)
     {
-        fputs("We need 5 arguments\n", stdout);
+        fputs("We need 5 arguments, and the parity folder if it isn't 'parity'\n", stdout);
         return 1;
     }
 
-    MPI_Init(&argc, &argv);
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    if (provided < MPI_THREAD_MULTIPLE) {
+        fputs("Your MPI does not support multithreading!\n", stderr);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
     MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &mpi_world_size);
 
@@ -105,6 +289,10 @@ int main(int argc, char **argv)
     const char *data_file = argv[3];
     const char *corrupt_list_file = argv[4];
     const char *db_folder = argv[5];
+    /* Relative to the store, like when the parity was generated */
+    const char *parity_dir = (argc == 7)? argv[6] : "parity";
+    if (!is_inside_store(parity_dir))
+        errx(1, "The parity folder '%s' has to be inside the store", parity_dir);
 
     int ntargets = mpi_world_size - 1;
     if (ntargets > MAX_STORAGE_TARGETS)
@@ -121,6 +309,8 @@ int main(int argc, char **argv)
     if (mpi_rank == 0) {
         last_run_fd = open(data_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
         read(last_run_fd, &last_run, sizeof(RunData));
+        if (lseek(last_run_fd, 0, SEEK_END) != sizeof(RunData))
+            last_run.nowners = 0;
     }
 
     /* Create mapping from storage targets to ranks, and vice versa */
@@ -182,13 +372,19 @@ int main(int argc, char **argv)
 
         if (rebuild_target == -1)
             errx(1, "rebuild_id not found");
+        /* Every database is on the current version, so a parity run has
+         * set it */
+        if (last_run.nowners == 0)
+            errx(1, "No owners in the data file, do a parity run first");
     }
     MPI_Bcast(&rebuild_target, sizeof(rebuild_target), MPI_BYTE, 0, MPI_COMM_WORLD);
     MPI_Bcast(st2rank, sizeof(st2rank), MPI_BYTE, 0, MPI_COMM_WORLD);
     MPI_Bcast(rank2st, sizeof(rank2st), MPI_BYTE, 0, MPI_COMM_WORLD);
+    int nowners = last_run.nowners;
+    MPI_Bcast(&nowners, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
     if (mpi_rank == 0) {
-        write(last_run_fd, &last_run, sizeof(RunData));
+        pwrite(last_run_fd, &last_run, sizeof(RunData), 0);
         close(last_run_fd);
     }
 
@@ -209,7 +405,7 @@ int main(int argc, char **argv)
     hs.log = fopen(log_file_name, "w");
     hs.write_dir = openat(store_fd, "chunks", O_DIRECTORY | O_RDONLY);
     hs.read_chunk_dir = hs.write_dir;
-    hs.read_parity_dir = openat(store_fd, "parity", O_DIRECTORY | O_RDONLY);
+    hs.read_parity_dir = openat(store_fd, parity_dir, O_DIRECTORY | O_RDONLY);
     close(store_fd);
 
     fprintf(hs.log, "=== start new run ===\n");
@@ -218,14 +414,57 @@ int main(int argc, char **argv)
 
     memset(&pr_sender, 0, sizeof(pr_sender));
 
+    PersistentDB *pdb = NULL;
+    PdbSplit *splits = calloc(N_LANES - 1, sizeof(PdbSplit));
+    if (splits == NULL)
+        err(1, "Out of memory for database splits");
     if (mpi_rank != 0)
     {
-        PersistentDB *pdb = pdb_init(db_folder, DB_VERSION);
-        pdb_iterate(pdb, do_file);
+        /* Scanning the snapshot is much faster, if the last run left one */
+        if (rank2st[mpi_rank] != rebuild_target) {
+            char snapshot_path[1024];
+            pdb_snapshot_path(db_folder, snapshot_path, sizeof(snapshot_path));
+            pdb = pdb_open_snapshot(snapshot_path, DB_VERSION, DB_VERSION_NO_CONTAINERS);
+        }
+        /* Everyone must scan their records in the same order, so every
+         * database must have packed keys */
+        if (pdb == NULL)
+            pdb = pdb_init(db_folder, DB_VERSION, DB_VERSION_NO_CONTAINERS);
+        if (rank2st[mpi_rank] == rebuild_target)
+            receive_shard(pdb, ntargets);
+        else
+            send_shard(pdb, nowners);
+        /* The rebuilt target has exactly the records that need work */
+        if (rank2st[mpi_rank] == rebuild_target)
+            pdb_split(pdb, N_LANES, splits);
+    }
+    MPI_Bcast(splits, (N_LANES - 1)*sizeof(PdbSplit), MPI_BYTE,
+            st2rank[rebuild_target], MPI_COMM_WORLD);
+
+    if (mpi_rank != 0)
+    {
+        /* The rebuilt target doesn't read any parity, and may not have any */
+        ParityContainers containers = { -1, 0, 0 };
+        if (rank2st[mpi_rank] != rebuild_target)
+            containers_open(&containers, hs.read_parity_dir);
+        Lane lanes[N_LANES];
+        void *lane_args[N_LANES];
+        for (int j = 0; j < N_LANES; j++) {
+            lanes[j].lane = j;
+            lanes[j].sample = (ProgressSample)PROGRESS_SAMPLE_INIT;
+            lanes[j].pdb = pdb;
+            container_init(&lanes[j].container, &containers);
+            lane_args[j] = &lanes[j];
+        }
+        clock_gettime(CLOCK_MONOTONIC, &pr_last_report);
+        pdb_iterate_parallel(pdb, N_LANES, splits, do_file, lane_args);
+        for (int j = 0; j < N_LANES; j++)
+            container_close(&lanes[j].container);
+        containers_close(&containers);
         pdb_term(pdb);
 
-        pr_add_tmp_to_total(&pr_sample);
-        pr_report_progress(&pr_sender, pr_sample);
+        ProgressSample last = PROGRESS_SAMPLE_INIT;
+        report_progress(&last, 1);
         pr_report_done(&pr_sender);
     }
     else if (mpi_rank == 0)
@@ -234,6 +473,7 @@ int main(int argc, char **argv)
         pr_receive_loop(ntargets-1);
     }
 
+    free(splits);
     if (mpi_rank != 0)
         close(hs.corrupt_files_fd);
 
@@ -14,6 +14,7 @@
 #include <limits.h>
 #include <err.h>
 #include <syslog.h>
+#include <dirent.h>
 
 /* MAX_OPEN_FILES should match the limit set for the beegfs-storage process. */
 #define MAX_OPEN_FILES              60000
@@ -21,6 +22,21 @@
 #define CHANGELOG_ROTATION_TIME     3600
 #define CHANGELOG_FOLDER            "/dev/shm/beegfs-changelog/"
 
+/* Sealed changelogs are copied to <store>/CHANGELOG_SPILL_SUBDIR on local disk
+ * every CHANGELOG_SPILL_INTERVAL seconds, together with a deduplicated
+ * snapshot of the changelogs that are still being written. That way a reboot
+ * only loses the events of the last interval instead of everything since the
+ * last parity run. */
+#define CHANGELOG_SPILL_INTERVAL    60
+#define CHANGELOG_SPILL_SUBDIR      "changelog"
+#define SPILL_SNAPSHOT_NAME         "dirty-snapshot"
+#define SPILL_TIMESTAMP_NAME        "last-spill"
+#define SPILL_RECOVER_NAME          "recover-since"
+
+/* Every store on the host shares CHANGELOG_FOLDER, so each one leaves a marker
+ * in here the first time its daemon starts after a boot. */
+#define CHANGELOG_STARTED_FOLDER    CHANGELOG_FOLDER "started/"
+
 /* DEBUG must be defined, change to 0 to disable debug info */
 #define DEBUG 0
 
@@ -29,6 +45,7 @@
 /* Operations for the `flock' call. */
 #define    LOCK_SH    1    /* Shared lock.    */
 #define    LOCK_EX    2    /* Exclusive lock. */
+#define    LOCK_NB    4    /* Don't block when locking. */
 #define    LOCK_UN    8    /* Unlock.         */
 
 /* Apply or remove an advisory lock, according to OPERATION,
@@ -38,6 +55,7 @@ extern int flock (int __fd, int __operation);
 /* Initialized once, when library is loaded */
 static char storage_id[PATH_MAX] = {0};
 static char dirpath[PATH_MAX] = {0};
+static char spillpath[PATH_MAX] = {0};
 static int (*_original_openat)(int dirfd, const char *pathname, int flags, mode_t mode);
 static int (*_original_unlinkat)(int dirfd, const char *pathname, int flags);
 static int (*_original_close)(int fd);
@@ -63,8 +81,12 @@ static char pathbuf[MAX_OPEN_FILES*MAX_PATH_LENGTH];
 #define log_debug(...)
 #endif
 
+static void ensure_spill_thread(void);
+
 static
 void write_change(const char *format,...) {
+  ensure_spill_thread();
+
   /* 1. Check whether or not we should start a new file. */
   time_t now = time(NULL);
   if (difftime(now, changelog_create_time) > CHANGELOG_ROTATION_TIME) {
@@ -186,6 +208,318 @@ int close(int fd) {
   return _original_close(fd);
 }
 
+/* Copy `src' to `dst' durably: write to a temporary name, fsync and rename.
+ * If `must_exist' is set the copy is dropped when `must_exist' disappears
+ * while we copy (the parity run cleaned it up under our feet), which isn't
+ * an error as the run has consumed it. */
+static
+int durable_copy(const char *src, const char *dst, const char *must_exist) {
+  char tmp[PATH_MAX];
+  char buf[64*1024];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", dst);
+  FILE *in = fopen(src, "r");
+  if (in == NULL)
+    return (must_exist != NULL && errno == ENOENT)? 0 : -1;
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL) {
+    fclose(in);
+    return -1;
+  }
+  size_t r;
+  int failed = 0;
+  while ((r = fread(buf, 1, sizeof(buf), in)) > 0)
+    if (fwrite(buf, 1, r, out) != r) {
+      failed = 1;
+      break;
+    }
+  if (ferror(in) || fflush(out) != 0 || fsync(fileno(out)) != 0)
+    failed = 1;
+  fclose(in);
+  fclose(out);
+  if (!failed && must_exist != NULL && access(must_exist, F_OK) != 0) {
+    remove(tmp);
+    return 0;
+  }
+  if (failed || rename(tmp, dst) != 0) {
+    remove(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* Builds "<spillpath>/<name><suffix>", returns 0 if it doesn't fit. */
+static
+int __attribute__((noinline)) spill_file(char *buf, const char *name, const char *suffix) {
+  return snprintf(buf, PATH_MAX, "%s/%s%s", spillpath, name, suffix) < PATH_MAX;
+}
+
+/* Changelog lines look like "<timestamp> <type> <path>\n" */
+static
+const char *line_path(const char *line) {
+  return strchr(strchr(line, ' ') + 1, ' ') + 1;
+}
+
+static
+int cmp_lines_by_path(const void *pa, const void *pb) {
+  const char *a = *(const char **)pa;
+  const char *b = *(const char **)pb;
+  int r = strcmp(line_path(a), line_path(b));
+  if (r != 0)
+    return r;
+  /* Same path: order by timestamp, and let 'd' win ties like the parser does */
+  unsigned long long ta = strtoull(a, NULL, 10), tb = strtoull(b, NULL, 10);
+  if (ta != tb)
+    return ta < tb ? -1 : 1;
+  return (int)(strchr(a, ' ')[1] == 'd') - (int)(strchr(b, ' ')[1] == 'd');
+}
+
+/* Collects the lines of every changelog we are still writing to, keeps only
+ * the newest event per path and stores the result as the dirty-set snapshot.
+ * Returns 0 if the snapshot wasn't updated. */
+static
+int write_dirty_snapshot(char **active, int nactive) {
+  char **lines = NULL;
+  size_t nlines = 0, cap = 0;
+  for (int i = 0; i < nactive; i++) {
+    FILE *f = fopen(active[i], "r");
+    /* A log can be cleaned up by a parity run since we listed it */
+    if (f == NULL && errno == ENOENT)
+      continue;
+    if (f == NULL) {
+      log_error("Could not read changelog %s, snapshot not updated", active[i]);
+      for (size_t j = 0; j < nlines; j++)
+        free(lines[j]);
+      free(lines);
+      return 0;
+    }
+    char *line = NULL;
+    size_t len = 0;
+    while (getline(&line, &len, f) > 0) {
+      /* Skip a partially written last line and anything we can't parse */
+      char *sp = strchr(line, ' ');
+      if (line[strlen(line) - 1] != '\n' || sp == NULL || strchr(sp + 1, ' ') == NULL)
+        continue;
+      if (nlines == cap) {
+        size_t new_cap = cap ? 2*cap : 1024;
+        char **grown = realloc(lines, new_cap*sizeof(char *));
+        if (grown == NULL)
+          break;
+        lines = grown;
+        cap = new_cap;
+      }
+      if ((lines[nlines] = strdup(line)) == NULL)
+        break;
+      nlines++;
+    }
+    int short_of_memory = !feof(f);
+    free(line);
+    fclose(f);
+    /* A snapshot with some of the events missing is worse than the old one */
+    if (short_of_memory) {
+      log_error("Out of memory reading changelog %s, snapshot not updated", active[i]);
+      for (size_t j = 0; j < nlines; j++)
+        free(lines[j]);
+      free(lines);
+      return 0;
+    }
+  }
+  qsort(lines, nlines, sizeof(char *), cmp_lines_by_path);
+
+  char tmp[PATH_MAX], dst[PATH_MAX];
+  spill_file(tmp, SPILL_SNAPSHOT_NAME, ".tmp");
+  spill_file(dst, SPILL_SNAPSHOT_NAME, "");
+  int ok = 0;
+  FILE *out = fopen(tmp, "w");
+  if (out != NULL) {
+    /* Lines are sorted oldest first within each path, keep the last one */
+    for (size_t i = 0; i < nlines; i++)
+      if (i + 1 == nlines || strcmp(line_path(lines[i]), line_path(lines[i+1])) != 0)
+        fputs(lines[i], out);
+    ok = fflush(out) == 0 && fsync(fileno(out)) == 0;
+    fclose(out);
+    ok = ok && rename(tmp, dst) == 0;
+  }
+  if (!ok)
+    log_error("Could not write changelog snapshot %s", dst);
+  for (size_t i = 0; i < nlines; i++)
+    free(lines[i]);
+  free(lines);
+  return ok;
+}
+
+static
+void spill_changelogs(void) {
+  DIR *dir = opendir(CHANGELOG_FOLDER);
+  if (dir == NULL)
+    return;
+  time_t started = time(NULL);
+  size_t id_len = strlen(storage_id);
+  char **active = NULL;
+  int nactive = 0, active_cap = 0;
+  int short_of_memory = 0;
+  /* Set when a log or the snapshot didn't make it to disk */
+  int incomplete = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    /* Only our own store, and never the per-thread file we are writing to */
+    if (strncmp(ent->d_name, storage_id, id_len) != 0 || ent->d_name[id_len] != '-')
+      continue;
+    char src[PATH_MAX], dst[PATH_MAX];
+    snprintf(src, sizeof(src), "%s/%s", CHANGELOG_FOLDER, ent->d_name);
+    if (!spill_file(dst, ent->d_name, "")) {
+      incomplete = 1;
+      continue;
+    }
+    FILE *f = fopen(src, "r");
+    if (f == NULL) {
+      incomplete |= errno != ENOENT;
+      continue;
+    }
+    /* The writing thread holds an exclusive lock until the log is rotated.
+     * A log younger than the rotation time might not have been locked yet. */
+    long created = strtol(ent->d_name + id_len + 1, NULL, 10);
+    int sealed = difftime(started, created) > CHANGELOG_ROTATION_TIME
+      && flock(fileno(f), LOCK_EX | LOCK_NB) == 0;
+    fclose(f);
+    if (!sealed) {
+      if (nactive == active_cap) {
+        int new_cap = active_cap ? 2*active_cap : 64;
+        char **grown = realloc(active, new_cap*sizeof(char *));
+        if (grown == NULL) {
+          short_of_memory = 1;
+          continue;
+        }
+        active = grown;
+        active_cap = new_cap;
+      }
+      if ((active[nactive] = strdup(src)) == NULL)
+        short_of_memory = 1;
+      else
+        nactive++;
+    }
+    else if (access(dst, F_OK) != 0 && durable_copy(src, dst, src) != 0) {
+      log_error("Could not spill changelog %s", src);
+      incomplete = 1;
+    }
+  }
+  closedir(dir);
+
+  if (short_of_memory) {
+    log_error("Out of memory listing changelogs, snapshot not updated");
+    incomplete = 1;
+  }
+  else if (!write_dirty_snapshot(active, nactive))
+    incomplete = 1;
+  for (int i = 0; i < nactive; i++)
+    free(active[i]);
+  free(active);
+
+  /* Everything logged before `started' is now on disk, unless something
+   * failed. Then the next reboot has to recover from the older spill. */
+  if (incomplete)
+    return;
+  char tmp[PATH_MAX], dst[PATH_MAX];
+  spill_file(tmp, SPILL_TIMESTAMP_NAME, ".tmp");
+  spill_file(dst, SPILL_TIMESTAMP_NAME, "");
+  FILE *f = fopen(tmp, "w");
+  if (f != NULL) {
+    fprintf(f, "%ld\n", (long)started);
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+    rename(tmp, dst);
+  }
+}
+
+static
+void *spill_thread(void *arg) {
+  (void)arg;
+  for (;;) {
+    sleep(CHANGELOG_SPILL_INTERVAL);
+    spill_changelogs();
+  }
+  return NULL;
+}
+
+/* The daemon forks after we are loaded and the constructor's threads don't
+ * follow it, so the spill thread is started by the first event of each
+ * process instead. */
+static pid_t spill_thread_pid = 0;
+
+static
+void ensure_spill_thread(void) {
+  pid_t me = getpid();
+  pid_t seen = spill_thread_pid;
+  /* No lock, one held across the fork would never be released in the child */
+  if (seen == me || !__sync_bool_compare_and_swap(&spill_thread_pid, seen, me))
+    return;
+  pthread_t spiller;
+  if (pthread_create(&spiller, NULL, spill_thread, NULL) != 0)
+    log_error("Could not start changelog spill thread, changes are only kept in memory");
+  else
+    pthread_detach(spiller);
+}
+
+/* Returns 1 the first time the daemon of our store starts after a boot, as
+ * /dev/shm is empty after a reboot. */
+static
+int first_start_since_boot(void) {
+  char marker[PATH_MAX];
+  if (mkdir(CHANGELOG_STARTED_FOLDER, S_IRUSR | S_IWUSR | S_IXUSR) != 0 && errno != EEXIST)
+    err(1, "Could not create changelog folder '%s'", CHANGELOG_STARTED_FOLDER);
+  if (snprintf(marker, sizeof(marker), "%s/%s", CHANGELOG_STARTED_FOLDER, storage_id) >= PATH_MAX)
+    errx(1, "Store name '%s' is too long", storage_id);
+  if (mkdir(marker, S_IRUSR | S_IWUSR | S_IXUSR) == 0)
+    return 1;
+  if (errno != EEXIST)
+    err(1, "Could not create changelog marker '%s'", marker);
+  return 0;
+}
+
+/* Called when the machine has been rebooted and every event after the last
+ * spill is gone. We leave a marker with the time of the last spill, so the next
+ * partial run can look for chunks modified after that point instead of having
+ * to do a complete run. Without any spill we don't know when the events start,
+ * so the marker makes it look at every chunk. */
+static
+void mark_recovery_point(void) {
+  char last[PATH_MAX], recover[PATH_MAX];
+  spill_file(last, SPILL_TIMESTAMP_NAME, "");
+  spill_file(recover, SPILL_RECOVER_NAME, "");
+
+  /* The snapshot of the logs we were writing is about to be replaced by one
+   * of the new logs, keep it as a spilled log of its own */
+  char snapshot[PATH_MAX], kept[PATH_MAX];
+  char kept_name[PATH_MAX];
+  int fits = snprintf(kept_name, sizeof(kept_name), "%s-%ld-snapshot",
+      storage_id, (long)time(NULL)) < PATH_MAX;
+  spill_file(snapshot, SPILL_SNAPSHOT_NAME, "");
+  if (fits && spill_file(kept, kept_name, "")
+      && rename(snapshot, kept) != 0 && errno != ENOENT)
+    log_error("Could not keep changelog snapshot %s", snapshot);
+
+  /* An older marker that hasn't been consumed yet goes further back */
+  if (access(recover, F_OK) == 0)
+    return;
+  if (access(last, F_OK) != 0) {
+    char tmp[PATH_MAX];
+    spill_file(tmp, SPILL_RECOVER_NAME, ".tmp");
+    FILE *f = fopen(tmp, "w");
+    int ok = f != NULL && fputs("0\n", f) >= 0 && fflush(f) == 0
+      && fsync(fileno(f)) == 0;
+    if (f != NULL)
+      fclose(f);
+    if (ok && rename(tmp, recover) == 0)
+      log_info("Changelog lost in reboot and never spilled, partial run will check every chunk");
+    else
+      log_error("Changelog lost in reboot, and could not write %s", recover);
+  }
+  else if (durable_copy(last, recover, NULL) == 0)
+    log_info("Changelog lost in reboot, partial run will recover from %s", last);
+  else
+    log_error("Changelog lost in reboot, and could not write %s", recover);
+}
+
 static void __attribute__((constructor)) init(void) {
   const char *store = getenv("BP_STORE");
   if (store == NULL) {
@@ -194,12 +528,19 @@ static void __attribute__((constructor)) init(void) {
   snprintf(dirpath, PATH_MAX, "/%s/chunks", store);
   strncpy(storage_id, store, PATH_MAX-1);
 
+  snprintf(spillpath, PATH_MAX, "/%s/%s", store, CHANGELOG_SPILL_SUBDIR);
+
   int retval = mkdir(CHANGELOG_FOLDER, S_IRUSR | S_IWUSR | S_IXUSR);
   // If log-dir creation fails for any other reason than folder-exists, exit.
   if (retval != 0 && errno != EEXIST) {
     err(1, "Could not create changelog folder '%s'", CHANGELOG_FOLDER);
   }
 
+  retval = mkdir(spillpath, S_IRUSR | S_IWUSR | S_IXUSR);
+  if (retval != 0 && errno != EEXIST) {
+    err(1, "Could not create changelog spill folder '%s'", spillpath);
+  }
+
   log_info("BeeGFS changelogger library injected");
 
   _original_openat = dlsym(RTLD_NEXT, "openat64");
@@ -211,4 +552,7 @@ static void __attribute__((constructor)) init(void) {
           || _original_close == NULL) {
       errx(1, "Cannot load original functions, we are really screwed!\n");
   }
+
+  if (first_start_since_boot())
+    mark_recovery_point();
 }
@@ -13,6 +13,11 @@ chunks_modified = {}
 
 FILEMOD_PATH = "/dev/shm/beegfs-changelog"
 
+# Files the changelogger keeps in its spill folder next to the spilled logs
+SPILL_TIMESTAMP = "last-spill"
+SPILL_RECOVER = "recover-since"
+SPILL_SNAPSHOT = "dirty-snapshot"
+
 def get_files(path, store):
     for (dirpath, dirnames, filenames) in os.walk(path):
         for name in filenames:
@@ -76,7 +81,24 @@ def parse(file,store):
     return valid_entries
 
 
-def construct_chunkmod_data(path, store, deletable_files):
+def find_modified_since(store, since):
+    ''' Used after a reboot lost the in-memory changelog: every chunk modified
+        after the last spill is reported as modified.'''
+
+    start = len(store)
+    entries = []
+    for (dirpath, dirnames, filenames) in os.walk(store):
+        for name in filenames:
+            path = os.path.join(dirpath, name)
+            try:
+                stat = os.stat(path)
+            except OSError:
+                continue
+            if stat.st_mtime >= since:
+                entries.append((int(stat.st_mtime),'m',path[start:],stat.st_size))
+    return entries
+
+def construct_chunkmod_data(path, store, deletable_files, spill_dir):
     for filename in get_files(path, store):
         with open(filename,'r') as f:
             entries = parse(f, store)
@@ -86,25 +108,62 @@ def construct_chunkmod_data(path, store, deletable_files):
                     fcntl.flock(f.fileno(), fcntl.LOCK_EX | fcntl.LOCK_NB)
                     # The file-lock was available, it is safe to delete this file
                     deletable_files.write(filename + "\n")
+                    # ... and the copy the changelogger spilled to disk
+                    if spill_dir:
+                        spilled = os.path.join(spill_dir, os.path.basename(filename))
+                        if os.path.exists(spilled):
+                            deletable_files.write(spilled + "\n")
                 except IOError:
                     pass
 
+    if spill_dir and os.path.isdir(spill_dir):
+        for filename in get_files(spill_dir, store):
+            name = os.path.basename(filename)
+            # Still in memory, so it has already been read above
+            if os.path.exists(os.path.join(path, name)):
+                continue
+            if name == SPILL_TIMESTAMP or name.endswith(".tmp"):
+                continue
+            if name == SPILL_SNAPSHOT:
+                # The changelogger rewrites it all the time, so it is never
+                # ours to delete
+                with open(filename,'r') as f:
+                    insert(parse(f, store))
+            elif name == SPILL_RECOVER:
+                # A new marker could show up during the run, so it is only
+                # deleted if it still says what we read
+                contents = open(filename).read().strip()
+                insert(find_modified_since(store, int(contents or 0)))
+                deletable_files.write(filename + "\t" + contents + "\n")
+            else:
+                with open(filename,'r') as f:
+                    insert(parse(f, store))
+                deletable_files.write(filename + "\n")
+
     write_to_stdout()
 
 def cleanup_until(targets):
+    ''' Every line is a file to delete, optionally followed by a tab and the
+        contents it must still have.'''
+
     for line in open(targets):
         try:
-            os.unlink(line.strip())
+            fields = line.rstrip("\n").split("\t", 1)
+            if len(fields) == 2 and open(fields[0]).read().strip() != fields[1]:
+                continue
+            os.unlink(fields[0])
         except:
             pass
 
 
 def main():
-    parser = optparse.OptionParser(usage="""Usage: %prog --deletable <file> --store <store prefix> [--cleanup]"
+    parser = optparse.OptionParser(usage="""Usage: %prog --deletable <file> --store <store prefix> [--spill-dir <dir>] [--cleanup]"
 
 %prog constructs a list of files that have been modified.
 It does this by looking at the logs files generated by a LD_PRELOAD'ed
 change-logger module for the beegfs-storage daemon.
+Logs the change-logger has spilled to --spill-dir are read as well, so events
+survive a reboot of the storage server.
 
 The output format is constructed to be easy parseable in C.
 Format: <time><type><len><str>
@@ -120,6 +179,8 @@ Format: <time><type><len><str>
                       help="Store a list of files that are safe to delete here", metavar="FILE")
     parser.add_option("-s", "--store", dest="store"  , type="string",
                       help="Store to work on", metavar="STORE")
+    parser.add_option("-p", "--spill-dir", dest="spill_dir", type="string",
+                      help="Folder with changelogs spilled to disk", metavar="DIR")
     parser.add_option("-c", "--cleanup" , dest="cleanup", action="store_true",
                       default=False, help="Delete the files")
 
@@ -138,7 +199,7 @@ Format: <time><type><len><str>
             options.store = "/"+options.store
 
         deletable_files = open(options.del_f, "a")
-        construct_chunkmod_data(FILEMOD_PATH, options.store, deletable_files)
+        construct_chunkmod_data(FILEMOD_PATH, options.store, deletable_files, options.spill_dir)
 
 if __name__ == "__main__":
     main()
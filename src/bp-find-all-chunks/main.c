@@ -1,3 +1,7 @@
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <sys/types.h>
@@ -6,22 +10,15 @@
 #include <sys/stat.h>
 #include <dirent.h>
 
-#include <ftw.h>
-
 #define MODIFY_EVENT 'm'
 #define UNLINK_EVENT 'd'
 
 char buffer[64*1024] = {0};
 int buffer_written = 0;
 
-int visitor(const char *fpath, const struct stat *sb, int typeflag)
+void visitor(const char *fpath, const struct stat *sb)
 {
-    if (typeflag != FTW_F)
-        return 0;
     size_t len = strlen(fpath);
-    /* Skip './' in each path */
-    fpath += 2;
-    len -= 2;
     size_t fields[4] = {sb->st_mtime, sb->st_size, MODIFY_EVENT, len};
     if (sizeof(fields) + len + buffer_written >= sizeof(buffer)) {
         write(1, buffer, buffer_written);
@@ -31,7 +28,57 @@ int visitor(const char *fpath, const struct stat *sb, int typeflag)
     buffer_written += sizeof(fields);
     memcpy(buffer + buffer_written, fpath, len);
     buffer_written += len;
-    return 0;
+}
+
+/*
+ * Byte order, not the locale, so every storage target lists its chunks in the
+ * same order. bp-parity-gen relies on that to know when a file has been seen
+ * on all targets.
+ */
+int cmp_names(const struct dirent **a, const struct dirent **b)
+{
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+int skip_dots(const struct dirent *d)
+{
+    return strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0;
+}
+
+/* Depth first walk, visiting the entries of each folder in sorted order */
+void walk(int dir_fd, char *path, size_t path_len)
+{
+    struct dirent **entries;
+    int n = scandirat(dir_fd, ".", &entries, skip_dots, cmp_names);
+    if (n < 0)
+        return;
+    for (int i = 0; i < n; i++) {
+        const char *name = entries[i]->d_name;
+        size_t name_len = strlen(name);
+        struct stat sb;
+        if (path_len + name_len + 2 >= PATH_MAX
+                || fstatat(dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+            free(entries[i]);
+            continue;
+        }
+        size_t len = path_len;
+        if (len > 0)
+            path[len++] = '/';
+        memcpy(path + len, name, name_len + 1);
+        len += name_len;
+        if (S_ISDIR(sb.st_mode)) {
+            int sub_fd = openat(dir_fd, name, O_DIRECTORY | O_RDONLY);
+            if (sub_fd >= 0) {
+                walk(sub_fd, path, len);
+                close(sub_fd);
+            }
+        }
+        else if (S_ISREG(sb.st_mode))
+            visitor(path, &sb);
+        path[path_len] = '\0';
+        free(entries[i]);
+    }
+    free(entries);
 }
 
 int main(int argc, char **argv)
@@ -39,8 +86,12 @@ int main(int argc, char **argv)
     if (argc != 2) {
         return 1;
     }
-    chdir(argv[1]);
-    ftw(".", visitor, 100);
+    int dir_fd = open(argv[1], O_DIRECTORY | O_RDONLY);
+    if (dir_fd < 0)
+        return 1;
+    static char path[PATH_MAX] = {0};
+    walk(dir_fd, path, 0);
+    close(dir_fd);
     write(1, buffer, buffer_written);
     return 0;
 }
@@ -0,0 +1,164 @@
+/*
+ * Compares the phase 1 path index of bp-parity-gen (file_info_hash.c) with
+ * the khash based version it replaced.
+ *
+ *   ./fih-bench [unique paths] [times each path is seen]
+ *
+ * The paths look like BeeGFS chunk paths and are fed in a shuffled order, in
+ * groups the size of a typical received MPI buffer - the same way an eater
+ * sees them in phase 1. Defaults to 25M paths seen twice each.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../../src/beegfs-raid5/gen/file_info_hash.h"
+#include "khash.h"
+
+/* Roughly what fits in one 10MiB buffer from a feeder */
+#define GROUP_SIZE (150*1000)
+
+KHASH_MAP_INIT_STR(old, size_t)
+
+/* The lookup as it was done before, including the copy in to the arena */
+static size_t old_lookup(khash_t(old) *h, char *arena, size_t *arena_used, const char *key, size_t key_len, int *is_new)
+{
+    char *n = arena + *arena_used;
+    memcpy(n, key, key_len);
+    n[key_len] = '\0';
+    *arena_used += key_len + 1;
+    khint_t it = kh_get(old, h, n);
+    if (it != kh_end(h)) {
+        *arena_used -= key_len + 1;
+        *is_new = 0;
+        return kh_val(h, it);
+    }
+    size_t val = kh_size(h);
+    int r;
+    it = kh_put(old, h, n, &r);
+    kh_val(h, it) = val;
+    *is_new = 1;
+    return val;
+}
+
+static uint64_t rng_state = 0x853c49e6748fea9bULL;
+static uint32_t next_random(void)
+{
+    uint64_t x = rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng_state = x;
+    return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    size_t nkeys = (argc > 1)? strtoull(argv[1], NULL, 10) : 25000000;
+    size_t dups = (argc > 2)? strtoull(argv[2], NULL, 10) : 2;
+    size_t nlookups = nkeys * dups;
+
+    /* Generate the paths */
+    size_t *offsets = malloc((nkeys + 1) * sizeof(size_t));
+    char *paths = malloc(nkeys * 48);
+    size_t path_bytes = 0;
+    for (size_t i = 0; i < nkeys; i++) {
+        offsets[i] = path_bytes;
+        path_bytes += sprintf(paths + path_bytes, "u%x/%02X/%02X/%X-%X-%u",
+                next_random() % 4096, next_random() % 128, next_random() % 128,
+                next_random(), (unsigned)i, next_random() % 64 + 1);
+    }
+    offsets[nkeys] = path_bytes;
+
+    /* Every path is seen `dups` times, in a shuffled order */
+    uint32_t *order = malloc(nlookups * sizeof(uint32_t));
+    for (size_t i = 0; i < nlookups; i++)
+        order[i] = i % nkeys;
+    for (size_t i = nlookups - 1; i > 0; i--) {
+        size_t j = (((uint64_t)next_random() << 32) | next_random()) % (i + 1);
+        uint32_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    printf("%zu paths (%.1f MiB), %zu lookups\n", nkeys, path_bytes / (1024.0*1024.0), nlookups);
+
+    /* Old: khash with char* keys in to a flat arena */
+    uint64_t old_check = 0;
+    {
+        khash_t(old) *h = kh_init(old);
+        char *arena = malloc(path_bytes + nkeys);
+        size_t arena_used = 0;
+        double t0 = now();
+        for (size_t i = 0; i < nlookups; i++) {
+            size_t k = order[i];
+            int is_new;
+            size_t val = old_lookup(h, arena, &arena_used, paths + offsets[k], offsets[k+1] - offsets[k], &is_new);
+            old_check = old_check * 31 + val + is_new;
+        }
+        double t1 = now();
+        size_t mem = h->n_buckets * (sizeof(char *) + sizeof(size_t) + 1.0/4) + arena_used;
+        printf("khash fih_get_or_create: %7.2f s  %6.1f ns/lookup  %7.1f MiB\n",
+                t1 - t0, 1e9 * (t1 - t0) / nlookups, mem / (1024.0*1024.0));
+        kh_destroy(old, h);
+        free(arena);
+    }
+
+    const char **keys = malloc(GROUP_SIZE * sizeof(char *));
+    size_t *key_lens = malloc(GROUP_SIZE * sizeof(size_t));
+    size_t *vals = malloc(GROUP_SIZE * sizeof(size_t));
+    int *status = malloc(GROUP_SIZE * sizeof(int));
+
+    /* New: one key at a time */
+    uint64_t single_check = 0;
+    {
+        FileInfoHash *fih = fih_init();
+        double t0 = now();
+        for (size_t i = 0; i < nlookups; i++) {
+            size_t k = order[i];
+            size_t val;
+            int is_new = fih_get_or_create(fih, paths + offsets[k], offsets[k+1] - offsets[k], &val);
+            single_check = single_check * 31 + val + is_new;
+        }
+        double t1 = now();
+        printf("open addressing, single: %7.2f s  %6.1f ns/lookup  %7.1f MiB\n",
+                t1 - t0, 1e9 * (t1 - t0) / nlookups, fih_memory_use(fih) / (1024.0*1024.0));
+        fih_term(fih);
+    }
+
+    /* New: a received buffer at a time */
+    uint64_t many_check = 0;
+    {
+        FileInfoHash *fih = fih_init();
+        double t0 = now();
+        for (size_t first = 0; first < nlookups; first += GROUP_SIZE) {
+            size_t n = (nlookups - first < GROUP_SIZE)? nlookups - first : GROUP_SIZE;
+            for (size_t j = 0; j < n; j++) {
+                size_t k = order[first + j];
+                keys[j] = paths + offsets[k];
+                key_lens[j] = offsets[k+1] - offsets[k];
+            }
+            fih_get_or_create_many(fih, n, keys, key_lens, vals, status);
+            for (size_t j = 0; j < n; j++)
+                many_check = many_check * 31 + vals[j] + (status[j] == FIH_NEW);
+        }
+        double t1 = now();
+        printf("open addressing, many:   %7.2f s  %6.1f ns/lookup  %7.1f MiB\n",
+                t1 - t0, 1e9 * (t1 - t0) / nlookups, fih_memory_use(fih) / (1024.0*1024.0));
+        fih_term(fih);
+    }
+
+    if (old_check != single_check || old_check != many_check) {
+        printf("Results differ!\n");
+        return 1;
+    }
+    return 0;
+}